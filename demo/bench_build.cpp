@@ -0,0 +1,120 @@
+// 建树耗时基准: 随机生成一批表达式, 分别统计解析/展开/规范化与CreateTree的速度
+// 用法: bench_build [表达式数量=20000] [随机种子=1]
+#include "factor_tree/factortree.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace factor_tree;
+
+namespace {
+
+// 随机表达式生成器, 算子和字段的组合接近挖掘出的因子
+class ExprGenerator {
+public:
+  explicit ExprGenerator(unsigned seed) : gen_(seed) {}
+
+  std::string Generate(int depth) {
+    std::uniform_int_distribution<int> kind(0, depth <= 0 ? 0 : 4);
+    switch (kind(gen_)) {
+    case 0:
+      return Pick(fields_);
+    case 1:
+      return Pick(unary_) + "(" + Generate(depth - 1) + ")";
+    case 2:
+      return Pick(ts_) + "(" + Generate(depth - 1) + "," + Window() + ")";
+    case 3:
+      return Pick(binary_) + "(" + Generate(depth - 1) + "," +
+             Generate(depth - 1) + ")";
+    default:
+      return Pick(cs_) + "(" + Generate(depth - 1) + ")";
+    }
+  }
+
+private:
+  const std::string &Pick(const std::vector<std::string> &names) {
+    std::uniform_int_distribution<size_t> dis(0, names.size() - 1);
+    return names[dis(gen_)];
+  }
+
+  std::string Window() {
+    static const int windows[] = {1, 3, 5, 10, 20, 60};
+    std::uniform_int_distribution<size_t> dis(0, 5);
+    return std::to_string(windows[dis(gen_)]);
+  }
+
+  std::mt19937 gen_;
+  std::vector<std::string> fields_{"@open",  "@high", "@low",
+                                   "@close", "@volume", "@amount"};
+  std::vector<std::string> unary_{"abs", "log1p", "sign", "minus", "power2"};
+  std::vector<std::string> ts_{"ts_mean", "ts_std",  "ts_diff", "ts_delay",
+                               "ts_rank", "ts_zscore", "ts_rs", "ts_wave"};
+  std::vector<std::string> binary_{"add", "subtract", "multiply", "divide"};
+  std::vector<std::string> cs_{"cs_rank", "cs_zscore", "cs_demean"};
+};
+
+template <typename Fn> double Seconds(Fn fn) {
+  auto begin = std::chrono::steady_clock::now();
+  fn();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+void Report(const char *name, size_t count, double seconds) {
+  std::cout << name << ": " << seconds * 1e3 << " ms, "
+            << static_cast<double>(count) / seconds << " 表达式/秒"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+  const unsigned seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+
+  ExprGenerator generator(seed);
+  std::vector<std::string> expressions;
+  expressions.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    expressions.push_back(generator.Generate(5));
+  }
+  std::cout << "表达式数量: " << count << std::endl;
+
+  size_t nodes = 0;
+  Report("解析", count, Seconds([&] {
+           for (const auto &expr : expressions) {
+             nodes += ParseExprTree(expr).args.size();
+           }
+         }));
+
+  BuildOptions options;
+  options.inline_combined_ops = true;
+  options.canonicalize = true;
+  const CombExpander &expander = LibraryCombExpander();
+  std::vector<std::string> prepared(count);
+  Report("展开+规范化", count, Seconds([&] {
+           for (size_t i = 0; i < count; ++i) {
+             prepared[i] = PrepareExpression(expressions[i], options,
+                                             &expander);
+           }
+         }));
+
+  InitArgs args(5000);
+  Report("CreateTree", count, Seconds([&] {
+           for (const auto &expr : expressions) {
+             FactorTree tree(args);
+             tree.CreateTree(expr);
+           }
+         }));
+  Report("CreateTree(展开+规范化)", count, Seconds([&] {
+           for (const auto &expr : expressions) {
+             FactorTree tree(args);
+             tree.CreateTree(expr, options);
+           }
+         }));
+  return nodes > 0 ? 0 : 1;
+}
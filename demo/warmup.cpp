@@ -0,0 +1,72 @@
+// 用.npy历史数据预热计算树, 输出吞吐, 可选保存checkpoint供开盘时直接加载
+// 给出输出目录时同时回补因子值, 写入<输出目录>/factor/*.npy
+// 用法: warmup <历史数据目录> <表达式> [checkpoint文件|-] [输出目录]
+// 目录布局见factor_tree/warmup.h
+// 设置环境变量FACTOR_TREE_PROFILE时额外输出最耗时的节点
+#include "factor_tree/warmup.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+using namespace factor_tree;
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0]
+              << " <history_dir> <expression> [checkpoint] [output_dir]"
+              << std::endl;
+    return 1;
+  }
+  NpyHistory history(argv[1]);
+
+  //   nstock取第一块的列数, batch_per_day取最长的一天
+  //   没有day_starts.npy时整段历史是同一天, 不能按它分配ad_*的时间槽
+  //   (历史长度 x 窗口 x nstock), 保留默认值
+  InitArgs args(history.LoadChunk(0)[0].shape()[1]);
+  if (history.HasDayStarts()) {
+    const auto &day_starts = history.DayStarts();
+    //   最后一天到历史末尾为止
+    const size_t total_rows = history.NumRows();
+    for (size_t d = 0; d < day_starts.size(); ++d) {
+      size_t end = d + 1 < day_starts.size() ? day_starts[d + 1] : total_rows;
+      args.batch_per_day = std::max(args.batch_per_day, end - day_starts[d]);
+    }
+  } else {
+    std::cerr << "没有" << NpyHistory::kDayStartsFile
+              << ", 整段历史视为同一天, batch_per_day保留默认值"
+              << args.batch_per_day << ", 含ad_*算子的表达式需要提供它"
+              << std::endl;
+  }
+
+  FactorTree tree(args);
+  tree.CreateTree(argv[2]);
+  std::cout << "字段:";
+  for (const auto &field : history.Fields()) {
+    std::cout << " " << field;
+  }
+  std::cout << std::endl;
+
+  std::unique_ptr<OutputSink> sink;
+  if (argc > 4) {
+    sink = std::make_unique<OutputSink>(argv[4], args.nstock, 4096);
+  }
+  const bool profile = std::getenv("FACTOR_TREE_PROFILE") != nullptr;
+  OpProfiler::Instance().SetEnabled(profile);
+  WarmupReport report = WarmUp(tree, history, sink.get(), "factor");
+  if (sink) {
+    sink->Close();
+  }
+  std::cout << "预热: " << report.ToString() << std::endl;
+  if (profile) {
+    std::cout << "最耗时的节点:\n" << FormatProfile(tree.Profile(20));
+  }
+
+  if (argc > 3 && std::string(argv[3]) != "-") {
+    tree.SaveMappedCheckpoint(argv[3]);
+    std::cout << "checkpoint: " << argv[3] << std::endl;
+  }
+  return 0;
+}
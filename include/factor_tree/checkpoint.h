@@ -0,0 +1,982 @@
+#pragma once
+
+#include "mappedfile.h"
+#include "operators/baseoperator.h"
+#include "threadpool.h"
+
+#include <cereal/types/string.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace factor_tree {
+
+// 按节点保存的checkpoint: 每个有状态的节点只写一次, 以OperatorId为键
+// 与逐层递归的SaveCheckpoint相比, 被多个父节点共享的子树不会重复写入
+// 按节点拆分只对header_ops算子手工组装的树有效: 库中编译的算子不登记子节点,
+// CreateTree建出的树只有根节点一项, 由根节点的SaveCheckpoint递归保存整棵树,
+// 内容与FactorTree::SaveCheckpoint相同, 共享子树仍会重复写入. 本文件中的
+// 其他格式(mmap、增量、按子表达式)同样以节点为单位, 限制相同
+//
+// 格式(cereal binary):
+//   magic, version, 节点数
+//   每个节点: OperatorId, OperatorType, 状态数据
+// 状态数据单独成块, 加载时先校验节点再解析
+constexpr const char *kDagCheckpointMagic = "FTDAGCKPT";
+constexpr uint32_t kDagCheckpointVersion = 1;
+
+// 单独保存状态的节点: DagOp按HasState; 没有DagOp的节点(库中编译的算子、
+// 组合算子)用它自己的SaveCheckpoint/LoadCheckpoint保存整棵子树, 不能确定
+// 它有没有状态, 除数据节点外都保存
+inline bool HasNodeState(const OperatorPtr &op) {
+  const DagOp *dag = AsDagOp(op.get());
+  return dag != nullptr ? dag->HasState() : !op->IsInputDataOp();
+}
+
+inline void SaveNodeState(const OperatorPtr &op,
+                          cereal::BinaryOutputArchive &ar) {
+  if (const DagOp *dag = AsDagOp(op.get())) {
+    dag->SaveState(ar);
+  } else {
+    op->SaveCheckpoint(ar);
+  }
+}
+
+inline void LoadNodeState(const OperatorPtr &op,
+                          cereal::BinaryInputArchive &ar) {
+  if (DagOp *dag = AsDagOp(op.get())) {
+    dag->LoadState(ar);
+  } else {
+    op->LoadCheckpoint(ar);
+  }
+}
+
+// 收集有状态的节点, 按子节点先于父节点的顺序
+inline std::vector<OperatorPtr> CollectStatefulOps(const OperatorPtr &root) {
+  std::vector<OperatorPtr> ops;
+  ForEachUniqueOp(root, [&ops](const OperatorPtr &op) {
+    if (HasNodeState(op)) {
+      ops.push_back(op);
+    }
+  });
+  return ops;
+}
+
+inline void SaveDagCheckpoint(const OperatorPtr &root, std::ostream &os) {
+  auto ops = CollectStatefulOps(root);
+  cereal::BinaryOutputArchive ar(os);
+  ar(std::string(kDagCheckpointMagic), kDagCheckpointVersion,
+     static_cast<uint64_t>(ops.size()));
+  std::ostringstream buffer;
+  for (const auto &op : ops) {
+    buffer.str("");
+    {
+      cereal::BinaryOutputArchive state_ar(buffer);
+      SaveNodeState(op, state_ar);
+    }
+    ar(static_cast<uint64_t>(op->GetOperatorId()),
+       static_cast<int>(op->GetType()), buffer.str());
+  }
+}
+
+// 有状态节点按OperatorId建索引, 加载时据此查找
+inline std::unordered_map<uint64_t, OperatorPtr>
+IndexStatefulOps(const OperatorPtr &root) {
+  std::unordered_map<uint64_t, OperatorPtr> ops;
+  for (auto &op : CollectStatefulOps(root)) {
+    if (!ops.emplace(op->GetOperatorId(), op).second) {
+      throw std::runtime_error("duplicate operator id " +
+                               std::to_string(op->GetOperatorId()));
+    }
+  }
+  return ops;
+}
+
+// 树的结构需要与保存时一致: 节点数、OperatorId和算子类型逐一校验
+inline void LoadDagCheckpoint(const OperatorPtr &root, std::istream &is) {
+  auto ops = IndexStatefulOps(root);
+  cereal::BinaryInputArchive ar(is);
+  std::string magic;
+  uint32_t version = 0;
+  uint64_t count = 0;
+  ar(magic, version, count);
+  if (magic != kDagCheckpointMagic || version != kDagCheckpointVersion) {
+    throw std::runtime_error("unsupported checkpoint format");
+  }
+  if (count != ops.size()) {
+    throw std::runtime_error("checkpoint has " + std::to_string(count) +
+                             " stateful nodes, tree has " +
+                             std::to_string(ops.size()));
+  }
+  std::string state;
+  for (uint64_t k = 0; k < count; ++k) {
+    uint64_t op_id = 0;
+    int type = 0;
+    ar(op_id, type, state);
+    auto it = ops.find(op_id);
+    if (it == ops.end() || static_cast<int>(it->second->GetType()) != type) {
+      throw std::runtime_error("checkpoint node " + std::to_string(op_id) +
+                               " does not match the tree");
+    }
+    std::istringstream buffer(state);
+    cereal::BinaryInputArchive state_ar(buffer);
+    LoadNodeState(it->second, state_ar);
+  }
+}
+
+// 页对齐、按偏移索引的checkpoint, 加载时mmap整个文件
+// 每个节点的状态从页边界开始, 直接从映射的内存解析, 数组整块拷贝进状态,
+// 不经过文件流; 节点之间互不依赖, 保存和加载都可以多线程
+// 多线程只对DagOp节点有效: CreateTree建出的树只有根节点一项, 由一个线程
+// 递归加载整棵树, nthread不起作用
+//
+// 文件布局:
+//   MappedCheckpointHeader
+//   MappedCheckpointEntry[count]
+//   状态数据, 每块的起始偏移按kCheckpointPageSize对齐
+constexpr char kMappedCheckpointMagic[8] = {'F', 'T', 'M', 'C',
+                                            'K', 'P', 'T', '\0'};
+constexpr uint32_t kMappedCheckpointVersion = 4;
+constexpr uint64_t kCheckpointPageSize = 4096;
+
+struct MappedCheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint64_t count;
+  //   保存时根节点的RequestIdx
+  uint64_t request_idx;
+  //   每次写出完整checkpoint时随机生成, 增量按它确认基准是同一个文件
+  uint64_t base_id;
+  //   状态的长度和时间槽与这两项有关, 不同时不能恢复
+  uint64_t nstock;
+  uint64_t batch_per_day;
+};
+
+struct MappedCheckpointEntry {
+  uint64_t op_id;
+  int32_t type;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// 只读的内存流, cereal直接从映射的内存读取
+class MemoryStreamBuf : public std::streambuf {
+public:
+  MemoryStreamBuf(const char *data, size_t size) {
+    char *begin = const_cast<char *>(data);
+    setg(begin, begin, begin + size);
+  }
+};
+
+// 追加写入std::string的输出流, 写完直接move走, 不像ostringstream多拷贝一次
+class StringStreamBuf : public std::streambuf {
+public:
+  std::string Take() { return std::move(data_); }
+
+protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    data_.append(s, static_cast<size_t>(n));
+    return n;
+  }
+  int_type overflow(int_type ch) override {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      data_.push_back(traits_type::to_char_type(ch));
+    }
+    return traits_type::not_eof(ch);
+  }
+
+private:
+  std::string data_;
+};
+
+inline uint64_t AlignToPage(uint64_t offset) {
+  return (offset + kCheckpointPageSize - 1) / kCheckpointPageSize *
+         kCheckpointPageSize;
+}
+
+// 某个RequestIdx时刻全部有状态节点的内存快照, 写文件可以放到后台
+struct StateSnapshot {
+  uint64_t request_idx = 0;
+  uint64_t nstock = 0;
+  uint64_t batch_per_day = 0;
+  std::vector<MappedCheckpointEntry> entries;
+  std::vector<std::string> blobs;
+};
+
+// 状态对象的拷贝, 序列化推迟到SerializeStates
+// writers[k]为空时节点没有可拷贝的状态对象, blobs[k]是已经序列化的数据
+struct StateCopies {
+  uint64_t request_idx = 0;
+  uint64_t nstock = 0;
+  uint64_t batch_per_day = 0;
+  std::vector<MappedCheckpointEntry> entries;
+  std::vector<StateWriter> writers;
+  std::vector<std::string> blobs;
+};
+
+inline std::string SerializeState(const StateWriter &save) {
+  StringStreamBuf buffer;
+  {
+    std::ostream os(&buffer);
+    cereal::BinaryOutputArchive ar(os);
+    save(ar);
+  }
+  return buffer.Take();
+}
+
+// 需要在两次Update之间调用. DagOp只拷贝状态对象, 不做序列化;
+// 没有DagOp的节点(库中编译的算子)拿不到状态对象, 当场用SaveCheckpoint序列化.
+// CreateTree建出的树只有这一类根节点, 整棵树在调用线程上同步序列化,
+// 后台只剩写文件, 停顿与同步保存相当
+inline StateCopies CopyStates(const OperatorPtr &root, size_t nthread = 1) {
+  auto ops = CollectStatefulOps(root);
+  StateCopies copies;
+  //   组合算子的根节点不更新自己的RequestIdx, 取各节点的最大值
+  copies.request_idx = root->GetOpCacheIdx();
+  for (const auto &op : ops) {
+    copies.request_idx = std::max<uint64_t>(copies.request_idx,
+                                            op->GetOpCacheIdx());
+  }
+  copies.nstock = root->Nstock();
+  copies.batch_per_day = root->BatchPerDay();
+  copies.entries.resize(ops.size());
+  copies.writers.resize(ops.size());
+  copies.blobs.resize(ops.size());
+  ThreadPool pool(nthread);
+  pool.ParallelFor(ops.size(), [&](size_t, size_t begin, size_t end) {
+    for (size_t k = begin; k < end; ++k) {
+      const auto &op = ops[k];
+      copies.entries[k].op_id = op->GetOperatorId();
+      copies.entries[k].type = static_cast<int32_t>(op->GetType());
+      const DagOp *dag = AsDagOp(op.get());
+      if (dag) {
+        copies.writers[k] = dag->CopyState();
+      }
+      if (!copies.writers[k]) {
+        copies.blobs[k] = SerializeState(
+            [&op](cereal::BinaryOutputArchive &ar) { SaveNodeState(op, ar); });
+      }
+    }
+  });
+  return copies;
+}
+
+// 序列化拷贝出的状态, 不访问树, 可以在后台线程上调用
+inline StateSnapshot SerializeStates(StateCopies copies, size_t nthread = 1) {
+  StateSnapshot snapshot;
+  snapshot.request_idx = copies.request_idx;
+  snapshot.nstock = copies.nstock;
+  snapshot.batch_per_day = copies.batch_per_day;
+  snapshot.entries = std::move(copies.entries);
+  snapshot.blobs = std::move(copies.blobs);
+  ThreadPool pool(nthread);
+  pool.ParallelFor(snapshot.entries.size(), [&](size_t, size_t begin,
+                                                size_t end) {
+    for (size_t k = begin; k < end; ++k) {
+      if (copies.writers[k]) {
+        snapshot.blobs[k] = SerializeState(copies.writers[k]);
+        copies.writers[k] = nullptr;
+      }
+      snapshot.entries[k].size = snapshot.blobs[k].size();
+    }
+  });
+  return snapshot;
+}
+
+// 需要在两次Update之间调用, 拷贝和序列化都在调用线程上完成
+inline StateSnapshot SnapshotStates(const OperatorPtr &root,
+                                    size_t nthread = 1) {
+  return SerializeStates(CopyStates(root, nthread), nthread);
+}
+
+// 完整checkpoint的随机标识, 同一RequestIdx重新保存的基准也不相同
+inline uint64_t NewCheckpointId() {
+  std::random_device device;
+  uint64_t id = (static_cast<uint64_t>(device()) << 32) ^ device();
+  return id ^ static_cast<uint64_t>(
+                  std::chrono::steady_clock::now().time_since_epoch().count());
+}
+
+// 先写临时文件再改名, 写到一半失败时不会破坏上一次的checkpoint
+inline void WriteMappedCheckpoint(const StateSnapshot &snapshot,
+                                  const std::string &filename) {
+  MappedCheckpointHeader header{};
+  std::memcpy(header.magic, kMappedCheckpointMagic, sizeof(header.magic));
+  header.version = kMappedCheckpointVersion;
+  header.page_size = static_cast<uint32_t>(kCheckpointPageSize);
+  header.count = snapshot.entries.size();
+  header.request_idx = snapshot.request_idx;
+  header.base_id = NewCheckpointId();
+  header.nstock = snapshot.nstock;
+  header.batch_per_day = snapshot.batch_per_day;
+  std::vector<MappedCheckpointEntry> entries = snapshot.entries;
+  uint64_t offset = AlignToPage(sizeof(header) +
+                                entries.size() * sizeof(MappedCheckpointEntry));
+  for (auto &entry : entries) {
+    entry.offset = offset;
+    offset = AlignToPage(offset + entry.size);
+  }
+
+  const std::string tmp_filename = filename + ".tmp";
+  {
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("cannot open checkpoint file " + tmp_filename);
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(entries.data()),
+              entries.size() * sizeof(MappedCheckpointEntry));
+    uint64_t written =
+        sizeof(header) + entries.size() * sizeof(MappedCheckpointEntry);
+    const std::string padding(kCheckpointPageSize, '\0');
+    for (size_t k = 0; k < entries.size(); ++k) {
+      out.write(padding.data(), entries[k].offset - written);
+      out.write(snapshot.blobs[k].data(), snapshot.blobs[k].size());
+      written = entries[k].offset + snapshot.blobs[k].size();
+    }
+    if (!out.flush()) {
+      throw std::runtime_error("failed to write checkpoint file " +
+                               tmp_filename);
+    }
+  }
+  if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    throw std::runtime_error("cannot rename checkpoint file to " + filename);
+  }
+}
+
+inline void SaveMappedCheckpoint(const OperatorPtr &root,
+                                 const std::string &filename,
+                                 size_t nthread = 1) {
+  WriteMappedCheckpoint(SnapshotStates(root, nthread), filename);
+}
+
+// 只读映射的整份checkpoint, 打开时校验文件头和全部索引项
+class MappedCheckpointReader {
+public:
+  explicit MappedCheckpointReader(const std::string &filename)
+      : file_(filename) {
+    if (file_.Size() < sizeof(MappedCheckpointHeader)) {
+      throw std::runtime_error("invalid checkpoint file " + filename);
+    }
+    std::memcpy(&header_, file_.Data(), sizeof(header_));
+    if (std::memcmp(header_.magic, kMappedCheckpointMagic,
+                    sizeof(header_.magic)) != 0 ||
+        header_.version != kMappedCheckpointVersion ||
+        header_.page_size != kCheckpointPageSize) {
+      throw std::runtime_error("unsupported checkpoint format " + filename);
+    }
+    if (sizeof(header_) + header_.count * sizeof(MappedCheckpointEntry) >
+        file_.Size()) {
+      throw std::runtime_error("checkpoint file " + filename +
+                               " is truncated");
+    }
+    entries_ = reinterpret_cast<const MappedCheckpointEntry *>(
+        file_.Data() + sizeof(header_));
+    for (size_t k = 0; k < header_.count; ++k) {
+      if (entries_[k].offset + entries_[k].size > file_.Size()) {
+        throw std::runtime_error("checkpoint file " + filename +
+                                 " is truncated");
+      }
+    }
+  }
+
+  const MappedCheckpointHeader &Header() const { return header_; }
+  const MappedCheckpointEntry *Entries() const { return entries_; }
+  const char *Blob(size_t k) const {
+    return file_.Data() + entries_[k].offset;
+  }
+  void WillNeed() const { file_.WillNeed(); }
+
+private:
+  MappedFile file_;
+  MappedCheckpointHeader header_;
+  const MappedCheckpointEntry *entries_ = nullptr;
+};
+
+// 保存时的nstock和batch_per_day需要与树一致
+inline void CheckCheckpointConfig(const OperatorPtr &root, uint64_t nstock,
+                                  uint64_t batch_per_day,
+                                  const std::string &name) {
+  if (nstock != root->Nstock() || batch_per_day != root->BatchPerDay()) {
+    throw std::runtime_error(
+        "checkpoint " + name + " has nstock " + std::to_string(nstock) +
+        ", batch_per_day " + std::to_string(batch_per_day) + ", tree has " +
+        std::to_string(root->Nstock()) + ", " +
+        std::to_string(root->BatchPerDay()));
+  }
+}
+
+// 按索引项找到树上对应的节点, 节点数、OperatorId和算子类型都需要一致
+inline std::vector<OperatorPtr>
+MatchCheckpointNodes(const OperatorPtr &root,
+                     const MappedCheckpointEntry *entries, size_t count) {
+  auto index = IndexStatefulOps(root);
+  if (count != index.size()) {
+    throw std::runtime_error("checkpoint has " + std::to_string(count) +
+                             " stateful nodes, tree has " +
+                             std::to_string(index.size()));
+  }
+  std::vector<OperatorPtr> ops(count);
+  for (size_t k = 0; k < count; ++k) {
+    auto it = index.find(entries[k].op_id);
+    if (it == index.end() ||
+        static_cast<int32_t>(it->second->GetType()) != entries[k].type) {
+      throw std::runtime_error("checkpoint node " +
+                               std::to_string(entries[k].op_id) +
+                               " does not match the tree");
+    }
+    ops[k] = it->second;
+  }
+  return ops;
+}
+
+// blob(k)返回第k个节点状态数据的起始地址
+// DagOp只写自身的状态, 并行加载; 没有DagOp的节点递归加载整棵子树, 子树中
+// 可能有与其他节点共享的节点, 最后逐个串行加载(CreateTree建出的树属于此类)
+inline void LoadStates(const std::vector<OperatorPtr> &ops,
+                       const MappedCheckpointEntry *entries,
+                       const std::function<const char *(size_t)> &blob,
+                       size_t nthread) {
+  auto load = [&](size_t k) {
+    MemoryStreamBuf buffer(blob(k), entries[k].size);
+    std::istream is(&buffer);
+    cereal::BinaryInputArchive ar(is);
+    LoadNodeState(ops[k], ar);
+  };
+  std::vector<size_t> dag_ops;
+  std::vector<size_t> subtree_ops;
+  for (size_t k = 0; k < ops.size(); ++k) {
+    (AsDagOp(ops[k].get()) ? dag_ops : subtree_ops).push_back(k);
+  }
+  ThreadPool pool(nthread);
+  pool.ParallelFor(dag_ops.size(), [&](size_t, size_t begin, size_t end) {
+    for (size_t k = begin; k < end; ++k) {
+      load(dag_ops[k]);
+    }
+  });
+  for (size_t k : subtree_ops) {
+    load(k);
+  }
+}
+
+// 直接从映射的内存解析各节点状态, 返回保存时的RequestIdx
+inline uint64_t LoadMappedCheckpoint(const OperatorPtr &root,
+                                     const std::string &filename,
+                                     size_t nthread = 1) {
+  MappedCheckpointReader reader(filename);
+  CheckCheckpointConfig(root, reader.Header().nstock,
+                        reader.Header().batch_per_day, filename);
+  auto ops = MatchCheckpointNodes(root, reader.Entries(),
+                                  reader.Header().count);
+  reader.WillNeed();
+  LoadStates(
+      ops, reader.Entries(), [&reader](size_t k) { return reader.Blob(k); },
+      nthread);
+  return reader.Header().request_idx;
+}
+
+// 从内存快照恢复, 返回快照的RequestIdx
+inline uint64_t LoadSnapshot(const OperatorPtr &root,
+                             const StateSnapshot &snapshot,
+                             size_t nthread = 1) {
+  CheckCheckpointConfig(root, snapshot.nstock, snapshot.batch_per_day,
+                        "snapshot");
+  auto ops = MatchCheckpointNodes(root, snapshot.entries.data(),
+                                  snapshot.entries.size());
+  LoadStates(
+      ops, snapshot.entries.data(),
+      [&snapshot](size_t k) { return snapshot.blobs[k].data(); }, nthread);
+  return snapshot.request_idx;
+}
+
+// 增量checkpoint: 相对最近一次完整checkpoint(基准), 只保存内容变化的页
+// 环形缓冲区每个批次只写一行, 大部分页与基准相同; 增量都相对同一个基准,
+// 恢复时只需要基准和最新的一个增量
+//
+// 文件布局:
+//   DeltaCheckpointHeader
+//   DeltaCheckpointEntry[count]
+//   uint64_t[page_count]   变化页在所属节点状态数据中的页号
+//   页数据, 从页边界开始, 每页kCheckpointPageSize字节, 最后一页不足时补0
+constexpr char kDeltaCheckpointMagic[8] = {'F', 'T', 'D', 'E',
+                                           'L', 'T', 'A', '\0'};
+constexpr uint32_t kDeltaCheckpointVersion = 2;
+
+struct DeltaCheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint64_t count;
+  uint64_t request_idx;
+  //   基准的RequestIdx和base_id, 恢复时校验
+  uint64_t base_request_idx;
+  uint64_t base_id;
+  uint64_t page_count;
+};
+
+struct DeltaCheckpointEntry {
+  uint64_t op_id;
+  int32_t type;
+  uint32_t reserved;
+  //   节点状态数据的完整长度
+  uint64_t size;
+  //   在页号表中的起始位置和页数
+  uint64_t first_page;
+  uint64_t page_count;
+};
+
+// 基准里找不到同一节点或长度变化时保存全部页
+inline void WriteDeltaCheckpoint(const StateSnapshot &snapshot,
+                                 const std::string &base_filename,
+                                 const std::string &filename) {
+  MappedCheckpointReader base(base_filename);
+  //   增量还原时沿用基准的nstock和batch_per_day
+  if (snapshot.nstock != base.Header().nstock ||
+      snapshot.batch_per_day != base.Header().batch_per_day) {
+    throw std::runtime_error("checkpoint base " + base_filename +
+                             " was taken with a different nstock or "
+                             "batch_per_day");
+  }
+  std::unordered_map<uint64_t, size_t> base_index;
+  for (size_t k = 0; k < base.Header().count; ++k) {
+    base_index.emplace(base.Entries()[k].op_id, k);
+  }
+
+  const size_t count = snapshot.entries.size();
+  std::vector<DeltaCheckpointEntry> entries(count);
+  std::vector<uint64_t> pages;
+  std::vector<std::pair<const char *, size_t>> page_data;
+  for (size_t k = 0; k < count; ++k) {
+    const auto &blob = snapshot.blobs[k];
+    auto &entry = entries[k];
+    entry.op_id = snapshot.entries[k].op_id;
+    entry.type = snapshot.entries[k].type;
+    entry.size = blob.size();
+    entry.first_page = pages.size();
+    const char *old = nullptr;
+    auto it = base_index.find(entry.op_id);
+    if (it != base_index.end()) {
+      const auto &base_entry = base.Entries()[it->second];
+      if (base_entry.type == entry.type && base_entry.size == blob.size()) {
+        old = base.Blob(it->second);
+      }
+    }
+    for (size_t begin = 0; begin < blob.size(); begin += kCheckpointPageSize) {
+      size_t length = std::min<size_t>(kCheckpointPageSize,
+                                       blob.size() - begin);
+      if (old && std::memcmp(old + begin, blob.data() + begin, length) == 0) {
+        continue;
+      }
+      pages.push_back(begin / kCheckpointPageSize);
+      page_data.emplace_back(blob.data() + begin, length);
+    }
+    entry.page_count = pages.size() - entry.first_page;
+  }
+
+  DeltaCheckpointHeader header{};
+  std::memcpy(header.magic, kDeltaCheckpointMagic, sizeof(header.magic));
+  header.version = kDeltaCheckpointVersion;
+  header.page_size = static_cast<uint32_t>(kCheckpointPageSize);
+  header.count = count;
+  header.request_idx = snapshot.request_idx;
+  header.base_request_idx = base.Header().request_idx;
+  header.base_id = base.Header().base_id;
+  header.page_count = pages.size();
+
+  const std::string tmp_filename = filename + ".tmp";
+  {
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("cannot open checkpoint file " + tmp_filename);
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(entries.data()),
+              entries.size() * sizeof(DeltaCheckpointEntry));
+    out.write(reinterpret_cast<const char *>(pages.data()),
+              pages.size() * sizeof(uint64_t));
+    uint64_t written = sizeof(header) +
+                       entries.size() * sizeof(DeltaCheckpointEntry) +
+                       pages.size() * sizeof(uint64_t);
+    const std::string padding(kCheckpointPageSize, '\0');
+    out.write(padding.data(), AlignToPage(written) - written);
+    for (const auto &[data, length] : page_data) {
+      out.write(data, length);
+      out.write(padding.data(), kCheckpointPageSize - length);
+    }
+    if (!out.flush()) {
+      throw std::runtime_error("failed to write checkpoint file " +
+                               tmp_filename);
+    }
+  }
+  if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    throw std::runtime_error("cannot rename checkpoint file to " + filename);
+  }
+}
+
+// 基准加增量还原为完整快照
+inline StateSnapshot ReadDeltaCheckpoint(const std::string &base_filename,
+                                         const std::string &filename) {
+  MappedCheckpointReader base(base_filename);
+  MappedFile delta(filename);
+  DeltaCheckpointHeader header;
+  if (delta.Size() < sizeof(header)) {
+    throw std::runtime_error("invalid checkpoint file " + filename);
+  }
+  std::memcpy(&header, delta.Data(), sizeof(header));
+  if (std::memcmp(header.magic, kDeltaCheckpointMagic,
+                  sizeof(header.magic)) != 0 ||
+      header.version != kDeltaCheckpointVersion ||
+      header.page_size != kCheckpointPageSize) {
+    throw std::runtime_error("unsupported checkpoint format " + filename);
+  }
+  //   同一RequestIdx可能重新保存过基准, 只比较RequestIdx不够
+  if (header.base_id != base.Header().base_id ||
+      header.base_request_idx != base.Header().request_idx) {
+    throw std::runtime_error("checkpoint " + filename +
+                             " was not taken against " + base_filename);
+  }
+  uint64_t index_end = sizeof(header) +
+                       header.count * sizeof(DeltaCheckpointEntry) +
+                       header.page_count * sizeof(uint64_t);
+  uint64_t data_begin = AlignToPage(index_end);
+  if (index_end > delta.Size() ||
+      data_begin + header.page_count * kCheckpointPageSize > delta.Size()) {
+    throw std::runtime_error("checkpoint file " + filename + " is truncated");
+  }
+  const auto *entries = reinterpret_cast<const DeltaCheckpointEntry *>(
+      delta.Data() + sizeof(header));
+  const auto *pages = reinterpret_cast<const uint64_t *>(
+      entries + header.count);
+  const char *page_data = delta.Data() + data_begin;
+
+  std::unordered_map<uint64_t, size_t> base_index;
+  for (size_t k = 0; k < base.Header().count; ++k) {
+    base_index.emplace(base.Entries()[k].op_id, k);
+  }
+  StateSnapshot snapshot;
+  snapshot.request_idx = header.request_idx;
+  snapshot.nstock = base.Header().nstock;
+  snapshot.batch_per_day = base.Header().batch_per_day;
+  snapshot.entries.resize(header.count);
+  snapshot.blobs.resize(header.count);
+  for (size_t k = 0; k < header.count; ++k) {
+    const auto &entry = entries[k];
+    if (entry.first_page + entry.page_count > header.page_count) {
+      throw std::runtime_error("checkpoint file " + filename +
+                               " is corrupted");
+    }
+    auto &blob = snapshot.blobs[k];
+    auto it = base_index.find(entry.op_id);
+    if (it != base_index.end() &&
+        base.Entries()[it->second].type == entry.type &&
+        base.Entries()[it->second].size == entry.size) {
+      blob.assign(base.Blob(it->second), entry.size);
+    } else {
+      blob.assign(entry.size, '\0');
+    }
+    for (uint64_t p = entry.first_page; p < entry.first_page + entry.page_count;
+         ++p) {
+      uint64_t begin = pages[p] * kCheckpointPageSize;
+      if (begin >= entry.size) {
+        throw std::runtime_error("checkpoint file " + filename +
+                                 " is corrupted");
+      }
+      size_t length = std::min<uint64_t>(kCheckpointPageSize,
+                                         entry.size - begin);
+      std::memcpy(&blob[begin], page_data + p * kCheckpointPageSize, length);
+    }
+    snapshot.entries[k].op_id = entry.op_id;
+    snapshot.entries[k].type = entry.type;
+    snapshot.entries[k].size = entry.size;
+  }
+  return snapshot;
+}
+
+// 返回增量的RequestIdx
+inline uint64_t LoadDeltaCheckpoint(const OperatorPtr &root,
+                                    const std::string &base_filename,
+                                    const std::string &filename,
+                                    size_t nthread = 1) {
+  return LoadSnapshot(root, ReadDeltaCheckpoint(base_filename, filename),
+                      nthread);
+}
+
+// 把基准和增量合并为新的完整checkpoint, 之后的增量以它为基准
+inline void CompactCheckpoint(const std::string &base_filename,
+                              const std::string &delta_filename,
+                              const std::string &filename) {
+  WriteMappedCheckpoint(ReadDeltaCheckpoint(base_filename, delta_filename),
+                        filename);
+}
+
+// 按子表达式保存的checkpoint: 以节点的表达式(ToString)为键, 与树的形状和
+// OperatorId无关. 新增或修改因子后, 新树上与旧树相同的子表达式都能恢复状态,
+// 只有真正新增的节点需要预热. 建树时打开canonicalize, 等价写法的键也相同
+// 只对header_ops算子组装的树有效: CreateTree建出的树只有根节点一项, 键是
+// 整个因子表达式, 因子有任何修改时整棵树都是cold节点, 子表达式不会被复用
+//
+// 文件布局:
+//   SubtreeCheckpointHeader
+//   SubtreeCheckpointEntry[count]
+//   char[key_size]         各节点表达式
+//   状态数据, 每块的起始偏移按kCheckpointPageSize对齐
+constexpr char kSubtreeCheckpointMagic[8] = {'F', 'T', 'S', 'U',
+                                             'B', 'C', 'K', 'P'};
+constexpr uint32_t kSubtreeCheckpointVersion = 2;
+
+struct SubtreeCheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint64_t count;
+  uint64_t request_idx;
+  //   状态的长度与nstock有关, ad_*等算子按batch_per_day分配时间槽,
+  //   两者不同的状态不能恢复
+  uint64_t nstock;
+  uint64_t batch_per_day;
+  uint64_t key_size;
+};
+
+struct SubtreeCheckpointEntry {
+  int32_t type;
+  uint32_t key_size;
+  uint64_t key_offset;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// cold为没有恢复状态、需要预热的有状态节点, 子节点先于父节点
+// cold不为空时, 不能把历史数据直接喂给这棵树补状态: 已恢复的节点会重复计入
+// 这段历史. 预热步骤:
+//   1. 用新的表达式另建一棵树, 用历史数据预热(见warmup.h), 最后一个批次与
+//      checkpoint的request_idx对齐; 历史长度要够cold节点连同它的子树算出
+//      有效值, 例如in_ts_mean(ts_tcorr(x,5),3)至少需要7个批次
+//   2. 对这棵树调用SaveSubtreeCheckpoint
+//   3. 在线上的树上先加载第2步的文件, 再加载原来的checkpoint: 原checkpoint
+//      中有的节点被覆盖为更长历史的状态, cold节点保留预热得到的状态
+struct SubtreeRestoreResult {
+  uint64_t request_idx = 0;
+  size_t restored = 0;
+  std::vector<OperatorPtr> cold;
+};
+
+inline void SaveSubtreeCheckpoint(const OperatorPtr &root,
+                                  const std::string &filename,
+                                  size_t nthread = 1) {
+  StateSnapshot snapshot = SnapshotStates(root, nthread);
+  auto ops = CollectStatefulOps(root);
+  std::unordered_map<std::string, size_t> seen;
+  std::vector<std::pair<std::string, size_t>> keys;
+  for (size_t k = 0; k < ops.size(); ++k) {
+    std::string key = ops[k]->ToString();
+    //   未去重的树里同一表达式可能出现多次, 状态相同, 只保存一份
+    if (seen.emplace(key, k).second) {
+      keys.emplace_back(std::move(key), k);
+    }
+  }
+
+  SubtreeCheckpointHeader header{};
+  std::memcpy(header.magic, kSubtreeCheckpointMagic, sizeof(header.magic));
+  header.version = kSubtreeCheckpointVersion;
+  header.page_size = static_cast<uint32_t>(kCheckpointPageSize);
+  header.count = keys.size();
+  header.request_idx = snapshot.request_idx;
+  header.nstock = root->Nstock();
+  header.batch_per_day = root->BatchPerDay();
+  std::vector<SubtreeCheckpointEntry> entries(keys.size());
+  for (size_t e = 0; e < keys.size(); ++e) {
+    entries[e].type = snapshot.entries[keys[e].second].type;
+    entries[e].key_size = static_cast<uint32_t>(keys[e].first.size());
+    entries[e].key_offset = header.key_size;
+    entries[e].size = snapshot.entries[keys[e].second].size;
+    header.key_size += keys[e].first.size();
+  }
+  uint64_t offset =
+      AlignToPage(sizeof(header) +
+                  entries.size() * sizeof(SubtreeCheckpointEntry) +
+                  header.key_size);
+  for (auto &entry : entries) {
+    entry.offset = offset;
+    offset = AlignToPage(offset + entry.size);
+  }
+
+  const std::string tmp_filename = filename + ".tmp";
+  {
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("cannot open checkpoint file " + tmp_filename);
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(entries.data()),
+              entries.size() * sizeof(SubtreeCheckpointEntry));
+    for (const auto &key : keys) {
+      out.write(key.first.data(), key.first.size());
+    }
+    uint64_t written = sizeof(header) +
+                       entries.size() * sizeof(SubtreeCheckpointEntry) +
+                       header.key_size;
+    const std::string padding(kCheckpointPageSize, '\0');
+    for (size_t e = 0; e < entries.size(); ++e) {
+      const auto &blob = snapshot.blobs[keys[e].second];
+      out.write(padding.data(), entries[e].offset - written);
+      out.write(blob.data(), blob.size());
+      written = entries[e].offset + blob.size();
+    }
+    if (!out.flush()) {
+      throw std::runtime_error("failed to write checkpoint file " +
+                               tmp_filename);
+    }
+  }
+  if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    throw std::runtime_error("cannot rename checkpoint file to " + filename);
+  }
+}
+
+// 树上的有状态节点按表达式查找, 找到且算子类型一致的恢复状态, 其余的返回
+// 在cold中; 保存时的树与当前树不需要一致
+inline SubtreeRestoreResult LoadSubtreeCheckpoint(const OperatorPtr &root,
+                                                  const std::string &filename,
+                                                  size_t nthread = 1) {
+  MappedFile file(filename);
+  SubtreeCheckpointHeader header;
+  if (file.Size() < sizeof(header)) {
+    throw std::runtime_error("invalid checkpoint file " + filename);
+  }
+  std::memcpy(&header, file.Data(), sizeof(header));
+  if (std::memcmp(header.magic, kSubtreeCheckpointMagic,
+                  sizeof(header.magic)) != 0 ||
+      header.version != kSubtreeCheckpointVersion ||
+      header.page_size != kCheckpointPageSize) {
+    throw std::runtime_error("unsupported checkpoint format " + filename);
+  }
+  if (header.nstock != root->Nstock()) {
+    throw std::runtime_error("checkpoint " + filename + " has nstock " +
+                             std::to_string(header.nstock) + ", tree has " +
+                             std::to_string(root->Nstock()));
+  }
+  if (header.batch_per_day != root->BatchPerDay()) {
+    throw std::runtime_error("checkpoint " + filename + " has batch_per_day " +
+                             std::to_string(header.batch_per_day) +
+                             ", tree has " +
+                             std::to_string(root->BatchPerDay()));
+  }
+  uint64_t key_begin =
+      sizeof(header) + header.count * sizeof(SubtreeCheckpointEntry);
+  if (key_begin + header.key_size > file.Size()) {
+    throw std::runtime_error("checkpoint file " + filename + " is truncated");
+  }
+  const auto *entries = reinterpret_cast<const SubtreeCheckpointEntry *>(
+      file.Data() + sizeof(header));
+  const char *keys = file.Data() + key_begin;
+  std::unordered_map<std::string, size_t> index;
+  index.reserve(header.count);
+  for (size_t e = 0; e < header.count; ++e) {
+    if (entries[e].key_offset + entries[e].key_size > header.key_size ||
+        entries[e].offset + entries[e].size > file.Size()) {
+      throw std::runtime_error("checkpoint file " + filename +
+                               " is corrupted");
+    }
+    index.emplace(std::string(keys + entries[e].key_offset,
+                              entries[e].key_size),
+                  e);
+  }
+
+  SubtreeRestoreResult result;
+  result.request_idx = header.request_idx;
+  std::vector<OperatorPtr> ops;
+  std::vector<MappedCheckpointEntry> matched;
+  std::vector<const char *> blobs;
+  for (auto &op : CollectStatefulOps(root)) {
+    auto it = index.find(op->ToString());
+    if (it == index.end() ||
+        entries[it->second].type != static_cast<int32_t>(op->GetType())) {
+      result.cold.push_back(op);
+      continue;
+    }
+    const auto &entry = entries[it->second];
+    MappedCheckpointEntry mapped{};
+    mapped.size = entry.size;
+    matched.push_back(mapped);
+    blobs.push_back(file.Data() + entry.offset);
+    ops.push_back(op);
+  }
+  result.restored = ops.size();
+  file.WillNeed();
+  LoadStates(
+      ops, matched.data(), [&blobs](size_t k) { return blobs[k]; }, nthread);
+  return result;
+}
+
+// 后台写checkpoint: Save在调用线程上只拷贝状态对象(见CopyStates),
+// 序列化和写文件由后台线程完成, 期间可以继续Update.
+// CreateTree建出的树在调用线程上同步序列化, 只有写文件在后台
+// 上一次写出还没完成时, Save先等待它结束
+class AsyncCheckpointWriter {
+public:
+  AsyncCheckpointWriter() = default;
+  AsyncCheckpointWriter(const AsyncCheckpointWriter &) = delete;
+  AsyncCheckpointWriter &operator=(const AsyncCheckpointWriter &) = delete;
+
+  ~AsyncCheckpointWriter() {
+    if (pending_.valid()) {
+      pending_.wait();
+    }
+  }
+
+  void Save(const OperatorPtr &root, const std::string &filename,
+            size_t nthread = 1) {
+    Wait();
+    auto copies = std::make_shared<StateCopies>(CopyStates(root, nthread));
+    pending_ = std::async(std::launch::async, [copies, filename, nthread] {
+      WriteMappedCheckpoint(SerializeStates(std::move(*copies), nthread),
+                            filename);
+    });
+  }
+
+  //   与基准比较和写增量都在后台完成
+  void SaveDelta(const OperatorPtr &root, const std::string &base_filename,
+                 const std::string &filename, size_t nthread = 1) {
+    Wait();
+    auto copies = std::make_shared<StateCopies>(CopyStates(root, nthread));
+    pending_ = std::async(
+        std::launch::async, [copies, base_filename, filename, nthread] {
+          WriteDeltaCheckpoint(SerializeStates(std::move(*copies), nthread),
+                               base_filename, filename);
+        });
+  }
+
+  //   等待后台写出完成, 写出失败时在这里抛出异常
+  void Wait() {
+    if (pending_.valid()) {
+      pending_.get();
+    }
+  }
+
+  bool Busy() const {
+    return pending_.valid() && pending_.wait_for(std::chrono::seconds(0)) !=
+                                   std::future_status::ready;
+  }
+
+private:
+  std::future<void> pending_;
+};
+
+} // namespace factor_tree
@@ -0,0 +1,505 @@
+#pragma once
+
+#include "operators/tsoperator.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace factor_tree {
+
+// 表达式语法树
+// 例如 add(@open,#-1.5) 为一个Call节点, 两个参数分别为Field和Constant节点
+struct ExprNode {
+  enum class Kind : int {
+    Call = 0, // 算子调用, text为算子名
+    Field,    // 输入字段, text含@前缀
+    Constant, // 常量, text含#前缀
+    Integer,
+    Double,
+    String,
+  };
+
+  Kind kind = Kind::Call;
+  std::string text;
+  std::vector<ExprNode> args;
+
+  bool IsCall(const char *name) const {
+    return kind == Kind::Call && text == name;
+  }
+
+  //   不含空格的表达式, 与算子的ToString()格式一致
+  std::string ToString() const {
+    std::string out;
+    AppendTo(out);
+    return out;
+  }
+
+  void AppendTo(std::string &out) const {
+    out += text;
+    if (kind != Kind::Call) {
+      return;
+    }
+    out += '(';
+    for (size_t k = 0; k < args.size(); ++k) {
+      if (k > 0) {
+        out += ',';
+      }
+      args[k].AppendTo(out);
+    }
+    out += ')';
+  }
+};
+
+// 单遍扫描的递归下降解析, 语法错误时抛出std::invalid_argument并给出位置
+class ExprParser {
+public:
+  explicit ExprParser(const std::string &expression) : expr_(expression) {}
+
+  ExprNode Parse() {
+    pos_ = 0;
+    ExprNode node = ParseNode();
+    SkipSpace();
+    if (pos_ != expr_.size()) {
+      Fail("unexpected trailing characters");
+    }
+    return node;
+  }
+
+private:
+  ExprNode ParseNode() {
+    SkipSpace();
+    if (pos_ >= expr_.size()) {
+      Fail("unexpected end of expression");
+    }
+    char c = expr_[pos_];
+    ExprNode node;
+    if (c == '@') {
+      node.kind = ExprNode::Kind::Field;
+      node.text = '@' + ScanName(pos_ + 1);
+      if (node.text.size() == 1) {
+        Fail("empty field name");
+      }
+      return node;
+    }
+    if (c == '#') {
+      node.kind = ExprNode::Kind::Constant;
+      size_t begin = pos_++;
+      ScanNumber();
+      node.text = expr_.substr(begin, pos_ - begin);
+      return node;
+    }
+    if (c == '{') {
+      // 组合算子模板中的参数占位符, 例如 {param}
+      size_t end = expr_.find('}', pos_ + 1);
+      if (end == std::string::npos) {
+        Fail("unterminated placeholder");
+      }
+      node.kind = ExprNode::Kind::String;
+      node.text = expr_.substr(pos_, end + 1 - pos_);
+      pos_ = end + 1;
+      return node;
+    }
+    if (c == '"' || c == '\'') {
+      size_t end = expr_.find(c, pos_ + 1);
+      if (end == std::string::npos) {
+        Fail("unterminated string");
+      }
+      node.kind = ExprNode::Kind::String;
+      node.text = expr_.substr(pos_, end + 1 - pos_);
+      pos_ = end + 1;
+      return node;
+    }
+    if (std::isdigit(static_cast<unsigned char>(c)) || c == '-' || c == '+' ||
+        c == '.') {
+      size_t begin = pos_;
+      bool is_double = ScanNumber();
+      node.kind = is_double ? ExprNode::Kind::Double : ExprNode::Kind::Integer;
+      node.text = expr_.substr(begin, pos_ - begin);
+      return node;
+    }
+    node.text = ScanName(pos_);
+    if (node.text.empty()) {
+      Fail(std::string("unexpected character '") + c + "'");
+    }
+    SkipSpace();
+    if (pos_ >= expr_.size() || expr_[pos_] != '(') {
+      node.kind = ExprNode::Kind::String;
+      return node;
+    }
+    node.kind = ExprNode::Kind::Call;
+    ++pos_;
+    SkipSpace();
+    if (pos_ < expr_.size() && expr_[pos_] == ')') {
+      ++pos_;
+      return node;
+    }
+    while (true) {
+      node.args.push_back(ParseNode());
+      SkipSpace();
+      if (pos_ >= expr_.size()) {
+        Fail("missing ')'");
+      }
+      if (expr_[pos_] == ',') {
+        ++pos_;
+        continue;
+      }
+      if (expr_[pos_] == ')') {
+        ++pos_;
+        return node;
+      }
+      Fail("expected ',' or ')'");
+    }
+  }
+
+  //   从begin开始读取名字, 返回后pos_指向名字之后
+  std::string ScanName(size_t begin) {
+    size_t end = begin;
+    while (end < expr_.size() &&
+           (std::isalnum(static_cast<unsigned char>(expr_[end])) ||
+            expr_[end] == '_' || expr_[end] == '.')) {
+      ++end;
+    }
+    pos_ = end;
+    return expr_.substr(begin, end - begin);
+  }
+
+  //   读取一个数字, 返回是否为浮点数
+  bool ScanNumber() {
+    const char *begin = expr_.c_str() + pos_;
+    char *end = nullptr;
+    std::strtod(begin, &end);
+    if (end == begin) {
+      Fail("invalid number");
+    }
+    auto not_integer = [](char ch) {
+      return !std::isdigit(static_cast<unsigned char>(ch)) && ch != '-' &&
+             ch != '+';
+    };
+    bool is_double =
+        std::any_of(begin, static_cast<const char *>(end), not_integer);
+    pos_ += end - begin;
+    return is_double;
+  }
+
+  void SkipSpace() {
+    while (pos_ < expr_.size() &&
+           std::isspace(static_cast<unsigned char>(expr_[pos_]))) {
+      ++pos_;
+    }
+  }
+
+  [[noreturn]] void Fail(const std::string &reason) const {
+    throw std::invalid_argument("invalid expression at " +
+                                std::to_string(pos_) + ": " + reason + " in " +
+                                expr_);
+  }
+
+  const std::string &expr_;
+  size_t pos_ = 0;
+};
+
+inline ExprNode ParseExprTree(const std::string &expression) {
+  return ExprParser(expression).Parse();
+}
+
+// 规范化: 语义完全相同的写法变为同一个字符串, 建树时经expr_map_去重
+//   - 常量统一写法: #1.0 -> #1
+//   - 交换律算子的参数按规范化后的字符串排序: add/multiply, ts_corr/ts_cov的x, y
+//   - 去掉恒等变换: add(x,#0) subtract(x,#0) multiply(x,#1) divide(x,#1)
+//     null(x) minus(minus(x)), 以及abs/relu/sign的重复嵌套
+//   - 合并平凡窗口: ts_mean/ts_min/ts_max/in_ts_mean(x,1) -> x,
+//     ts_delay(x,0) -> x, ts_delay(ts_delay(x,a),b) -> ts_delay(x,a+b)
+// 只做对nan也完全等价的改写, 例如multiply(x,#0)不会改写为#0,
+// ts_sum(x,1)在x为nan时返回0, 也不改写
+class ExprCanonicalizer {
+public:
+  //   自底向上改写node, 返回规范化后的表达式
+  std::string Canonicalize(ExprNode &node) {
+    if (node.kind == ExprNode::Kind::Constant) {
+      node.text = "#" + FormatDouble(std::strtod(node.text.c_str() + 1,
+                                                  nullptr));
+    }
+    if (node.kind != ExprNode::Kind::Call) {
+      return node.text;
+    }
+    std::vector<std::string> keys(node.args.size());
+    for (size_t k = 0; k < node.args.size(); ++k) {
+      keys[k] = Canonicalize(node.args[k]);
+    }
+    if (node.IsCall("add") || node.IsCall("multiply")) {
+      SortArgs(node, keys, node.args.size());
+    } else if (node.IsCall("ts_corr") || node.IsCall("ts_cov")) {
+      SortArgs(node, keys, 2);
+    }
+    if (Rewrite(node)) {
+      // 改写后的结果可能还能继续化简, 例如 minus(minus(add(x,#0)))
+      return Canonicalize(node);
+    }
+    std::string out;
+    out += node.text;
+    out += '(';
+    for (size_t k = 0; k < keys.size(); ++k) {
+      if (k > 0) {
+        out += ',';
+      }
+      out += keys[k];
+    }
+    out += ')';
+    return out;
+  }
+
+private:
+  //   对前n个参数按规范化字符串排序, 排序稳定, 结果与原顺序无关
+  static void SortArgs(ExprNode &node, std::vector<std::string> &keys,
+                       size_t n) {
+    if (node.args.size() < n || n < 2) {
+      return;
+    }
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+    std::vector<ExprNode> args;
+    std::vector<std::string> sorted_keys;
+    for (size_t k : order) {
+      args.push_back(std::move(node.args[k]));
+      sorted_keys.push_back(std::move(keys[k]));
+    }
+    for (size_t k = 0; k < n; ++k) {
+      node.args[k] = std::move(args[k]);
+      keys[k] = std::move(sorted_keys[k]);
+    }
+  }
+
+  static bool IsConstant(const ExprNode &node, double value) {
+    return node.kind == ExprNode::Kind::Constant &&
+           std::strtod(node.text.c_str() + 1, nullptr) == value;
+  }
+
+  static bool IsInteger(const ExprNode &node, long value) {
+    return node.kind == ExprNode::Kind::Integer &&
+           std::strtol(node.text.c_str(), nullptr, 10) == value;
+  }
+
+  //   用node的第k个参数替换node本身
+  static void Replace(ExprNode &node, size_t k) {
+    ExprNode child = std::move(node.args[k]);
+    node = std::move(child);
+  }
+
+  //   改写了node时返回true
+  static bool Rewrite(ExprNode &node) {
+    auto &args = node.args;
+    if (args.size() == 2 &&
+        (node.IsCall("add") || node.IsCall("subtract"))) {
+      if (IsConstant(args[1], 0.0)) {
+        Replace(node, 0);
+        return true;
+      }
+      if (node.IsCall("add") && IsConstant(args[0], 0.0)) {
+        Replace(node, 1);
+        return true;
+      }
+    }
+    if (args.size() == 2 &&
+        (node.IsCall("multiply") || node.IsCall("divide"))) {
+      if (IsConstant(args[1], 1.0)) {
+        Replace(node, 0);
+        return true;
+      }
+      if (node.IsCall("multiply") && IsConstant(args[0], 1.0)) {
+        Replace(node, 1);
+        return true;
+      }
+    }
+    if (args.size() == 1) {
+      if (node.IsCall("null")) {
+        Replace(node, 0);
+        return true;
+      }
+      if (node.IsCall("minus") && args[0].IsCall("minus") &&
+          args[0].args.size() == 1) {
+        ExprNode inner = std::move(args[0].args[0]);
+        node = std::move(inner);
+        return true;
+      }
+      for (const char *idempotent : {"abs", "relu", "sign"}) {
+        if (node.IsCall(idempotent) && args[0].IsCall(idempotent)) {
+          Replace(node, 0);
+          return true;
+        }
+      }
+    }
+    if (args.size() == 2) {
+      for (const char *name : {"ts_mean", "ts_min", "ts_max", "in_ts_mean"}) {
+        if (node.IsCall(name) && IsInteger(args[1], 1)) {
+          Replace(node, 0);
+          return true;
+        }
+      }
+      if (node.IsCall("ts_delay") && IsInteger(args[1], 0)) {
+        Replace(node, 0);
+        return true;
+      }
+      if (node.IsCall("ts_delay") && args[0].IsCall("ts_delay") &&
+          args[0].args.size() == 2 &&
+          args[0].args[1].kind == ExprNode::Kind::Integer &&
+          args[1].kind == ExprNode::Kind::Integer) {
+        long window = std::strtol(args[0].args[1].text.c_str(), nullptr, 10) +
+                      std::strtol(args[1].text.c_str(), nullptr, 10);
+        ExprNode inner = std::move(args[0].args[0]);
+        args[0] = std::move(inner);
+        args[1].text = std::to_string(window);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// 规范化表达式字符串, 语法错误时抛出std::invalid_argument
+inline std::string CanonicalizeExpression(const std::string &expression) {
+  ExprNode node = ParseExprTree(expression);
+  return ExprCanonicalizer().Canonicalize(node);
+}
+
+// 组合算子展开: 把组合算子替换为模板展开后的基础算子表达式
+// GeneralCombOp在自己的child_表里单独建树, 内部的ts_mean(x,w)、ts_diff(x,1)
+// 等无法与树上其他位置的相同子表达式共享; 展开后所有节点都经expr_map_去重
+// 模板即组合算子的GetOpExpression(): @child_data/@child_data1/@child_data2
+// 为输入, {param}为整数参数; 库中算子的模板见factortree.h中的
+// LibraryCombExpander(). 模板在注册时解析一次, 展开时只做子树替换
+class CombExpander {
+public:
+  //   注册或覆盖一个组合算子, 输入个数和是否带{param}由模板推出
+  void Register(const std::string &name, const std::string &expression) {
+    Template tmpl;
+    tmpl.body = ParseExprTree(expression);
+    Scan(tmpl.body, tmpl);
+    templates_[name] = std::move(tmpl);
+  }
+
+  bool Contains(const std::string &name) const {
+    return templates_.count(name) > 0;
+  }
+
+  //   自底向上展开, 模板中引用的其他组合算子也会展开
+  void Expand(ExprNode &node) const {
+    for (auto &arg : node.args) {
+      Expand(arg);
+    }
+    if (node.kind != ExprNode::Kind::Call) {
+      return;
+    }
+    auto it = templates_.find(node.text);
+    if (it == templates_.end()) {
+      return;
+    }
+    const Template &tmpl = it->second;
+    const size_t nargs = tmpl.nchild + (tmpl.has_param ? 1 : 0);
+    if (node.args.size() != nargs) {
+      throw std::invalid_argument(node.text + " operator should have " +
+                                  std::to_string(nargs) + " arguments");
+    }
+    ExprNode body = tmpl.body;
+    Substitute(body, node.args);
+    // 参数已经展开过, 这里只会展开模板自身引用的组合算子
+    Expand(body);
+    node = std::move(body);
+  }
+
+  std::string Expand(const std::string &expression) const {
+    ExprNode node = ParseExprTree(expression);
+    Expand(node);
+    return node.ToString();
+  }
+
+private:
+  struct Template {
+    ExprNode body;
+    size_t nchild = 0;
+    bool has_param = false;
+  };
+
+  //   输入位置: @child_data为0, @child_dataN为N-1
+  static int ChildIndex(const ExprNode &node) {
+    if (node.kind != ExprNode::Kind::Field ||
+        node.text.compare(0, 11, "@child_data") != 0) {
+      return -1;
+    }
+    if (node.text.size() == 11) {
+      return 0;
+    }
+    return std::atoi(node.text.c_str() + 11) - 1;
+  }
+
+  static void Scan(const ExprNode &node, Template &tmpl) {
+    int child = ChildIndex(node);
+    if (child >= 0) {
+      tmpl.nchild = std::max(tmpl.nchild, static_cast<size_t>(child) + 1);
+    }
+    if (node.kind == ExprNode::Kind::String && node.text == "{param}") {
+      tmpl.has_param = true;
+    }
+    for (const auto &arg : node.args) {
+      Scan(arg, tmpl);
+    }
+  }
+
+  //   args为组合算子的实参, 前nchild个为输入, 最后一个为{param}
+  static void Substitute(ExprNode &node, const std::vector<ExprNode> &args) {
+    int child = ChildIndex(node);
+    if (child >= 0) {
+      node = args[child];
+      return;
+    }
+    if (node.kind == ExprNode::Kind::String && node.text == "{param}") {
+      node = args.back();
+      return;
+    }
+    for (auto &arg : node.args) {
+      Substitute(arg, args);
+    }
+  }
+
+  std::unordered_map<std::string, Template> templates_;
+};
+
+// 建树选项, 见FactorTree::CreateTree
+struct BuildOptions {
+  //   组合算子展开为基础算子, 内部节点参与全树去重
+  bool inline_combined_ops = false;
+  //   规范化表达式, 见ExprCanonicalizer
+  bool canonicalize = false;
+};
+
+// 按选项改写表达式, 先展开组合算子, 展开出的节点再一起规范化
+// inline_combined_ops时需要给出组合算子的模板expander
+inline std::string PrepareExpression(const std::string &expression,
+                                     const BuildOptions &options,
+                                     const CombExpander *expander = nullptr) {
+  if (!options.inline_combined_ops && !options.canonicalize) {
+    return expression;
+  }
+  ExprNode node = ParseExprTree(expression);
+  if (options.inline_combined_ops) {
+    if (!expander) {
+      throw std::invalid_argument(
+          "inline_combined_ops needs the combined op templates");
+    }
+    expander->Expand(node);
+  }
+  if (options.canonicalize) {
+    return ExprCanonicalizer().Canonicalize(node);
+  }
+  return node.ToString();
+}
+
+} // namespace factor_tree
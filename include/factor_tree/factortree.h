@@ -1,11 +1,95 @@
 #pragma once
+#include "checkpoint.h"
+#include "expression.h"
 #include "operators/baseoperator.h"
+#include "outputsink.h"
+#include "plan.h"
+#include "profiler.h"
 
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <xtensor/xtensor.hpp>
 
 namespace factor_tree {
+inline const CombExpander &LibraryCombExpander();
+
+// UpdateBlock的逐行调度, 不依赖库中的实现: day_starts为块内每天第一行的
+// 行号, 升序且小于rows; 在这些行之前调用days.OnDayBegin(第0行之外先调用
+// OnDayEnd), 再对每行调用update(r, tidx). days可以是FactorTree, 也可以是
+// 手工组装的树的DayCycle
+template <typename Days, typename UpdateRow>
+inline void RunBlockRows(Days &days, size_t rows,
+                         const std::vector<size_t> &day_starts,
+                         size_t first_tidx, bool close_day,
+                         UpdateRow update) {
+  for (size_t d = 0; d < day_starts.size(); ++d) {
+    if (day_starts[d] >= rows ||
+        (d > 0 && day_starts[d] <= day_starts[d - 1])) {
+      throw std::invalid_argument("day_starts should be increasing and "
+                                  "less than the number of rows");
+    }
+  }
+  size_t next_day = 0;
+  size_t tidx = first_tidx;
+  for (size_t r = 0; r < rows; ++r, ++tidx) {
+    if (next_day < day_starts.size() && day_starts[next_day] == r) {
+      if (r > 0) {
+        days.OnDayEnd();
+      }
+      days.OnDayBegin();
+      tidx = 0;
+      ++next_day;
+    }
+    update(r, tidx);
+  }
+  if (close_day && rows > 0) {
+    days.OnDayEnd();
+  }
+}
+
+// FactorTree::UpdateInto的输入缓冲区, 由调用方持有, 在多次调用之间复用
+// 每个字段一个长度为nstock的Tensor, 字段集合不变时不再分配
+class UpdateBuffers {
+public:
+  //   把data拷贝进各字段的缓冲区, 返回Update的输入
+  const std::unordered_map<std::string, TensorPtr> &
+  Fill(const std::unordered_map<std::string, const double *> &data,
+       size_t nstock) {
+    if (!Matches(data, nstock)) {
+      tensors_.clear();
+      for (const auto &[field, values] : data) {
+        auto tensor = std::make_shared<Tensor>(Tensor::from_shape({nstock}));
+        tensors_.emplace(field, std::move(tensor));
+      }
+    }
+    for (const auto &[field, values] : data) {
+      std::copy(values, values + nstock, tensors_.find(field)->second->begin());
+    }
+    return tensors_;
+  }
+
+private:
+  bool Matches(const std::unordered_map<std::string, const double *> &data,
+               size_t nstock) const {
+    if (tensors_.size() != data.size()) {
+      return false;
+    }
+    for (const auto &[field, values] : data) {
+      auto it = tensors_.find(field);
+      if (it == tensors_.end() || it->second->size() != nstock) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::unordered_map<std::string, TensorPtr> tensors_;
+};
+
 class FactorTree {
 public:
   explicit FactorTree(const InitArgs &init_args);
@@ -14,6 +98,14 @@ public:
 
   void CreateTree(const std::string &expression);
 
+  // 按选项改写表达式后再建树, 见expression.h
+  // canonicalize: add(@a,@b)与add(@b,@a)、multiply(x,#1)与x等写法得到同一个节点
+  // inline_combined_ops: ts_rs/ts_wave等组合算子展开为基础算子, 内部的
+  // ts_diff(x,1)等与树上其他位置共享
+  void CreateTree(const std::string &expression, const BuildOptions &options) {
+    CreateTree(PrepareExpression(expression, options, Expander(options)));
+  }
+
   std::shared_ptr<xt::xtensor<double, 1>> Update(
       const std::unordered_map<std::string,
                                std::shared_ptr<xt::xtensor<double, 1>>> &data);
@@ -21,8 +113,101 @@ public:
   xt::xtensor<double, 1>
   Update(const std::unordered_map<std::string, xt::xtensor<double, 1>> &data);
 
+  // 显式指定当天时间槽tidx, 写入TreeContext::tidx. 只有header_ops的ad_*
+  // 读取它; 库中的ad_mean/ad_sum忽略这个参数, 仍按当天Update次数推算
+  std::shared_ptr<xt::xtensor<double, 1>> Update(
+      const std::unordered_map<std::string,
+                               std::shared_ptr<xt::xtensor<double, 1>>> &data,
+      size_t tidx) {
+    ScopedValue<size_t> scoped_tidx(Context().tidx, tidx);
+    return Update(data);
+  }
+
+  xt::xtensor<double, 1>
+  Update(const std::unordered_map<std::string, xt::xtensor<double, 1>> &data,
+         size_t tidx) {
+    ScopedValue<size_t> scoped_tidx(Context().tidx, tidx);
+    return Update(data);
+  }
+
+  // 供Python绑定等调用方使用: 每个字段是nstock个连续的double, 结果写入out
+  // 只读写调用方给出的内存, 不涉及Python对象, 绑定层可以在调用期间释放GIL,
+  // 不同的树可以在不同线程中同时计算. 输入拷贝进buffers中各字段的Tensor
+  // (DataOp的缓冲区是Tensor), 同一个buffers逐批次复用, 不再为每个批次分配;
+  // 结果直接写入调用方的数组. buffers不能在同时计算的树之间共用
+  // 不需要拷贝结果时可以用Update返回的指针, 它指向根节点的缓冲区,
+  // 下一次Update时会被覆盖
+  void UpdateInto(const std::unordered_map<std::string, const double *> &data,
+                  double *out, UpdateBuffers &buffers,
+                  size_t tidx = kAutoTidx) {
+    auto result = Update(buffers.Fill(data, init_args_->nstock), tidx);
+    std::copy(result->begin(), result->end(), out);
+  }
+
+  // 一次计算T个批次: data中每个字段为 T x nstock, 返回 T x nstock 的结果
+  // day_starts为块内每天第一行的行号, 升序; 在这些行之前调用OnDayBegin
+  // (第0行之外还会先调用OnDayEnd), tidx为行在当天的序号.
+  // 第一个day_start之前的行属于进行中的一天, tidx从first_tidx开始;
+  // close_day为true时最后一行之后调用OnDayEnd
+  xt::xtensor<double, 2> UpdateBlock(
+      const std::unordered_map<std::string, xt::xtensor<double, 2>> &data,
+      const std::vector<size_t> &day_starts, size_t first_tidx = 0,
+      bool close_day = true) {
+    if (data.empty()) {
+      throw std::invalid_argument("UpdateBlock needs at least one field");
+    }
+    const size_t nstock = init_args_->nstock;
+    const size_t rows = data.begin()->second.shape()[0];
+    for (const auto &[field, values] : data) {
+      if (values.shape()[0] != rows || values.shape()[1] != nstock) {
+        throw std::invalid_argument(field + " should be " +
+                                    std::to_string(rows) + " x " +
+                                    std::to_string(nstock));
+      }
+    }
+    auto out = xt::xtensor<double, 2>::from_shape({rows, nstock});
+    //   每个字段的Tensor在循环外分配一次, 逐行拷贝进去
+    std::vector<std::pair<const double *, TensorPtr>> fields;
+    std::unordered_map<std::string, TensorPtr> tensors;
+    fields.reserve(data.size());
+    tensors.reserve(data.size());
+    for (const auto &[field, values] : data) {
+      auto tensor = std::make_shared<Tensor>(Tensor::from_shape({nstock}));
+      fields.emplace_back(values.data(), tensor);
+      tensors.emplace(field, std::move(tensor));
+    }
+    RunBlockRows(*this, rows, day_starts, first_tidx, close_day,
+                 [&](size_t r, size_t tidx) {
+                   for (auto &[values, tensor] : fields) {
+                     const double *row = values + r * nstock;
+                     std::copy(row, row + nstock, tensor->begin());
+                   }
+                   auto result = Update(tensors, tidx);
+                   std::copy(result->begin(), result->end(),
+                             out.data() + r * nstock);
+                 });
+    return out;
+  }
+
+  // 计算一个批次并把结果追加到sink中名为factor的输出, 见outputsink.h
+  void UpdateToSink(
+      const std::unordered_map<std::string,
+                               std::shared_ptr<xt::xtensor<double, 1>>> &data,
+      OutputSink &sink, const std::string &factor, size_t tidx = kAutoTidx) {
+    sink.Append(factor, *Update(data, tidx));
+  }
+
   std::string ToString() const { return root_->ToString(); }
 
+  OperatorPtr GetRoot() const { return root_; }
+
+  // 本树的运行期状态和调优参数, 见TreeContext. 在CreateTree之前设置
+  // cs_batch_threads/cs_parallel_*只作用于header_ops算子, 对CreateTree
+  // 建出的树没有作用
+  TreeContext &Context() { return *GetTreeContext(init_args_); }
+
+  // 库中编译的算子由根节点递归处理整棵树; DayCycle的惰性重置只用于
+  // header_ops算子手工组装的树, CreateTree建出的树不含这些算子
   void OnDayBegin() { root_->OnDayBegin(); }
   void OnDayEnd() { root_->OnDayEnd(); }
 
@@ -30,9 +215,105 @@ public:
 
   void LoadCheckpoint(const std::string &filename);
 
+  // 按节点保存/加载状态, 共享节点只处理一次, 见checkpoint.h
+  // CreateTree建出的树没有header_ops算子, 只有根节点一项
+  void SaveDagCheckpoint(const std::string &filename) const {
+    std::ofstream os(filename, std::ios::binary | std::ios::trunc);
+    if (!os) {
+      throw std::runtime_error("cannot open checkpoint file " + filename);
+    }
+    factor_tree::SaveDagCheckpoint(root_, os);
+  }
+
+  void LoadDagCheckpoint(const std::string &filename) {
+    std::ifstream is(filename, std::ios::binary);
+    if (!is) {
+      throw std::runtime_error("cannot open checkpoint file " + filename);
+    }
+    factor_tree::LoadDagCheckpoint(root_, is);
+  }
+
+  // 页对齐的mmap格式, nthread个线程并行保存/加载header_ops节点
+  // CreateTree建出的树只有根节点一项, 实际为单线程
+  void SaveMappedCheckpoint(const std::string &filename,
+                            size_t nthread = 1) const {
+    factor_tree::SaveMappedCheckpoint(root_, filename, nthread);
+  }
+
+  //   返回保存时的RequestIdx
+  size_t LoadMappedCheckpoint(const std::string &filename,
+                              size_t nthread = 1) {
+    return factor_tree::LoadMappedCheckpoint(root_, filename, nthread);
+  }
+
+  // 在两次Update之间调用, 拷贝完状态即返回, 文件由writer在后台写出
+  // CreateTree建出的树没有可拷贝的状态对象, 在调用线程上同步序列化
+  void SaveCheckpointAsync(AsyncCheckpointWriter &writer,
+                           const std::string &filename,
+                           size_t nthread = 1) const {
+    writer.Save(root_, filename, nthread);
+  }
+
+  // 增量checkpoint, 只保存相对基准(SaveMappedCheckpoint的文件)变化的页
+  void SaveDeltaCheckpoint(const std::string &base_filename,
+                           const std::string &filename,
+                           size_t nthread = 1) const {
+    WriteDeltaCheckpoint(factor_tree::SnapshotStates(root_, nthread),
+                         base_filename, filename);
+  }
+
+  void SaveDeltaCheckpointAsync(AsyncCheckpointWriter &writer,
+                                const std::string &base_filename,
+                                const std::string &filename,
+                                size_t nthread = 1) const {
+    writer.SaveDelta(root_, base_filename, filename, nthread);
+  }
+
+  //   返回增量的RequestIdx
+  size_t LoadDeltaCheckpoint(const std::string &base_filename,
+                             const std::string &filename,
+                             size_t nthread = 1) {
+    return factor_tree::LoadDeltaCheckpoint(root_, base_filename, filename,
+                                            nthread);
+  }
+
+  // 以子表达式为键保存/恢复状态, 修改因子后共享的子表达式不用重新预热
+  // 只对header_ops节点有效, CreateTree建出的树只有整个表达式一个键
+  void SaveSubtreeCheckpoint(const std::string &filename,
+                             size_t nthread = 1) const {
+    factor_tree::SaveSubtreeCheckpoint(root_, filename, nthread);
+  }
+
+  //   返回值中的cold为没有恢复状态的节点, 预热方法见SubtreeRestoreResult
+  SubtreeRestoreResult LoadSubtreeCheckpoint(const std::string &filename,
+                                             size_t nthread = 1) {
+    return factor_tree::LoadSubtreeCheckpoint(root_, filename, nthread);
+  }
+
+  // 把本树的DAG导出为计划文件供离线检查, 见plan.h. 计划不能用来建树,
+  // 不缩短启动时间. tag标识生成计划的库版本, PlanFile按tag校验
+  void SavePlan(const std::string &filename, const std::string &tag,
+                const BuildOptions &options = {}) const {
+    PlanCompiler compiler(tag, options, Expander(options));
+    compiler.AddExpression(ToString());
+    compiler.Save(filename);
+  }
+
+  // 本树各节点的耗时统计, 按累计耗时降序取前top_n个(0表示全部)
+  // 按InitArgs归属到本树, 不依赖子节点的登记. 需要先开启OpProfiler;
+  // 库中编译的算子只有在库本身用这些头文件重新编译时才有数据, 见profiler.h
+  std::vector<OpProfile> Profile(size_t top_n = 0) const {
+    return OpProfiler::Instance().Report(top_n, init_args_.get());
+  }
+
   static std::string ParseExpression(const std::string &expression);
 
 private:
+  //   只有展开组合算子时才探测模板
+  static const CombExpander *Expander(const BuildOptions &options) {
+    return options.inline_combined_ops ? &LibraryCombExpander() : nullptr;
+  }
+
   size_t next_req_idx_;
   std::string expression_;
   OperatorPtr root_;
@@ -41,4 +322,39 @@ private:
   InitArgsPtr init_args_;
 };
 
+// 库中组合算子的展开模板, 取自各算子的GetOpExpression(), 不在头文件中另抄一份
+// 对每个组合算子建一棵只有该算子的树, 根节点是GeneralCombOp时登记它的模板;
+// 库中没有或不是GeneralCombOp实现的算子不展开. 首次调用时探测一次
+inline const CombExpander &LibraryCombExpander() {
+  static const CombExpander expander = [] {
+    struct Signature {
+      const char *name;
+      size_t nchild;
+    };
+    //   operators.md中列出的带window参数的组合算子
+    const Signature signatures[] = {
+        {"ts_meanstd", 1},     {"ts_squaremean", 1}, {"ts_autocorr", 1},
+        {"ts_rs", 1},          {"ts_rsi", 1},        {"ts_wave", 1},
+        {"ts_gammaalpha", 1},  {"ts_gammabeta", 1},  {"ts_downvarpct", 1},
+        {"ts_min_max_cps", 1}, {"ts_conv", 2},       {"ts_twapywap", 2}};
+    CombExpander e;
+    for (const auto &signature : signatures) {
+      std::string expression = std::string(signature.name) + "(@x" +
+                               (signature.nchild == 2 ? ",@y" : "") + ",2)";
+      FactorTree tree(InitArgs(1));
+      try {
+        tree.CreateTree(expression);
+      } catch (const std::exception &) {
+        continue;
+      }
+      auto comb = dynamic_cast<const GeneralCombOp *>(tree.GetRoot().get());
+      if (comb) {
+        e.Register(signature.name, comb->GetOpExpression());
+      }
+    }
+    return e;
+  }();
+  return expander;
+}
+
 } // namespace factor_tree
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+namespace factor_tree {
+
+// 只读映射整个文件, 析构时解除映射
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("cannot open " + filename);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      throw std::runtime_error("cannot map empty file " + filename);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    void *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("cannot mmap " + filename);
+    }
+    data_ = static_cast<const char *>(data);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() { ::munmap(const_cast<char *>(data_), size_); }
+
+  //   即将整体读取时提示内核预读
+  void WillNeed() const {
+    ::madvise(const_cast<char *>(data_), size_, MADV_WILLNEED);
+  }
+
+  const char *Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace factor_tree
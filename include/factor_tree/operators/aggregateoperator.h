@@ -0,0 +1,181 @@
+#pragma once
+
+#include "intradayoperator.h"
+
+#include <cereal/types/vector.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace header_ops {
+
+// ad_mean / ad_sum 的状态, 按 (batch_per_day x window x nstock) 连续存储,
+// 每个时间槽单独维护窗口内的和, 每次Update只触及当前时间槽
+// 时间槽取TreeContext::tidx, 未指定时按当天Update次数推算(即要求频率固定)
+struct AdWindowState : public BaseState {
+  static constexpr bool kDayAware = false;
+
+  std::shared_ptr<const TreeContext> context;
+  size_t window = 0;
+  size_t nstock = 0;
+  size_t batch_per_day = 0;
+  //   历史数据, 下标为 (tidx * window + 天) * nstock + 标的
+  std::vector<double> data;
+  //   每个时间槽的窗口和, 下标为 tidx * nstock + 标的
+  std::vector<double> sum;
+  std::vector<int32_t> valid_count;
+  //   每个时间槽下一个写入的天, 已有天数, 距上次重算的天数
+  std::vector<uint32_t> slot_pos;
+  std::vector<uint32_t> slot_count;
+  std::vector<uint32_t> slot_refresh;
+  //   时间槽当天是否已写入过, 重复写入同一时间槽时覆盖当天的值
+  IntradayLanes slot_lanes;
+  IntradayLanes auto_lane;
+  size_t next_auto_tidx = 0;
+
+  AdWindowState() = default;
+  AdWindowState(size_t window, const InitArgsPtr &config)
+      : context(GetTreeContext(config)), window(window),
+        nstock(config->nstock), batch_per_day(config->batch_per_day),
+        data(batch_per_day * window * nstock, kNaN),
+        sum(batch_per_day * nstock, 0.0),
+        valid_count(batch_per_day * nstock, 0),
+        slot_pos(batch_per_day, 0), slot_count(batch_per_day, 0),
+        slot_refresh(batch_per_day, 0), slot_lanes(config, batch_per_day),
+        auto_lane(config, 1) {}
+
+  //   写入当前批次, 返回时间槽
+  size_t Push(const Tensor &x) {
+    size_t tidx = CurrentTidx();
+    double *slot_sum = sum.data() + tidx * nstock;
+    int32_t *slot_valid = valid_count.data() + tidx * nstock;
+    double *rows = data.data() + tidx * window * nstock;
+
+    double *row = nullptr;
+    if (slot_lanes.Stale(tidx)) {
+      // 当天第一次写入该时间槽, 窗口前移一天
+      row = rows + slot_pos[tidx] * nstock;
+      if (slot_count[tidx] < window) {
+        ++slot_count[tidx];
+        std::fill(row, row + nstock, kNaN);
+      }
+      slot_pos[tidx] = (slot_pos[tidx] + 1) % window;
+    } else {
+      row = rows + (slot_pos[tidx] + window - 1) % window * nstock;
+    }
+    for (size_t i = 0; i < nstock; ++i) {
+      if (!std::isnan(row[i])) {
+        slot_sum[i] -= row[i];
+        --slot_valid[i];
+      }
+      double xn = x(i);
+      if (!std::isnan(xn)) {
+        slot_sum[i] += xn;
+        ++slot_valid[i];
+      }
+      row[i] = xn;
+    }
+    if (++slot_refresh[tidx] >= window) {
+      Refresh(tidx);
+    }
+    return tidx;
+  }
+
+  //   滚动和有浮点误差累积, 每隔window次从历史数据重算
+  void Refresh(size_t tidx) {
+    slot_refresh[tidx] = 0;
+    double *slot_sum = sum.data() + tidx * nstock;
+    int32_t *slot_valid = valid_count.data() + tidx * nstock;
+    std::fill(slot_sum, slot_sum + nstock, 0.0);
+    std::fill(slot_valid, slot_valid + nstock, 0);
+    const double *rows = data.data() + tidx * window * nstock;
+    for (size_t k = 0; k < slot_count[tidx]; ++k) {
+      const double *row = rows + k * nstock;
+      for (size_t i = 0; i < nstock; ++i) {
+        if (!std::isnan(row[i])) {
+          slot_sum[i] += row[i];
+          ++slot_valid[i];
+        }
+      }
+    }
+  }
+
+  void Detach() {
+    slot_lanes = slot_lanes.Snapshot();
+    auto_lane = auto_lane.Snapshot();
+  }
+
+  template <class Archive> void serialize(Archive &ar) {
+    ar(window, nstock, batch_per_day, data, sum, valid_count, slot_pos,
+       slot_count, slot_refresh, slot_lanes, auto_lane, next_auto_tidx);
+  }
+
+private:
+  size_t CurrentTidx() {
+    size_t tidx = context->tidx;
+    if (tidx == kAutoTidx) {
+      if (auto_lane.Stale(0)) {
+        next_auto_tidx = 0;
+      }
+      tidx = next_auto_tidx++;
+    }
+    if (tidx >= batch_per_day) {
+      throw std::out_of_range("tidx " + std::to_string(tidx) +
+                              " exceeds batch_per_day " +
+                              std::to_string(batch_per_day));
+    }
+    return tidx;
+  }
+};
+
+// ad_mean(x, window): 最近window天同一时间槽的均值, min_count=1
+struct AdMeanState : public AdWindowState {
+  using AdWindowState::AdWindowState;
+
+  void Update(const Tensor &x, Tensor &out) {
+    size_t tidx = Push(x);
+    const double *slot_sum = sum.data() + tidx * nstock;
+    const int32_t *slot_valid = valid_count.data() + tidx * nstock;
+    for (size_t i = 0; i < nstock; ++i) {
+      out(i) = slot_valid[i] > 0 ? slot_sum[i] / slot_valid[i] : kNaN;
+    }
+  }
+};
+
+// ad_sum(x, window): 最近window天同一时间槽的和, min_count=1
+struct AdSumState : public AdWindowState {
+  using AdWindowState::AdWindowState;
+
+  void Update(const Tensor &x, Tensor &out) {
+    size_t tidx = Push(x);
+    const double *slot_sum = sum.data() + tidx * nstock;
+    const int32_t *slot_valid = valid_count.data() + tidx * nstock;
+    for (size_t i = 0; i < nstock; ++i) {
+      out(i) = slot_valid[i] > 0 ? slot_sum[i] : kNaN;
+    }
+  }
+};
+
+// 不替换库中的ad_mean/ad_sum, 见baseoperator.h中header_ops的说明
+// 库中的实现不读TreeContext::tidx, 总是按当天Update次数推算时间槽
+class AdMean : public TsWindowUnaryOp<AdMean, AdMeanState> {
+public:
+  static constexpr const char *kName = "ad_mean";
+  using TsWindowUnaryOp::TsWindowUnaryOp;
+  OperatorType GetType() const override { return OperatorType::AdMean; }
+};
+
+class AdSum : public TsWindowUnaryOp<AdSum, AdSumState> {
+public:
+  static constexpr const char *kName = "ad_sum";
+  using TsWindowUnaryOp::TsWindowUnaryOp;
+  OperatorType GetType() const override { return OperatorType::AdSum; }
+};
+
+} // namespace header_ops
+} // namespace factor_tree
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "../profiler.h"
+
 #include <cereal/archives/binary.hpp>
 #include <xtensor/xtensor.hpp>
 #include <xtensor/xtensor_forward.hpp>
@@ -7,10 +9,15 @@
 #include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+// 本文件不再使用<regex>, 保留给依赖间接包含的下游代码
 #include <regex>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
@@ -119,6 +126,10 @@ enum class OperatorType : int {
   TsCoskewness,
   AdMean,
   AdSum,
+  CsOLSResK,
+  TsOLSResK,
+  TsOLSAlphaK,
+  TsOLSBetaK,
 };
 
 enum class ArgType : int {
@@ -168,6 +179,8 @@ public:
   inline TensorPtr GetLeftColumeData() { return input_columes_[0]; }
   inline TensorPtr GetRightColumeData() { return input_columes_[1]; }
 
+  inline size_t NumColumes() const { return input_columes_.size(); }
+
 private:
   std::vector<TensorPtr> input_columes_;
 };
@@ -195,8 +208,19 @@ private:
   ArgType type_;
 };
 
+// cs_group_*算子共享的分组索引, 见csgroupoperator.h
+struct GroupIndexRegistry;
+// 截面算子批量执行, 见csbatch.h
+class CsBatchRegistry;
+// 截面并行共用的线程池, 见threadpool.h
+class ThreadPool;
+
+// 未显式指定当日时间槽时, ad算子按当天Update次数推算
+constexpr size_t kAutoTidx = std::numeric_limits<size_t>::max();
+
 // 初始化参数。
 // 通过结构体封装,以后新加参数就不需要改原有Operator接口
+// 库按这里的布局分配和拷贝InitArgs, 运行期参数加在TreeContext中
 
 struct InitArgs {
   //   nstock: 标的数量
@@ -226,6 +250,76 @@ struct OpInitArgs {
   InitArgsPtr config;
 };
 
+// 一棵树的运行期状态和调优参数
+// InitArgs由库按原有的大小分配和拷贝, 不能再加字段, 这些参数放在按InitArgs
+// 对象登记的TreeContext中. 每个InitArgs对象一份, 不随InitArgs拷贝:
+// FactorTree构造时拷贝一份InitArgs, 需要在构造之后通过FactorTree::Context()
+// 设置, 再CreateTree
+struct TreeContext {
+  //   day_epoch: 交易日序号, 运行期由DayCycle::OnDayBegin递增, 不参与序列化
+  //   header_ops的日内算子按它惰性重置, 换日时不需要遍历和清空状态
+  size_t day_epoch = 0;
+  //   tidx: 当前批次在当天的时间槽, 由FactorTree::Update(data, tidx)设置,
+  //   header_ops的ad_*读取
+  size_t tidx = kAutoTidx;
+  //   group_indices: 同一棵树内按group表达式共享的分组索引, 首次使用时创建
+  std::shared_ptr<GroupIndexRegistry> group_indices;
+
+  //   以下截面参数只被header_ops的cs_*算子读取, 对CreateTree建出的树
+  //   (库中编译的算子)没有作用
+  //   cs_batch_threads: 大于0时同一批次的cs_rank/cs_*归一化节点合并执行,
+  //   按节点分块并行计算, 0表示逐个节点计算
+  size_t cs_batch_threads = 0;
+  std::shared_ptr<CsBatchRegistry> cs_batch;
+  //   cs_parallel_threads: 大于1且nstock不小于cs_parallel_threshold时,
+  //   cs_rank/cs_ols_res/cs_group_*/cs_*归一化在单个节点内按块并行计算
+  size_t cs_parallel_threads = 0;
+  size_t cs_parallel_threshold = 100000;
+  //   cs_pool: 截面并行共用的线程池, 首个满足条件的节点创建
+  std::shared_ptr<ThreadPool> cs_pool;
+};
+
+// config对应的TreeContext, 第一次调用时创建. 算子在构造时取一次并持有,
+// 计算时不再查表; config释放后同一地址上的新InitArgs得到新的TreeContext
+inline std::shared_ptr<TreeContext> GetTreeContext(const InitArgsPtr &config) {
+  struct Entry {
+    std::weak_ptr<InitArgs> owner;
+    std::shared_ptr<TreeContext> context;
+  };
+  static std::mutex mutex;
+  static std::unordered_map<const InitArgs *, Entry> contexts;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &entry = contexts[config.get()];
+  if (entry.owner.expired()) {
+    //   顺便清理已释放的InitArgs, 表的大小与存活的树的数量有关
+    for (auto it = contexts.begin(); it != contexts.end();) {
+      if (&it->second != &entry && it->second.owner.expired()) {
+        it = contexts.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    entry.owner = config;
+    entry.context = std::make_shared<TreeContext>();
+  }
+  return entry.context;
+}
+
+// 作用域内把value设为scoped, 离开作用域时(包括抛出异常)恢复原值
+template <typename T> class ScopedValue {
+public:
+  ScopedValue(T &value, T scoped) : value_(value), saved_(value) {
+    value_ = scoped;
+  }
+  ScopedValue(const ScopedValue &) = delete;
+  ScopedValue &operator=(const ScopedValue &) = delete;
+  ~ScopedValue() { value_ = saved_; }
+
+private:
+  T &value_;
+  T saved_;
+};
+
 class BaseOperator {
 public:
   BaseOperator() = delete;
@@ -295,6 +389,16 @@ public:
   inline virtual void OnDayBegin() {};
   inline virtual void OnDayEnd() {};
 
+  //   直接子节点, 只有DagOp会登记; 库中编译的算子和组合算子为空,
+  //   遍历时按叶子节点处理
+  inline const std::vector<OperatorPtr> &GetChilds() const { return childs_; }
+
+protected:
+  inline void AddChild(const OperatorPtr &child) { childs_.push_back(child); }
+  inline void SetChilds(std::vector<OperatorPtr> childs) {
+    childs_ = std::move(childs);
+  }
+
 private:
   OpInitArgs op_config_;
   RequestIdx current_idx_;
@@ -302,15 +406,69 @@ private:
   std::vector<OperatorPtr> childs_;
 };
 
+// 状态的拷贝, 调用时把拷贝序列化, 与SaveState写出的数据相同
+// 拷贝与节点无关, 可以在其他线程上序列化, 见SnapshotStates
+using StateWriter = std::function<void(cereal::BinaryOutputArchive &)>;
+
+// 头文件中的算子模板(UnaryOp/BinaryOp/NaryOp)和header_ops::ConstantOp
+// 另外实现的接口, 用dynamic_cast取得. 不加在BaseOperator上, 库中编译的算子
+// 保持原有的对象布局和虚表; 它们没有DagOp, 按原有的递归接口处理自己的
+// 整棵子树
+// DagOp的子节点由AddChild登记, 日终处理只作用于当前节点
+class DagOp {
+public:
+  virtual ~DagOp() = default;
+
+  //   OnDayBegin/OnDayEnd有实际处理时返回true, 加入CollectDayAwareOps的列表
+  virtual bool IsDayAware() const { return false; }
+
+  //   只读写当前节点自身的状态, 不递归子节点, 见checkpoint.h
+  //   共享节点按节点逐个保存时只写一次
+  virtual bool HasState() const { return false; }
+  virtual void LoadState(cereal::BinaryInputArchive &) {}
+  virtual void SaveState(cereal::BinaryOutputArchive &) const {}
+  //   返回空时调用方用SaveState当场序列化
+  virtual StateWriter CopyState() const { return nullptr; }
+};
+
+inline const DagOp *AsDagOp(const BaseOperator *op) {
+  return dynamic_cast<const DagOp *>(op);
+}
+
+inline DagOp *AsDagOp(BaseOperator *op) { return dynamic_cast<DagOp *>(op); }
+
+// RealOp重写了SaveCheckpoint(自身有状态)时必须同时重写SaveState,
+// 否则按节点保存的checkpoint会漏掉它的状态. Base为RealOp的算子模板
+template <typename RealOp, typename Base> constexpr bool SavesOwnState() {
+  using SaveFn = void (Base::*)(cereal::BinaryOutputArchive &) const;
+  using StateFn = void (DagOp::*)(cereal::BinaryOutputArchive &) const;
+  return std::is_same_v<decltype(&RealOp::SaveCheckpoint), SaveFn> ||
+         !std::is_same_v<decltype(&RealOp::SaveState), StateFn>;
+}
+
+// 只在头文件中实现的算子(tsoperator.h等)放在header_ops命名空间
+// 库的CreateTree不会创建它们, 表达式中的ts_tcorr等仍由库中编译的实现计算;
+// 它们不替换库中的算子, 只能手工组装成树使用(见test/). 与库中的同名类
+// (如factor_tree::TsTcorr)放在不同的命名空间, 同一程序中不会有两份定义
+namespace header_ops {}
+
 struct BaseState {
+  // 状态不需要日终处理时置为false, 算子就不会加入CollectDayAwareOps的列表
+  static constexpr bool kDayAware = true;
   virtual void OnDayBegin() {};
   virtual void OnDayEnd() {};
+  // CopyState在状态的拷贝上调用, 拷贝若还引用树上会变化的对象(例如
+  // TreeContext), 在这里换成与树无关的快照. 非虚函数, 由状态类型静态调用
+  void Detach() {}
 };
 
-template <typename RealOp> class UnaryOp : public BaseOperator {
+template <typename RealOp>
+class UnaryOp : public BaseOperator, public DagOp {
 public:
   UnaryOp(std::shared_ptr<BaseOperator> &child, const OpInitArgs &init_args)
-      : BaseOperator(init_args), child_(child) {}
+      : BaseOperator(init_args), child_(child) {
+    AddChild(child_);
+  }
   void LoadCheckpoint(cereal::BinaryInputArchive &ar) override {
     UnaryChildLoadCheckpoint(ar);
   }
@@ -319,10 +477,6 @@ public:
     UnaryChildSaveCheckpoint(ar);
   }
 
-  void OnDayBegin() override { UnaryChildOnDayBegin(); }
-
-  void OnDayEnd() override { UnaryChildOnDayEnd(); }
-
   void UnaryChildLoadCheckpoint(cereal::BinaryInputArchive &ar) {
     child_->LoadCheckpoint(ar);
   }
@@ -330,9 +484,6 @@ public:
     child_->SaveCheckpoint(ar);
   }
 
-  void UnaryChildOnDayBegin() { child_->OnDayBegin(); }
-  void UnaryChildOnDayEnd() { child_->OnDayEnd(); }
-
   std::shared_ptr<BaseOperator> GetChild() const { return child_; }
 
   //  计算函数，直接返回结果
@@ -340,27 +491,41 @@ public:
     if (GetOpCacheIdx() == idx) {
       return OpOutput(GetOpResultBuffer());
     }
+    static_assert(SavesOwnState<RealOp, UnaryOp>(),
+                  "ops overriding SaveCheckpoint should override SaveState");
     DCHECK(idx == GetOpCacheIdx() + 1);
     auto child_output = child_->GetResult(idx);
     OpInput input{child_output.GetTensorPtr()};
     OpOutput output(GetOpResultBuffer());
 
+    FACTOR_TREE_PROFILE_OP(this, 2 * Nstock() * sizeof(double));
     static_cast<RealOp *>(this)->Update(input, output);
 
     UpdateRequestIdx(idx);
     return output;
   };
 
+protected:
+  //   改接子节点, 只在建树完成后、第一次计算前由合并节点的pass调用
+  void ReplaceChild(const OperatorPtr &child) {
+    child_ = child;
+    SetChilds({child_});
+  }
+
 private:
   std::shared_ptr<BaseOperator> child_;
 };
 
-template <typename RealOp> class BinaryOp : public BaseOperator {
+template <typename RealOp>
+class BinaryOp : public BaseOperator, public DagOp {
 public:
   BinaryOp(OperatorPtr &left_child, OperatorPtr &right_child,
            const OpInitArgs &init_args)
       : BaseOperator(init_args), left_child_(left_child),
-        right_child_(right_child) {}
+        right_child_(right_child) {
+    AddChild(left_child_);
+    AddChild(right_child_);
+  }
   void LoadCheckpoint(cereal::BinaryInputArchive &ar) override {
     BinaryChildLoadCheckpoint(ar);
   }
@@ -369,10 +534,6 @@ public:
     BinaryChildSaveCheckpoint(ar);
   }
 
-  void OnDayBegin() override { BinaryChildOnDayBegin(); }
-
-  void OnDayEnd() override { BinaryChildOnDayEnd(); }
-
   void BinaryChildLoadCheckpoint(cereal::BinaryInputArchive &ar) {
     left_child_->LoadCheckpoint(ar);
     right_child_->LoadCheckpoint(ar);
@@ -383,15 +544,6 @@ public:
     right_child_->SaveCheckpoint(ar);
   }
 
-  void BinaryChildOnDayBegin() {
-    left_child_->OnDayBegin();
-    right_child_->OnDayBegin();
-  }
-  void BinaryChildOnDayEnd() {
-    left_child_->OnDayEnd();
-    right_child_->OnDayEnd();
-  }
-
   // Getters for child operators
   OperatorPtr GetLeftChild() const { return left_child_; }
 
@@ -401,6 +553,8 @@ public:
     if (GetOpCacheIdx() == idx) {
       return OpOutput(GetOpResultBuffer());
     }
+    static_assert(SavesOwnState<RealOp, BinaryOp>(),
+                  "ops overriding SaveCheckpoint should override SaveState");
     DCHECK(idx == GetOpCacheIdx() + 1);
     auto left_output = left_child_->GetResult(idx);
     auto right_output = right_child_->GetResult(idx);
@@ -411,6 +565,7 @@ public:
     //   有输入的Op需要实现这个接口
     //   即除data,constant,combined op外的所有算子都需要实现这个接口
 
+    FACTOR_TREE_PROFILE_OP(this, 3 * Nstock() * sizeof(double));
     static_cast<RealOp *>(this)->Update(input, output);
 
     // 更新缓存标记为最新的idx
@@ -423,6 +578,60 @@ private:
   OperatorPtr right_child_;
 };
 
+// 任意个子节点的算子, 子节点顺序即表达式中的参数顺序
+template <typename RealOp>
+class NaryOp : public BaseOperator, public DagOp {
+public:
+  NaryOp(const std::vector<OperatorPtr> &childs, const OpInitArgs &init_args)
+      : BaseOperator(init_args) {
+    for (const auto &child : childs) {
+      AddChild(child);
+    }
+  }
+  void LoadCheckpoint(cereal::BinaryInputArchive &ar) override {
+    NaryChildLoadCheckpoint(ar);
+  }
+
+  void SaveCheckpoint(cereal::BinaryOutputArchive &ar) const override {
+    NaryChildSaveCheckpoint(ar);
+  }
+
+  void NaryChildLoadCheckpoint(cereal::BinaryInputArchive &ar) {
+    for (const auto &child : GetChilds()) {
+      child->LoadCheckpoint(ar);
+    }
+  }
+
+  void NaryChildSaveCheckpoint(cereal::BinaryOutputArchive &ar) const {
+    for (const auto &child : GetChilds()) {
+      child->SaveCheckpoint(ar);
+    }
+  }
+
+  OpOutput GetResult(RequestIdx idx) override final {
+    if (GetOpCacheIdx() == idx) {
+      return OpOutput(GetOpResultBuffer());
+    }
+    static_assert(SavesOwnState<RealOp, NaryOp>(),
+                  "ops overriding SaveCheckpoint should override SaveState");
+    DCHECK(idx == GetOpCacheIdx() + 1);
+    std::vector<TensorPtr> input_columes;
+    input_columes.reserve(GetChilds().size());
+    for (const auto &child : GetChilds()) {
+      input_columes.push_back(child->GetResult(idx).GetTensorPtr());
+    }
+    OpInput input(std::move(input_columes));
+    OpOutput output(GetOpResultBuffer());
+
+    FACTOR_TREE_PROFILE_OP(this, (GetChilds().size() + 1) * Nstock() *
+                                     sizeof(double));
+    static_cast<RealOp *>(this)->Update(input, output);
+
+    UpdateRequestIdx(idx);
+    return output;
+  };
+};
+
 template <typename State> class StateClass {
 public:
   StateClass(State &&state) : state_(std::move(state)) {}
@@ -430,6 +639,11 @@ public:
   void StateSaveCheckpoint(cereal::BinaryOutputArchive &ar) const {
     ar(state_);
   }
+  StateWriter StateCopy() const {
+    auto copy = std::make_shared<State>(state_);
+    copy->Detach();
+    return [copy](cereal::BinaryOutputArchive &ar) { ar(*copy); };
+  }
   void StateOnDayBegin() { state_.OnDayBegin(); }
   void StateOnDayEnd() { state_.OnDayEnd(); }
 
@@ -449,8 +663,6 @@ public:
   using StateClass<State>::GetState;
   using UnaryOp<RealOp>::UnaryChildLoadCheckpoint;
   using UnaryOp<RealOp>::UnaryChildSaveCheckpoint;
-  using UnaryOp<RealOp>::UnaryChildOnDayBegin;
-  using UnaryOp<RealOp>::UnaryChildOnDayEnd;
 
   StatefulUnaryOp(OperatorPtr &child, State &&state,
                   const OpInitArgs &init_args)
@@ -467,14 +679,20 @@ public:
     StateSaveCheckpoint(ar);
   }
 
-  void OnDayBegin() override final {
-    StateOnDayBegin();
-    UnaryChildOnDayBegin();
+  bool HasState() const override final { return true; }
+  void LoadState(cereal::BinaryInputArchive &ar) override final {
+    StateLoadCheckpoint(ar);
+  }
+  void SaveState(cereal::BinaryOutputArchive &ar) const override final {
+    StateSaveCheckpoint(ar);
   }
-  void OnDayEnd() override final {
-    StateOnDayEnd();
-    UnaryChildOnDayEnd();
+  StateWriter CopyState() const override final {
+    return StateClass<State>::StateCopy();
   }
+
+  void OnDayBegin() override final { StateOnDayBegin(); }
+  void OnDayEnd() override final { StateOnDayEnd(); }
+  bool IsDayAware() const override final { return State::kDayAware; }
 };
 
 template <typename RealOp, typename State>
@@ -487,8 +705,6 @@ public:
   using StateClass<State>::GetState;
   using BinaryOp<RealOp>::BinaryChildLoadCheckpoint;
   using BinaryOp<RealOp>::BinaryChildSaveCheckpoint;
-  using BinaryOp<RealOp>::BinaryChildOnDayBegin;
-  using BinaryOp<RealOp>::BinaryChildOnDayEnd;
 
   StatefulBinaryOp(OperatorPtr &left_child, OperatorPtr &right_child,
                    State &&state, const OpInitArgs &init_args)
@@ -504,15 +720,61 @@ public:
     StateSaveCheckpoint(ar);
   }
 
-  void OnDayBegin() override final {
-    StateOnDayBegin();
-    BinaryChildOnDayBegin();
+  bool HasState() const override final { return true; }
+  void LoadState(cereal::BinaryInputArchive &ar) override final {
+    StateLoadCheckpoint(ar);
+  }
+  void SaveState(cereal::BinaryOutputArchive &ar) const override final {
+    StateSaveCheckpoint(ar);
+  }
+  StateWriter CopyState() const override final {
+    return StateClass<State>::StateCopy();
   }
 
-  void OnDayEnd() override final {
-    StateOnDayEnd();
-    BinaryChildOnDayEnd();
+  void OnDayBegin() override final { StateOnDayBegin(); }
+  void OnDayEnd() override final { StateOnDayEnd(); }
+  bool IsDayAware() const override final { return State::kDayAware; }
+};
+
+template <typename RealOp, typename State>
+class StatefulNaryOp : public NaryOp<RealOp>, public StateClass<State> {
+public:
+  using StateClass<State>::StateLoadCheckpoint;
+  using StateClass<State>::StateSaveCheckpoint;
+  using StateClass<State>::StateOnDayBegin;
+  using StateClass<State>::StateOnDayEnd;
+  using StateClass<State>::GetState;
+  using NaryOp<RealOp>::NaryChildLoadCheckpoint;
+  using NaryOp<RealOp>::NaryChildSaveCheckpoint;
+
+  StatefulNaryOp(const std::vector<OperatorPtr> &childs, State &&state,
+                 const OpInitArgs &init_args)
+      : NaryOp<RealOp>(childs, init_args), StateClass<State>(std::move(state)) {
+  }
+  void LoadCheckpoint(cereal::BinaryInputArchive &ar) override final {
+    NaryChildLoadCheckpoint(ar);
+    StateLoadCheckpoint(ar);
+  }
+
+  void SaveCheckpoint(cereal::BinaryOutputArchive &ar) const override final {
+    NaryChildSaveCheckpoint(ar);
+    StateSaveCheckpoint(ar);
+  }
+
+  bool HasState() const override final { return true; }
+  void LoadState(cereal::BinaryInputArchive &ar) override final {
+    StateLoadCheckpoint(ar);
   }
+  void SaveState(cereal::BinaryOutputArchive &ar) const override final {
+    StateSaveCheckpoint(ar);
+  }
+  StateWriter CopyState() const override final {
+    return StateClass<State>::StateCopy();
+  }
+
+  void OnDayBegin() override final { StateOnDayBegin(); }
+  void OnDayEnd() override final { StateOnDayEnd(); }
+  bool IsDayAware() const override final { return State::kDayAware; }
 };
 
 class GeneralCombOp : public BaseOperator {
@@ -582,6 +844,11 @@ public:
   }
 
   OpOutput GetResult(RequestIdx input) override final {
+    //   已缓存时不计数, 与其他算子一致
+    if (OpProfiler::Enabled() && real_operator_->GetOpCacheIdx() != input) {
+      FACTOR_TREE_PROFILE_SUBTREE(this);
+      return real_operator_->GetResult(input);
+    }
     return real_operator_->GetResult(input);
   }
 
@@ -594,6 +861,41 @@ private:
   OperatorPtr real_operator_;
 };
 
+// 组合算子的表达式模板, 按占位符切分为若干段, 实例化时用参数值拼接
+// 代替每个实例都做一次std::regex_replace. 库中的组合算子在预编译的库里
+// 实例化UnaryCombOp2, 仍用编译时的实现, CreateTree的建树耗时不变; 只有
+// 在本头文件中新实例化的组合算子受益
+class ExprTemplate {
+public:
+  ExprTemplate(const std::string &text, const std::string &placeholder) {
+    size_t begin = 0;
+    size_t pos;
+    while ((pos = text.find(placeholder, begin)) != std::string::npos) {
+      pieces_.push_back(text.substr(begin, pos - begin));
+      begin = pos + placeholder.size();
+    }
+    pieces_.push_back(text.substr(begin));
+    for (const auto &piece : pieces_) {
+      length_ += piece.size();
+    }
+  }
+
+  std::string Instantiate(const std::string &value) const {
+    std::string out;
+    out.reserve(length_ + (pieces_.size() - 1) * value.size());
+    out += pieces_[0];
+    for (size_t k = 1; k < pieces_.size(); ++k) {
+      out += value;
+      out += pieces_[k];
+    }
+    return out;
+  }
+
+private:
+  std::vector<std::string> pieces_;
+  size_t length_ = 0;
+};
+
 template <typename T> class UnaryCombOp : public GeneralCombOp {
 public:
   UnaryCombOp(OperatorPtr &child, const OpInitArgs &init_args)
@@ -647,9 +949,9 @@ public:
   OperatorPtr GetChildOp() const { return GetChild("@child_data"); }
 
   void CombOpInit() override final {
-    std::string expression = std::regex_replace(
-        GetOpExpression(), std::regex("\\{param\\}"), std::to_string(param_));
-    SetExpression(expression);
+    // 同一种组合算子的模板只切分一次, 之后每个实例只做拼接
+    static const ExprTemplate expr_template(GetOpExpression(), "{param}");
+    SetExpression(expr_template.Instantiate(std::to_string(param_)));
   }
 
   int GetParam() const { return param_; }
@@ -692,4 +994,70 @@ public:
   }
 };
 
+// 按DAG遍历每个节点恰好一次, 被多个父节点共享的子表达式不会重复访问
+// 子节点先于父节点访问
+inline void
+ForEachUniqueOp(const OperatorPtr &root,
+                const std::function<void(const OperatorPtr &)> &fn) {
+  std::unordered_set<const BaseOperator *> visited;
+  // <节点, 子节点是否已展开>
+  std::vector<std::pair<OperatorPtr, bool>> stack{{root, false}};
+  while (!stack.empty()) {
+    auto [op, expanded] = stack.back();
+    stack.pop_back();
+    if (expanded) {
+      fn(op);
+      continue;
+    }
+    if (!visited.insert(op.get()).second) {
+      continue;
+    }
+    stack.emplace_back(op, true);
+    const auto &childs = op->GetChilds();
+    for (auto it = childs.rbegin(); it != childs.rend(); ++it) {
+      stack.emplace_back(*it, false);
+    }
+  }
+}
+
+// 收集需要日终处理的节点, 换日时扁平遍历, 不再逐层递归
+// 没有DagOp的节点(库中编译的算子、组合算子)整个加入, 由它自己递归处理子树
+inline std::vector<OperatorPtr> CollectDayAwareOps(const OperatorPtr &root) {
+  std::vector<OperatorPtr> day_ops;
+  ForEachUniqueOp(root, [&day_ops](const OperatorPtr &op) {
+    const DagOp *dag = AsDagOp(op.get());
+    if (dag != nullptr ? dag->IsDayAware() : !op->IsInputDataOp()) {
+      day_ops.push_back(op);
+    }
+  });
+  return day_ops;
+}
+
+// 换日处理, 由调用方持有: 构造时收集一次节点列表, 之后每次换日只递增
+// day_epoch并扁平遍历列表. 用于header_ops算子手工组装的树; 库建出的树没有
+// DagOp, 列表只有根节点, FactorTree::OnDayBegin直接调用根节点
+class DayCycle {
+public:
+  explicit DayCycle(const OperatorPtr &root)
+      : context_(GetTreeContext(root->GetInitArgs())),
+        day_ops_(CollectDayAwareOps(root)) {}
+
+  void OnDayBegin() {
+    ++context_->day_epoch;
+    for (auto &op : day_ops_) {
+      op->OnDayBegin();
+    }
+  }
+
+  void OnDayEnd() {
+    for (auto &op : day_ops_) {
+      op->OnDayEnd();
+    }
+  }
+
+private:
+  std::shared_ptr<TreeContext> context_;
+  std::vector<OperatorPtr> day_ops_;
+};
+
 } // namespace factor_tree
\ No newline at end of file
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "../threadpool.h"
+#include "baseoperator.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+namespace factor_tree {
+
+// 截面算子批量执行
+// 大量根节点都套着cs_rank/cs_zscore时, 逐个节点计算的调度开销和单线程都是瓶颈。
+// 参与批量执行的节点第一次被计算时登记(构建时生成但不可达的节点不会登记),
+// 之后每个批次由第一个被求值的节点触发: 先串行求出所有登记节点的输入,
+// 再按节点分块并行计算, 各自写入自己的缓冲区并标记为已缓存, 父节点再求值时
+// 直接命中缓存。节点的计算只使用节点自身的缓冲区, 不同节点之间互不影响。
+class CsBatchRegistry {
+public:
+  //   输入已就绪时在节点自身的缓冲区上计算
+  using ComputeFn = void (*)(BaseOperator *, const Tensor &, Tensor &);
+
+  explicit CsBatchRegistry(size_t nthread) : pool_(nthread) {}
+
+  //   未开启批量执行时返回空指针
+  static std::shared_ptr<CsBatchRegistry> Get(const InitArgsPtr &config) {
+    auto context = GetTreeContext(config);
+    if (context->cs_batch_threads == 0) {
+      return nullptr;
+    }
+    if (!context->cs_batch) {
+      context->cs_batch =
+          std::make_shared<CsBatchRegistry>(context->cs_batch_threads);
+    }
+    return context->cs_batch;
+  }
+
+  //   由trigger的Update调用, trigger的输入已就绪
+  //   返回true表示trigger已在本批次中算完, 返回false表示需要单独计算
+  bool Run(BaseOperator *trigger, ComputeFn compute, RequestIdx idx) {
+    // 批量执行过程中被递归求值的节点, 或本批次之后才登记的节点单独计算
+    // 批量执行时entries_正在遍历, 新节点先放进pending_; 每个节点只登记一次,
+    // pending_在下一次批量执行开始时清空, 大小不超过节点数
+    if (registered_.insert(trigger).second) {
+      pending_.push_back(Entry{trigger, compute, nullptr});
+    }
+    if (running_ || idx == last_idx_) {
+      return false;
+    }
+    MergePending();
+    last_idx_ = idx;
+    {
+      // 输入或计算抛出异常时也要退出批量执行状态, 之后的批次照常触发
+      ScopedValue<bool> running(running_, true);
+      RunEntries(idx);
+    }
+    MergePending();
+    return true;
+  }
+
+  //   批量执行过程中(例如输入求值时)释放的节点不能从正在遍历的entries_中
+  //   删除, 先置空, 批量执行结束后再移除
+  void Unregister(const BaseOperator *op) {
+    auto same = [op](const Entry &entry) { return entry.op == op; };
+    registered_.erase(op);
+    pending_.erase(std::remove_if(pending_.begin(), pending_.end(), same),
+                   pending_.end());
+    if (running_) {
+      for (auto &entry : entries_) {
+        if (same(entry)) {
+          entry.op = nullptr;
+          entry.input = nullptr;
+        }
+      }
+      return;
+    }
+    entries_.erase(std::remove_if(entries_.begin(), entries_.end(), same),
+                   entries_.end());
+  }
+
+  //   已登记的节点数, 不随批次增长
+  size_t NumRegistered() const { return registered_.size(); }
+
+private:
+  struct Entry {
+    BaseOperator *op;
+    ComputeFn compute;
+    TensorPtr input;
+  };
+
+  void RunEntries(RequestIdx idx) {
+    for (auto &entry : entries_) {
+      entry.input = nullptr;
+    }
+    //   下标遍历: 求值过程中释放的节点会被置空, entries_本身不变
+    for (size_t k = 0; k < entries_.size(); ++k) {
+      BaseOperator *op = entries_[k].op;
+      if (op == nullptr || op->GetOpCacheIdx() == idx) {
+        continue;
+      }
+      TensorPtr input = op->GetChilds()[0]->GetResult(idx).GetTensorPtr();
+      if (entries_[k].op != nullptr) {
+        entries_[k].input = std::move(input);
+      }
+    }
+    // 递归求值时已单独算完的节点不再计算
+    for (auto &entry : entries_) {
+      if (entry.op != nullptr && entry.op->GetOpCacheIdx() == idx) {
+        entry.input = nullptr;
+      }
+    }
+    pool_.ParallelFor(entries_.size(), [this](size_t, size_t begin,
+                                              size_t end) {
+      for (size_t k = begin; k < end; ++k) {
+        auto &entry = entries_[k];
+        if (entry.input) {
+          entry.compute(entry.op, *entry.input,
+                        *entry.op->GetOpResultBuffer());
+        }
+      }
+    });
+    for (auto &entry : entries_) {
+      if (entry.input) {
+        entry.op->UpdateRequestIdx(idx);
+        entry.input = nullptr;
+      }
+    }
+  }
+
+  void MergePending() {
+    entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                  [](const Entry &entry) {
+                                    return entry.op == nullptr;
+                                  }),
+                   entries_.end());
+    entries_.insert(entries_.end(), pending_.begin(), pending_.end());
+    pending_.clear();
+    // 同类节点相邻, 计算时指令和缓存更友好
+    std::stable_sort(entries_.begin(), entries_.end(),
+                     [](const Entry &a, const Entry &b) {
+                       return std::less<ComputeFn>()(a.compute, b.compute);
+                     });
+  }
+
+  ThreadPool pool_;
+  std::vector<Entry> entries_;
+  std::vector<Entry> pending_;
+  std::unordered_set<const BaseOperator *> registered_;
+  bool running_ = false;
+  RequestIdx last_idx_ = 0;
+};
+
+// 算子内嵌的批量执行句柄, Op需要提供 Compute(const Tensor &, Tensor &)
+class CsBatchHandle {
+public:
+  explicit CsBatchHandle(const OpInitArgs &init_args)
+      : registry_(CsBatchRegistry::Get(init_args.config)) {}
+  CsBatchHandle(const CsBatchHandle &) = delete;
+
+  ~CsBatchHandle() {
+    if (registry_ && op_) {
+      registry_->Unregister(op_);
+    }
+  }
+
+  //   在Op::Update中调用, 返回true表示本批次已经算完
+  template <typename Op> bool Run(Op *op) {
+    if (!registry_) {
+      return false;
+    }
+    op_ = op;
+    RequestIdx idx = op->GetChilds()[0]->GetOpCacheIdx();
+    return registry_->Run(op, &ComputeEntry<Op>, idx);
+  }
+
+private:
+  template <typename Op>
+  static void ComputeEntry(BaseOperator *op, const Tensor &x, Tensor &out) {
+    static_cast<Op *>(op)->Compute(x, out);
+  }
+
+  std::shared_ptr<CsBatchRegistry> registry_;
+  BaseOperator *op_ = nullptr;
+};
+
+} // namespace factor_tree
@@ -0,0 +1,463 @@
+#pragma once
+
+#include "csoperator.h"
+#include "csparallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace factor_tree {
+
+// 分组索引: 把group列映射为连续组号, 并按组连续存放成员下标(CSR)
+// 行业/板块代码一天内基本不变, 只有group列内容变化时才重建
+class GroupIndex {
+public:
+  //   每个标的的组号, 无效分组为-1, 组号按group值从小到大编号
+  std::vector<int32_t> group_id;
+  //   第g组的成员为 members[offsets[g], offsets[g + 1]), 组内按标的下标升序
+  std::vector<uint32_t> offsets{0};
+  std::vector<uint32_t> members;
+  //   每次重建加一, 使用方可据此判断索引是否变化
+  size_t version = 0;
+
+  inline size_t NumGroups() const { return offsets.size() - 1; }
+
+  //   同一批次只比较一次, group列与上次完全相同时不重建
+  void Refresh(const Tensor &group, RequestIdx idx) {
+    if (checked_ && idx == checked_idx_) {
+      return;
+    }
+    checked_ = true;
+    checked_idx_ = idx;
+    if (group.size() == cached_group_.size() &&
+        std::memcmp(group.data(), cached_group_.data(),
+                    group.size() * sizeof(double)) == 0) {
+      return;
+    }
+    Rebuild(group);
+  }
+
+private:
+  void Rebuild(const Tensor &group) {
+    const size_t n = group.size();
+    cached_group_.assign(group.begin(), group.end());
+    group_id.assign(n, -1);
+    scratch_.Reserve(n);
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (ValidGroup(group(i))) {
+        scratch_.key[m] = OrderedKey(group(i));
+        scratch_.idx[m] = static_cast<uint32_t>(i);
+        ++m;
+      }
+    }
+    scratch_.Sort(m);
+    members.assign(scratch_.idx.begin(), scratch_.idx.begin() + m);
+    offsets.assign(1, 0);
+    for (size_t j = 0; j < m; ++j) {
+      if (j > 0 && scratch_.key[j] != scratch_.key[j - 1]) {
+        offsets.push_back(static_cast<uint32_t>(j));
+      }
+      group_id[members[j]] = static_cast<int32_t>(offsets.size() - 1);
+    }
+    if (m > 0) {
+      offsets.push_back(static_cast<uint32_t>(m));
+    }
+    ++version;
+  }
+
+  bool checked_ = false;
+  RequestIdx checked_idx_ = 0;
+  std::vector<double> cached_group_;
+  RadixSortScratch scratch_;
+};
+
+// 一棵树内按group算子共享分组索引, 相同的group表达式经expr_map_去重后
+// 是同一个算子, 所有以它为group的cs_group_*算子共用一份索引
+struct GroupIndexRegistry {
+  std::unordered_map<const BaseOperator *, std::weak_ptr<GroupIndex>> indices;
+
+  static std::shared_ptr<GroupIndex> Get(const InitArgsPtr &config,
+                                         const BaseOperator *group_op) {
+    auto context = GetTreeContext(config);
+    if (!context->group_indices) {
+      context->group_indices = std::make_shared<GroupIndexRegistry>();
+    }
+    auto &indices = context->group_indices->indices;
+    auto &slot = indices[group_op];
+    auto index = slot.lock();
+    if (!index) {
+      //   顺便清理已释放的索引, 反复建树时表的大小与存活的group算子数量有关,
+      //   group算子的地址被复用时也不会留下过期的条目
+      for (auto it = indices.begin(); it != indices.end();) {
+        if (&it->second != &slot && it->second.expired()) {
+          it = indices.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      index = std::make_shared<GroupIndex>();
+      slot = index;
+    }
+    return index;
+  }
+};
+
+// 组内统计量, 缓冲区随算子常驻
+// 按组遍历成员下标(组内按标的下标升序)累加, 各组互不依赖, 可按组并行,
+// 每组的累加顺序固定, 是否并行结果都相同
+struct GroupMoments {
+  std::vector<int32_t> count;
+  std::vector<double> mean;
+  //   Σ(x - mean)², 只在需要标准差时计算
+  std::vector<double> m2;
+
+  void Compute(const CsParallel &parallel, const Tensor &x,
+               const GroupIndex &index, bool with_m2) {
+    const size_t ngroup = index.NumGroups();
+    count.resize(ngroup);
+    mean.resize(ngroup);
+    if (with_m2) {
+      m2.resize(ngroup);
+    }
+    const double *data = x.data();
+    parallel.ForEach(ngroup, [this, data, &index, with_m2](size_t, size_t g) {
+      const uint32_t *member = index.members.data() + index.offsets[g];
+      const size_t size = index.offsets[g + 1] - index.offsets[g];
+      int32_t c = 0;
+      double sum = 0.0;
+      for (size_t j = 0; j < size; ++j) {
+        double v = data[member[j]];
+        if (!std::isnan(v)) {
+          ++c;
+          sum += v;
+        }
+      }
+      count[g] = c;
+      mean[g] = c > 0 ? sum / c : kNaN;
+      if (!with_m2) {
+        return;
+      }
+      double sum_sq = 0.0;
+      for (size_t j = 0; j < size; ++j) {
+        double v = data[member[j]];
+        if (!std::isnan(v)) {
+          sum_sq += (v - mean[g]) * (v - mean[g]);
+        }
+      }
+      m2[g] = sum_sq;
+    });
+  }
+
+  //   样本标准差, 组内有效值少于2个时为nan
+  inline double Std(size_t g) const {
+    return count[g] > 1 ? std::sqrt(m2[g] / (count[g] - 1)) : kNaN;
+  }
+};
+
+// cs_group_* 算子公共部分, 右子节点为group
+// Update时先刷新共享的分组索引, 再交给RealOp::GroupUpdate按组计算
+// 截面较大时组内统计按组并行, 逐元素的输出按块并行
+template <typename RealOp> class CsGroupOp : public CsBinaryOp<RealOp> {
+public:
+  using CsBinaryOp<RealOp>::GetRightChild;
+
+  CsGroupOp(OperatorPtr &left_child, OperatorPtr &right_child,
+            const OpInitArgs &init_args)
+      : CsBinaryOp<RealOp>(left_child, right_child, init_args),
+        parallel_(init_args),
+        index_(GroupIndexRegistry::Get(init_args.config, right_child.get())) {
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    index_->Refresh(*input.GetRightColumeData(),
+                    GetRightChild()->GetOpCacheIdx());
+    static_cast<RealOp *>(this)->GroupUpdate(*input.GetLeftColumeData(),
+                                             *index_, output.GetTensor());
+  }
+
+  const std::shared_ptr<GroupIndex> &GetGroupIndex() const { return index_; }
+
+protected:
+  //   对每个标的i调用fn(i, g), g为组号, 无效分组为-1
+  template <typename Fn>
+  void ForEachStock(const GroupIndex &index, size_t size, Fn fn) const {
+    const int32_t *group_id = index.group_id.data();
+    parallel_.ForBlocks(size, [group_id, &fn](size_t, size_t begin,
+                                              size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        fn(i, group_id[i]);
+      }
+    });
+  }
+
+  CsParallel parallel_;
+
+private:
+  std::shared_ptr<GroupIndex> index_;
+};
+
+namespace header_ops {
+
+// 不替换库中的cs_group_*, 见baseoperator.h中header_ops的说明
+// cs_group_mean(x, group): 组内均值填充组内所有非nan的x
+class CsGroupMean : public CsGroupOp<CsGroupMean> {
+public:
+  static constexpr const char *kName = "cs_group_mean";
+  using CsGroupOp::CsGroupOp;
+  OperatorType GetType() const override { return OperatorType::CsGroupMean; }
+
+  void GroupUpdate(const Tensor &x, const GroupIndex &index, Tensor &out) {
+    moments_.Compute(parallel_, x, index, false);
+    ForEachStock(index, x.size(), [this, &x, &out](size_t i, int32_t g) {
+      out(i) = (g < 0 || std::isnan(x(i))) ? kNaN : moments_.mean[g];
+    });
+  }
+
+private:
+  GroupMoments moments_;
+};
+
+// cs_group_sum(x, group): 组内和填充组内所有非nan的x
+class CsGroupSum : public CsGroupOp<CsGroupSum> {
+public:
+  static constexpr const char *kName = "cs_group_sum";
+  using CsGroupOp::CsGroupOp;
+  OperatorType GetType() const override { return OperatorType::CsGroupSum; }
+
+  void GroupUpdate(const Tensor &x, const GroupIndex &index, Tensor &out) {
+    moments_.Compute(parallel_, x, index, false);
+    ForEachStock(index, x.size(), [this, &x, &out](size_t i, int32_t g) {
+      out(i) = (g < 0 || std::isnan(x(i)))
+                   ? kNaN
+                   : moments_.mean[g] * moments_.count[g];
+    });
+  }
+
+private:
+  GroupMoments moments_;
+};
+
+// cs_group_demean(x, group): x - 组内均值
+class CsGroupDemean : public CsGroupOp<CsGroupDemean> {
+public:
+  static constexpr const char *kName = "cs_group_demean";
+  using CsGroupOp::CsGroupOp;
+  OperatorType GetType() const override {
+    return OperatorType::CsGroupDemean;
+  }
+
+  void GroupUpdate(const Tensor &x, const GroupIndex &index, Tensor &out) {
+    moments_.Compute(parallel_, x, index, false);
+    ForEachStock(index, x.size(), [this, &x, &out](size_t i, int32_t g) {
+      out(i) = g < 0 ? kNaN : x(i) - moments_.mean[g];
+    });
+  }
+
+private:
+  GroupMoments moments_;
+};
+
+// cs_group_std(x, group): 组内标准差填充组内所有非nan的x
+class CsGroupStd : public CsGroupOp<CsGroupStd> {
+public:
+  static constexpr const char *kName = "cs_group_std";
+  using CsGroupOp::CsGroupOp;
+  OperatorType GetType() const override { return OperatorType::CsGroupStd; }
+
+  void GroupUpdate(const Tensor &x, const GroupIndex &index, Tensor &out) {
+    moments_.Compute(parallel_, x, index, true);
+    ForEachStock(index, x.size(), [this, &x, &out](size_t i, int32_t g) {
+      out(i) = (g < 0 || std::isnan(x(i))) ? kNaN : moments_.Std(g);
+    });
+  }
+
+private:
+  GroupMoments moments_;
+};
+
+// cs_group_zscore(x, group): (x - 组内均值) / 组内标准差
+class CsGroupZscore : public CsGroupOp<CsGroupZscore> {
+public:
+  static constexpr const char *kName = "cs_group_zscore";
+  using CsGroupOp::CsGroupOp;
+  OperatorType GetType() const override {
+    return OperatorType::CsGroupZscore;
+  }
+
+  void GroupUpdate(const Tensor &x, const GroupIndex &index, Tensor &out) {
+    moments_.Compute(parallel_, x, index, true);
+    ForEachStock(index, x.size(), [this, &x, &out](size_t i, int32_t g) {
+      if (g < 0) {
+        out(i) = kNaN;
+        return;
+      }
+      double sd = moments_.Std(g);
+      out(i) = sd < kEpsilon ? kNaN : (x(i) - moments_.mean[g]) / sd;
+    });
+  }
+
+private:
+  GroupMoments moments_;
+};
+
+// cs_group_position(x, group): 组内min-max缩放到[0, 1]
+class CsGroupPosition : public CsGroupOp<CsGroupPosition> {
+public:
+  static constexpr const char *kName = "cs_group_position";
+  using CsGroupOp::CsGroupOp;
+  OperatorType GetType() const override {
+    return OperatorType::CsGroupPosition;
+  }
+
+  void GroupUpdate(const Tensor &x, const GroupIndex &index, Tensor &out) {
+    const size_t ngroup = index.NumGroups();
+    min_.resize(ngroup);
+    max_.resize(ngroup);
+    const double *data = x.data();
+    parallel_.ForEach(ngroup, [this, data, &index](size_t, size_t g) {
+      double lo = kNaN;
+      double hi = kNaN;
+      for (size_t j = index.offsets[g]; j < index.offsets[g + 1]; ++j) {
+        double v = data[index.members[j]];
+        if (std::isnan(v)) {
+          continue;
+        }
+        // nan参与比较恒为false, 首个有效值直接写入
+        if (!(v >= lo)) {
+          lo = v;
+        }
+        if (!(v <= hi)) {
+          hi = v;
+        }
+      }
+      min_[g] = lo;
+      max_[g] = hi;
+    });
+    ForEachStock(index, x.size(), [this, &x, &out](size_t i, int32_t g) {
+      if (g < 0) {
+        out(i) = kNaN;
+        return;
+      }
+      double range = max_[g] - min_[g];
+      out(i) = range < kEpsilon ? kNaN : (x(i) - min_[g]) / range;
+    });
+  }
+
+private:
+  std::vector<double> min_;
+  std::vector<double> max_;
+};
+
+// cs_group_rank(x, group): 组内排名, 缩放到[-0.5, 0.5]
+// 串行时先对x做基数排序, 再按组号做一次稳定的计数排序, 得到按组连续、
+// 组内有序的下标; 并行时按组分配给工作线程, 各组在线程自己的缓冲区内排序
+class CsGroupRank : public CsGroupOp<CsGroupRank> {
+public:
+  static constexpr const char *kName = "cs_group_rank";
+  using CsGroupOp::CsGroupOp;
+  OperatorType GetType() const override { return OperatorType::CsGroupRank; }
+
+  void GroupUpdate(const Tensor &x, const GroupIndex &index, Tensor &out) {
+    if (parallel_.Enabled()) {
+      ParallelUpdate(x, index, out);
+      return;
+    }
+    const size_t ngroup = index.NumGroups();
+    scratch_.Reserve(x.size());
+    value_key_.resize(x.size());
+    bucket_.assign(ngroup + 1, 0);
+    size_t n = 0;
+    for (size_t i = 0; i < x.size(); ++i) {
+      int32_t g = index.group_id[i];
+      if (g < 0 || std::isnan(x(i))) {
+        out(i) = kNaN;
+        continue;
+      }
+      value_key_[i] = OrderedKey(x(i));
+      scratch_.key[n] = value_key_[i];
+      scratch_.idx[n] = static_cast<uint32_t>(i);
+      ++bucket_[g + 1];
+      ++n;
+    }
+    if (n == 0) {
+      return;
+    }
+    scratch_.Sort(n);
+    for (size_t g = 0; g < ngroup; ++g) {
+      bucket_[g + 1] += bucket_[g];
+    }
+    sorted_.resize(n);
+    group_begin_.assign(bucket_.begin(), bucket_.end());
+    for (size_t j = 0; j < n; ++j) {
+      uint32_t i = scratch_.idx[j];
+      sorted_[bucket_[index.group_id[i]]++] = i;
+    }
+
+    const uint64_t *vkey = value_key_.data();
+    for (size_t g = 0; g < ngroup; ++g) {
+      size_t begin = group_begin_[g];
+      size_t end = group_begin_[g + 1];
+      if (begin == end) {
+        continue;
+      }
+      const uint32_t *idx = sorted_.data() + begin;
+      AssignScaledRank(
+          idx, end - begin,
+          [vkey, idx](size_t a, size_t b) {
+            return vkey[idx[a]] == vkey[idx[b]];
+          },
+          out);
+    }
+  }
+
+private:
+  void ParallelUpdate(const Tensor &x, const GroupIndex &index, Tensor &out) {
+    worker_scratch_.resize(parallel_.NumWorkers());
+    ForEachStock(index, x.size(), [&x, &out](size_t i, int32_t g) {
+      if (g < 0 || std::isnan(x(i))) {
+        out(i) = kNaN;
+      }
+    });
+    const double *data = x.data();
+    parallel_.ForEach(index.NumGroups(), [this, data, &index,
+                                          &out](size_t worker, size_t g) {
+      auto &scratch = worker_scratch_[worker];
+      const uint32_t *member = index.members.data() + index.offsets[g];
+      const size_t size = index.offsets[g + 1] - index.offsets[g];
+      scratch.Reserve(size);
+      size_t n = 0;
+      for (size_t j = 0; j < size; ++j) {
+        double v = data[member[j]];
+        if (!std::isnan(v)) {
+          scratch.key[n] = OrderedKey(v);
+          scratch.idx[n] = member[j];
+          ++n;
+        }
+      }
+      if (n == 0) {
+        return;
+      }
+      scratch.Sort(n);
+      const uint64_t *key = scratch.key.data();
+      AssignScaledRank(
+          scratch.idx.data(), n,
+          [key](size_t a, size_t b) { return key[a] == key[b]; }, out);
+    });
+  }
+
+  RadixSortScratch scratch_;
+  std::vector<uint64_t> value_key_;
+  std::vector<uint32_t> bucket_;
+  std::vector<uint32_t> group_begin_;
+  std::vector<uint32_t> sorted_;
+  std::vector<RadixSortScratch> worker_scratch_;
+};
+
+} // namespace header_ops
+} // namespace factor_tree
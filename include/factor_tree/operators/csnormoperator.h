@@ -0,0 +1,286 @@
+#pragma once
+
+#include "csoperator.h"
+#include "csparallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace factor_tree {
+
+// 截面归一化的一步, param只有cs_winsorize使用
+struct CsNormStep {
+  OperatorType type;
+  double param;
+};
+
+// 非nan元素的截面统计量, 一次遍历得到
+// 按kCsBlockSize分块统计后依次合并, 是否并行都得到相同的结果
+struct CsMoments {
+  size_t n = 0;
+  double mean = kNaN;
+  double sd = kNaN;
+  double min = kNaN;
+  double max = kNaN;
+
+  //   value(i)可以顺带写出第i个元素, 并行时各块写入的位置互不重叠
+  template <typename Value>
+  void Compute(const CsParallel &parallel, size_t size, Value value) {
+    partials_.resize(CsParallel::NumBlocks(size));
+    parallel.ForBlocks(size, [this, &value](size_t block, size_t begin,
+                                            size_t end) {
+      partials_[block] = CsMomentPartial::FromRange(begin, end, value);
+    });
+    CsMomentPartial total;
+    for (const auto &partial : partials_) {
+      total.Merge(partial);
+    }
+    n = total.n;
+    min = total.min;
+    max = total.max;
+    mean = n > 0 ? total.mean_x : kNaN;
+    sd = n > 1 ? std::sqrt(total.m2_x / (n - 1)) : kNaN;
+  }
+
+private:
+  std::vector<CsMomentPartial> partials_;
+};
+
+// 融合的截面归一化算子
+// cs_demean/cs_mean/cs_std/cs_zscore/cs_position/cs_winsorize 每个先建一个节点,
+// 建树完成后FuseCsNormalize把只有一个消费者的嵌套节点合并, 例如
+// cs_zscore(cs_winsorize(cs_demean(x), 6)) 最后只有一个CsNormalizeOp
+//
+// 当前值始终表示为 a * base + b, 除winsorize外每一步都只改变a, b,
+// 所需的均值/标准差/最值由base的统计量推出; winsorize的截断与下一次统计
+// 在同一次遍历中完成。整条链只统计一次输入, 每个winsorize多一次遍历,
+// 最后写一次输出
+class CsNormalizeOp : public UnaryOp<CsNormalizeOp> {
+public:
+  CsNormalizeOp(OperatorPtr &input, std::vector<CsNormStep> &&steps,
+                const OpInitArgs &init_args)
+      : UnaryOp(input, init_args), steps_(std::move(steps)),
+        parallel_(init_args), batch_(init_args) {}
+
+  // 在child之上追加一步. 这里不合并: 建树时还不知道child之后是否会被
+  // 其他节点共享, 共享的child合并后会多统计一次输入
+  static OperatorPtr Chain(OperatorPtr child, CsNormStep step,
+                           const OpInitArgs &init_args) {
+    return OperatorPtr(new CsNormalizeOp(child, {step}, init_args));
+  }
+
+  // 把只被自己消费的子节点inner合并进来, 之后直接读inner的输入
+  void Absorb(const CsNormalizeOp &inner) {
+    steps_.insert(steps_.begin(), inner.steps_.begin(), inner.steps_.end());
+    ReplaceChild(inner.GetChild());
+  }
+
+  const std::vector<CsNormStep> &GetSteps() const { return steps_; }
+
+  //   对外表现为最外层的算子
+  OperatorType GetType() const override { return steps_.back().type; }
+
+  std::string ToString() const override {
+    std::string expr = GetChild()->ToString();
+    for (const auto &step : steps_) {
+      expr = std::string(StepName(step.type)) + "(" + expr;
+      if (step.type == OperatorType::CsWinsorize) {
+        expr += "," + FormatDouble(step.param);
+      }
+      expr += ")";
+    }
+    return expr;
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    if (!batch_.Run(this)) {
+      Compute(*input.GetColumeData(), output.GetTensor());
+    }
+  }
+
+  void Compute(const Tensor &x, Tensor &out) {
+    const double *base = x.data();
+    const size_t size = x.size();
+    double a = 1.0;
+    double b = 0.0;
+    bool have_moments = false;
+    for (const auto &step : steps_) {
+      if (!have_moments) {
+        moments_.Compute(parallel_, size,
+                         [base](size_t i) { return base[i]; });
+        have_moments = true;
+      }
+      const double mean = a * moments_.mean + b;
+      const double sd = std::abs(a) * moments_.sd;
+      switch (step.type) {
+      case OperatorType::CsDemean:
+        b -= mean;
+        break;
+      case OperatorType::CsMean:
+        a = 0.0;
+        b = mean;
+        break;
+      case OperatorType::CsStd:
+        a = 0.0;
+        b = sd;
+        break;
+      case OperatorType::CsZscore:
+        if (sd >= kEpsilon) {
+          a /= sd;
+          b = (b - mean) / sd;
+        } else {
+          a = b = kNaN;
+        }
+        break;
+      case OperatorType::CsPosition: {
+        double lo = a >= 0 ? a * moments_.min + b : a * moments_.max + b;
+        double hi = a >= 0 ? a * moments_.max + b : a * moments_.min + b;
+        double range = hi - lo;
+        if (range >= kEpsilon) {
+          a /= range;
+          b = (b - lo) / range;
+        } else {
+          a = b = kNaN;
+        }
+        break;
+      }
+      case OperatorType::CsWinsorize: {
+        if (moments_.n < 2) {
+          break;
+        }
+        double lo = mean - step.param * sd;
+        double hi = mean + step.param * sd;
+        double *dst = out.data();
+        auto clip = [base, dst, a, b, lo, hi](size_t i) {
+          double v = a * base[i] + b;
+          return dst[i] = std::isnan(v) ? v : std::clamp(v, lo, hi);
+        };
+        moments_.Compute(parallel_, size, clip);
+        base = dst;
+        a = 1.0;
+        b = 0.0;
+        break;
+      }
+      default:
+        throw std::logic_error("unsupported cs normalize step");
+      }
+    }
+    if (base == out.data() && a == 1.0 && b == 0.0) {
+      return;
+    }
+    double *dst = out.data();
+    parallel_.ForBlocks(size, [base, dst, a, b](size_t, size_t begin,
+                                                size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        dst[i] = a * base[i] + b;
+      }
+    });
+  }
+
+  static const char *StepName(OperatorType type) {
+    switch (type) {
+    case OperatorType::CsDemean:
+      return "cs_demean";
+    case OperatorType::CsMean:
+      return "cs_mean";
+    case OperatorType::CsStd:
+      return "cs_std";
+    case OperatorType::CsZscore:
+      return "cs_zscore";
+    case OperatorType::CsPosition:
+      return "cs_position";
+    case OperatorType::CsWinsorize:
+      return "cs_winsorize";
+    default:
+      throw std::logic_error("unsupported cs normalize step");
+    }
+  }
+
+private:
+  std::vector<CsNormStep> steps_;
+  CsMoments moments_;
+  CsParallel parallel_;
+  CsBatchHandle batch_;
+};
+
+// 建树完成后对根节点调用一次, 合并嵌套的截面归一化节点
+// 内层节点只有外层一个消费者时才合并; 被其他节点共享的内层节点照常输出,
+// 外层在它的结果上继续计算. 子节点先于父节点处理, 整条链合并为一个节点
+inline void FuseCsNormalize(const OperatorPtr &root) {
+  std::unordered_map<const BaseOperator *, size_t> consumers;
+  ForEachUniqueOp(root, [&consumers](const OperatorPtr &op) {
+    for (const auto &child : op->GetChilds()) {
+      ++consumers[child.get()];
+    }
+  });
+  ForEachUniqueOp(root, [&consumers](const OperatorPtr &op) {
+    auto outer = dynamic_cast<CsNormalizeOp *>(op.get());
+    if (outer == nullptr) {
+      return;
+    }
+    auto inner = std::dynamic_pointer_cast<CsNormalizeOp>(outer->GetChild());
+    if (inner != nullptr && consumers[inner.get()] == 1) {
+      outer->Absorb(*inner);
+    }
+  });
+}
+
+// 各截面归一化算子只负责解析参数, 实际节点都是CsNormalizeOp
+template <OperatorType kType> struct CsNormFactory {
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    if (args.size() != 1 || args[0].GetType() != ArgType::Operator) {
+      throw std::invalid_argument(
+          std::string(CsNormalizeOp::StepName(kType)) +
+          " operator should have 1 arguments");
+    }
+    return CsNormalizeOp::Chain(args[0].GetOperator(), {kType, 0.0},
+                                init_args);
+  }
+
+  static std::vector<ArgType> ArgTypes() { return {ArgType::Operator}; }
+};
+
+namespace header_ops {
+
+// 不替换库中的cs_demean/cs_zscore/cs_winsorize等, 见baseoperator.h中
+// header_ops的说明
+// cs_demean(x): x - 截面均值
+using CsDemean = CsNormFactory<OperatorType::CsDemean>;
+// cs_mean(x): 截面均值填充所有非nan的x
+using CsMean = CsNormFactory<OperatorType::CsMean>;
+// cs_std(x): 截面标准差填充所有非nan的x
+using CsStd = CsNormFactory<OperatorType::CsStd>;
+// cs_zscore(x): (x - 截面均值) / 截面标准差
+using CsZscore = CsNormFactory<OperatorType::CsZscore>;
+// cs_position(x): min-max缩放到[0, 1]
+using CsPosition = CsNormFactory<OperatorType::CsPosition>;
+
+// cs_winsorize(x, std=6): 把x截断到 mean ± std * 截面标准差
+struct CsWinsorize {
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    if (args.size() != 2 || args[0].GetType() != ArgType::Operator ||
+        (args[1].GetType() != ArgType::Double &&
+         args[1].GetType() != ArgType::Integer)) {
+      throw std::invalid_argument("cs_winsorize operator should have 2 "
+                                  "arguments");
+    }
+    double nstd = args[1].GetType() == ArgType::Double
+                      ? args[1].GetDouble()
+                      : static_cast<double>(args[1].GetInteger());
+    return CsNormalizeOp::Chain(args[0].GetOperator(),
+                                {OperatorType::CsWinsorize, nstd}, init_args);
+  }
+
+  static std::vector<ArgType> ArgTypes() {
+    return {ArgType::Operator, ArgType::Double};
+  }
+};
+
+} // namespace header_ops
+} // namespace factor_tree
@@ -0,0 +1,445 @@
+#pragma once
+
+#include "csbatch.h"
+#include "csparallel.h"
+#include "tsoperator.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+
+// 无参数的一元截面算子公共部分
+template <typename RealOp> class CsUnaryOp : public UnaryOp<RealOp> {
+public:
+  using UnaryOp<RealOp>::GetChild;
+  using UnaryOp<RealOp>::UnaryOp;
+
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    if (args.size() != 1 || args[0].GetType() != ArgType::Operator) {
+      throw std::invalid_argument(std::string(RealOp::kName) +
+                                  " operator should have 1 arguments");
+    }
+    auto child = args[0].GetOperator();
+    return OperatorPtr(new RealOp(child, init_args));
+  }
+
+  static std::vector<ArgType> ArgTypes() { return {ArgType::Operator}; }
+
+  std::string ToString() const override {
+    return std::string(RealOp::kName) + "(" + GetChild()->ToString() + ")";
+  }
+};
+
+// 无参数的二元截面算子公共部分, cs_group_* 的右子节点为group
+template <typename RealOp> class CsBinaryOp : public BinaryOp<RealOp> {
+public:
+  using BinaryOp<RealOp>::GetLeftChild;
+  using BinaryOp<RealOp>::GetRightChild;
+  using BinaryOp<RealOp>::BinaryOp;
+
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    if (args.size() != 2 || args[0].GetType() != ArgType::Operator ||
+        args[1].GetType() != ArgType::Operator) {
+      throw std::invalid_argument(std::string(RealOp::kName) +
+                                  " operator should have 2 arguments");
+    }
+    auto left_child = args[0].GetOperator();
+    auto right_child = args[1].GetOperator();
+    return OperatorPtr(new RealOp(left_child, right_child, init_args));
+  }
+
+  static std::vector<ArgType> ArgTypes() {
+    return {ArgType::Operator, ArgType::Operator};
+  }
+
+  std::string ToString() const override {
+    return std::string(RealOp::kName) + "(" + GetLeftChild()->ToString() +
+           "," + GetRightChild()->ToString() + ")";
+  }
+};
+
+// double按位映射为保序的uint64, 负数取反, 非负数置符号位, -0.0视为0.0
+inline uint64_t OrderedKey(double x) {
+  x += 0.0;
+  uint64_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  return (bits & 0x8000000000000000ULL) ? ~bits
+                                        : bits | 0x8000000000000000ULL;
+}
+
+// group < 0 或 nan 视为无效分组, 见operators.md
+inline bool ValidGroup(double group) { return group >= 0; }
+
+// LSD基数排序, 每轮8位, 所有元素该位相同的轮次直接跳过
+// 缓冲区随算子常驻, 截面大小不变时稳态下不分配内存
+class RadixSortScratch {
+public:
+  //   待排序的键和原始下标, 调用方只需填写前n个
+  std::vector<uint64_t> key;
+  std::vector<uint32_t> idx;
+
+  void Reserve(size_t n) {
+    if (key.size() < n) {
+      key.resize(n);
+      idx.resize(n);
+      key_tmp_.resize(n);
+      idx_tmp_.resize(n);
+    }
+  }
+
+  //   按key稳定排序前n个元素, idx随之移动
+  void Sort(size_t n) {
+    if (n < 2) {
+      return;
+    }
+    for (auto &hist : hist_) {
+      hist.fill(0);
+    }
+    for (size_t j = 0; j < n; ++j) {
+      uint64_t k = key[j];
+      for (size_t pass = 0; pass < kPasses; ++pass) {
+        ++hist_[pass][(k >> (pass * 8)) & 0xff];
+      }
+    }
+    for (size_t pass = 0; pass < kPasses; ++pass) {
+      auto &hist = hist_[pass];
+      if (hist[(key[0] >> (pass * 8)) & 0xff] == n) {
+        continue;
+      }
+      uint32_t offset = 0;
+      for (auto &count : hist) {
+        uint32_t c = count;
+        count = offset;
+        offset += c;
+      }
+      for (size_t j = 0; j < n; ++j) {
+        uint32_t pos = hist[(key[j] >> (pass * 8)) & 0xff]++;
+        key_tmp_[pos] = key[j];
+        idx_tmp_[pos] = idx[j];
+      }
+      key.swap(key_tmp_);
+      idx.swap(idx_tmp_);
+    }
+  }
+
+private:
+  static constexpr size_t kPasses = 8;
+  std::array<std::array<uint32_t, 256>, kPasses> hist_;
+  std::vector<uint64_t> key_tmp_;
+  std::vector<uint32_t> idx_tmp_;
+};
+
+// 对排好序的n个下标按平均排名缩放到[-0.5, 0.5]写入out
+// same(a, b)判断排序后第a个和第b个元素是否并列
+template <typename Same>
+inline void AssignScaledRank(const uint32_t *idx, size_t n, Same same,
+                             Tensor &out) {
+  if (n == 1) {
+    out(idx[0]) = 0.0;
+    return;
+  }
+  const double scale = 1.0 / static_cast<double>(n - 1);
+  size_t begin = 0;
+  while (begin < n) {
+    size_t end = begin + 1;
+    while (end < n && same(begin, end)) {
+      ++end;
+    }
+    double rank = 0.5 * static_cast<double>(begin + end - 1) * scale - 0.5;
+    for (size_t j = begin; j < end; ++j) {
+      out(idx[j]) = rank;
+    }
+    begin = end;
+  }
+}
+
+// 把有序段[key_a, idx_a)与[key_b, idx_b)归并到dst, 并列时a段在前
+inline void MergeSortedRuns(const uint64_t *key_a, const uint32_t *idx_a,
+                            size_t na, const uint64_t *key_b,
+                            const uint32_t *idx_b, size_t nb, uint64_t *key_dst,
+                            uint32_t *idx_dst) {
+  size_t i = 0, j = 0, k = 0;
+  while (i < na && j < nb) {
+    if (key_b[j] < key_a[i]) {
+      key_dst[k] = key_b[j];
+      idx_dst[k++] = idx_b[j++];
+    } else {
+      key_dst[k] = key_a[i];
+      idx_dst[k++] = idx_a[i++];
+    }
+  }
+  for (; i < na; ++i, ++k) {
+    key_dst[k] = key_a[i];
+    idx_dst[k] = idx_a[i];
+  }
+  for (; j < nb; ++j, ++k) {
+    key_dst[k] = key_b[j];
+    idx_dst[k] = idx_b[j];
+  }
+}
+
+namespace header_ops {
+
+// 不替换库中的cs_rank, 见baseoperator.h中header_ops的说明
+// cs_rank(x): 截面排名, 缩放到[-0.5, 0.5], 并列取平均排名
+// 截面较大时各块并行做基数排序, 再两两并行归并; 排名是精确值, 与串行结果相同
+class CsRank : public CsUnaryOp<CsRank> {
+public:
+  static constexpr const char *kName = "cs_rank";
+  CsRank(OperatorPtr &child, const OpInitArgs &init_args)
+      : CsUnaryOp(child, init_args), parallel_(init_args), batch_(init_args) {}
+  OperatorType GetType() const override { return OperatorType::CsRank; }
+
+  void Update(OpInput &input, OpOutput &output) {
+    if (!batch_.Run(this)) {
+      Compute(*input.GetColumeData(), output.GetTensor());
+    }
+  }
+
+  void Compute(const Tensor &x, Tensor &out) {
+    if (parallel_.Enabled()) {
+      ParallelCompute(x, out);
+      return;
+    }
+    scratch_.Reserve(x.size());
+    size_t n = 0;
+    for (size_t i = 0; i < x.size(); ++i) {
+      if (std::isnan(x(i))) {
+        out(i) = kNaN;
+        continue;
+      }
+      scratch_.key[n] = OrderedKey(x(i));
+      scratch_.idx[n] = static_cast<uint32_t>(i);
+      ++n;
+    }
+    if (n == 0) {
+      return;
+    }
+    scratch_.Sort(n);
+    const uint64_t *key = scratch_.key.data();
+    AssignScaledRank(
+        scratch_.idx.data(), n,
+        [key](size_t a, size_t b) { return key[a] == key[b]; }, out);
+  }
+
+private:
+  void ParallelCompute(const Tensor &x, Tensor &out) {
+    const double *data = x.data();
+    const size_t size = x.size();
+    const size_t nblock = CsParallel::NumBlocks(size);
+    // 先数出各块的有效值个数, 确定每块排序结果的写入位置
+    run_begin_.assign(nblock + 1, 0);
+    parallel_.ForBlocks(size, [this, data](size_t block, size_t begin,
+                                           size_t end) {
+      uint32_t count = 0;
+      for (size_t i = begin; i < end; ++i) {
+        count += !std::isnan(data[i]);
+      }
+      run_begin_[block + 1] = count;
+    });
+    for (size_t block = 0; block < nblock; ++block) {
+      run_begin_[block + 1] += run_begin_[block];
+    }
+    const size_t n = run_begin_[nblock];
+    key_.resize(n);
+    idx_.resize(n);
+    key_tmp_.resize(n);
+    idx_tmp_.resize(n);
+    worker_scratch_.resize(parallel_.NumWorkers());
+    parallel_.ForEach(nblock, [this, data, size, &out](size_t worker,
+                                                       size_t block) {
+      auto &scratch = worker_scratch_[worker];
+      size_t begin = block * kCsBlockSize;
+      size_t end = std::min(size, begin + kCsBlockSize);
+      scratch.Reserve(end - begin);
+      size_t m = 0;
+      for (size_t i = begin; i < end; ++i) {
+        if (std::isnan(data[i])) {
+          out(i) = kNaN;
+          continue;
+        }
+        scratch.key[m] = OrderedKey(data[i]);
+        scratch.idx[m] = static_cast<uint32_t>(i);
+        ++m;
+      }
+      scratch.Sort(m);
+      std::copy_n(scratch.key.begin(), m, key_.begin() + run_begin_[block]);
+      std::copy_n(scratch.idx.begin(), m, idx_.begin() + run_begin_[block]);
+    });
+    // 相邻的有序段两两归并, 每轮段数减半, 并列时左段在前, 与串行顺序一致
+    for (size_t width = 1; width < nblock; width *= 2) {
+      const size_t npair = (nblock + 2 * width - 1) / (2 * width);
+      parallel_.ForEach(npair, [this, width, nblock](size_t, size_t pair) {
+        size_t lo = run_begin_[std::min(2 * pair * width, nblock)];
+        size_t mid = run_begin_[std::min((2 * pair + 1) * width, nblock)];
+        size_t hi = run_begin_[std::min((2 * pair + 2) * width, nblock)];
+        MergeSortedRuns(key_.data() + lo, idx_.data() + lo, mid - lo,
+                        key_.data() + mid, idx_.data() + mid, hi - mid,
+                        key_tmp_.data() + lo, idx_tmp_.data() + lo);
+      });
+      key_.swap(key_tmp_);
+      idx_.swap(idx_tmp_);
+    }
+    if (n == 0) {
+      return;
+    }
+    const uint64_t *key = key_.data();
+    AssignScaledRank(
+        idx_.data(), n, [key](size_t a, size_t b) { return key[a] == key[b]; },
+        out);
+  }
+
+  RadixSortScratch scratch_;
+  CsParallel parallel_;
+  //   并行路径: 各块的排序结果依次存放, 第k块从run_begin_[k]开始
+  std::vector<uint32_t> run_begin_;
+  std::vector<uint64_t> key_;
+  std::vector<uint32_t> idx_;
+  std::vector<uint64_t> key_tmp_;
+  std::vector<uint32_t> idx_tmp_;
+  std::vector<RadixSortScratch> worker_scratch_;
+  CsBatchHandle batch_;
+};
+
+// 不替换库中的cs_ols_res, 见baseoperator.h中header_ops的说明
+// cs_ols_res(x, y): 截面回归 y = a + b * x + e, 返回e
+// x, y均非nan的标的参与回归, 有效值少于2个或x没有波动时为nan
+// 协方差按块统计后依次合并, 是否并行结果都相同
+class CsOLSRes : public CsBinaryOp<CsOLSRes> {
+public:
+  static constexpr const char *kName = "cs_ols_res";
+  CsOLSRes(OperatorPtr &left_child, OperatorPtr &right_child,
+           const OpInitArgs &init_args)
+      : CsBinaryOp(left_child, right_child, init_args), parallel_(init_args) {}
+  OperatorType GetType() const override { return OperatorType::CsOLSRes; }
+
+  void Update(OpInput &input, OpOutput &output) {
+    const double *x = input.GetLeftColumeData()->data();
+    const double *y = input.GetRightColumeData()->data();
+    double *out = output.GetTensor().data();
+    const size_t size = input.GetLeftColumeData()->size();
+    partials_.resize(CsParallel::NumBlocks(size));
+    parallel_.ForBlocks(size, [this, x, y](size_t block, size_t begin,
+                                           size_t end) {
+      partials_[block] = CsMomentPartial::FromPairs(begin, end, x, y);
+    });
+    CsMomentPartial total;
+    for (const auto &partial : partials_) {
+      total.Merge(partial);
+    }
+    double beta = kNaN;
+    double alpha = kNaN;
+    if (total.n > 1 && total.m2_x >= kEpsilon) {
+      beta = total.c_xy / total.m2_x;
+      alpha = total.mean_y - beta * total.mean_x;
+    }
+    parallel_.ForBlocks(size, [x, y, out, alpha, beta](size_t, size_t begin,
+                                                       size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        out[i] = y[i] - (alpha + beta * x[i]);
+      }
+    });
+  }
+
+private:
+  CsParallel parallel_;
+  std::vector<CsMomentPartial> partials_;
+};
+
+// 不替换库中的cs_quantilize, 见baseoperator.h中header_ops的说明
+// cs_quantilize(x, bins): 非nan的x按值等分为bins组, 返回组号{0, ..., bins-1}
+// 第k个分位点取排序后第k * n / bins个值, x不小于第k个分位点即落入第k组及以上
+// 分位点用多路nth_element选出, O(n log bins), 不需要全排序
+class CsQuantilize : public UnaryOp<CsQuantilize> {
+public:
+  static constexpr const char *kName = "cs_quantilize";
+
+  CsQuantilize(OperatorPtr &child, int bins, const OpInitArgs &init_args)
+      : UnaryOp(child, init_args), bins_(bins) {
+    if (bins < 1) {
+      throw std::invalid_argument("cs_quantilize bins should be positive");
+    }
+    boundaries_.reserve(bins - 1);
+    values_.reserve(Nstock());
+  }
+
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    if (args.size() != 2 || args[0].GetType() != ArgType::Operator ||
+        args[1].GetType() != ArgType::Integer) {
+      throw std::invalid_argument("cs_quantilize operator should have 2 "
+                                  "arguments");
+    }
+    auto child = args[0].GetOperator();
+    return OperatorPtr(new CsQuantilize(child, args[1].GetInteger(),
+                                        init_args));
+  }
+
+  static std::vector<ArgType> ArgTypes() {
+    return {ArgType::Operator, ArgType::Integer};
+  }
+
+  OperatorType GetType() const override { return OperatorType::CsQuantilize; }
+
+  std::string ToString() const override {
+    return std::string(kName) + "(" + GetChild()->ToString() + "," +
+           std::to_string(bins_) + ")";
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    const Tensor &x = *input.GetColumeData();
+    Tensor &out = output.GetTensor();
+    values_.clear();
+    for (double v : x) {
+      if (!std::isnan(v)) {
+        values_.push_back(v);
+      }
+    }
+    const size_t n = values_.size();
+    boundaries_.resize(bins_ - 1);
+    if (n > 0) {
+      Select(0, n, 1, bins_ - 1);
+    }
+    for (size_t i = 0; i < x.size(); ++i) {
+      if (std::isnan(x(i))) {
+        out(i) = kNaN;
+        continue;
+      }
+      auto it = std::upper_bound(boundaries_.begin(), boundaries_.end(), x(i));
+      out(i) = static_cast<double>(it - boundaries_.begin());
+    }
+  }
+
+private:
+  //   在values_[begin, end)中选出第k_lo..k_hi个分位点
+  //   先选中间的分位点, 左右两侧的分位点只会落在对应的半区内
+  void Select(size_t begin, size_t end, int k_lo, int k_hi) {
+    if (k_lo > k_hi) {
+      return;
+    }
+    const size_t n = values_.size();
+    int k = k_lo + (k_hi - k_lo) / 2;
+    size_t pos = static_cast<size_t>(k) * n / bins_;
+    std::nth_element(values_.begin() + begin, values_.begin() + pos,
+                     values_.begin() + end);
+    boundaries_[k - 1] = values_[pos];
+    Select(begin, pos, k_lo, k - 1);
+    Select(pos, end, k + 1, k_hi);
+  }
+
+  int bins_;
+  std::vector<double> values_;
+  std::vector<double> boundaries_;
+};
+
+} // namespace header_ops
+} // namespace factor_tree
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "../threadpool.h"
+#include "baseoperator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+namespace factor_tree {
+
+// 截面并行的块大小
+// 块的划分只取决于nstock, 与线程数以及是否并行无关, 归约结果按块号顺序合并,
+// 所以开关并行、改变线程数都不影响结果
+constexpr size_t kCsBlockSize = 16384;
+
+// 单个节点内的截面并行, nstock达到TreeContext::cs_parallel_threshold时启用
+// 线程池在同一棵树内共享, 已被占用时(例如批量执行中的其他节点)直接串行计算
+class CsParallel {
+public:
+  explicit CsParallel(const OpInitArgs &init_args)
+      : pool_(GetPool(init_args.config)) {}
+
+  static std::shared_ptr<ThreadPool> GetPool(const InitArgsPtr &config) {
+    auto context = GetTreeContext(config);
+    if (context->cs_parallel_threads < 2 ||
+        config->nstock < context->cs_parallel_threshold) {
+      return nullptr;
+    }
+    if (!context->cs_pool) {
+      context->cs_pool =
+          std::make_shared<ThreadPool>(context->cs_parallel_threads);
+    }
+    return context->cs_pool;
+  }
+
+  inline bool Enabled() const { return pool_ != nullptr; }
+
+  //   并行时最多同时使用的工作线程数, 用于按线程分配临时缓冲区
+  inline size_t NumWorkers() const { return pool_ ? pool_->Size() : 1; }
+
+  static inline size_t NumBlocks(size_t n) {
+    return (n + kCsBlockSize - 1) / kCsBlockSize;
+  }
+
+  //   fn(worker, k), k取遍[0, count), 各任务之间互不依赖
+  template <typename Fn> void ForEach(size_t count, Fn fn) const {
+    auto run = [&fn](size_t worker, size_t begin, size_t end) {
+      for (size_t k = begin; k < end; ++k) {
+        fn(worker, k);
+      }
+    };
+    if (!pool_ || count < 2 || !pool_->TryParallelFor(count, run)) {
+      run(0, 0, count);
+    }
+  }
+
+  //   fn(block, begin, end), 按kCsBlockSize划分[0, n)
+  template <typename Fn> void ForBlocks(size_t n, Fn fn) const {
+    ForEach(NumBlocks(n), [&fn, n](size_t, size_t block) {
+      size_t begin = block * kCsBlockSize;
+      fn(block, begin, std::min(n, begin + kCsBlockSize));
+    });
+  }
+
+private:
+  std::shared_ptr<ThreadPool> pool_;
+};
+
+// 可合并的一阶、二阶矩, 合并方式见Chan et al.的并行方差算法
+// 同时记录y时可得到x, y的协方差, 供截面回归使用
+struct CsMomentPartial {
+  size_t n = 0;
+  double mean_x = 0.0;
+  double mean_y = 0.0;
+  double m2_x = 0.0;
+  double m2_y = 0.0;
+  double c_xy = 0.0;
+  double min = std::numeric_limits<double>::quiet_NaN();
+  double max = std::numeric_limits<double>::quiet_NaN();
+
+  //   用块内第一个值做平移后累加, 再转换为均值和离差平方和
+  template <typename Value>
+  static CsMomentPartial FromRange(size_t begin, size_t end, Value value) {
+    CsMomentPartial p;
+    double shift = 0.0;
+    double sum = 0.0;
+    double sum_sq = 0.0;
+    for (size_t i = begin; i < end; ++i) {
+      double v = value(i);
+      if (std::isnan(v)) {
+        continue;
+      }
+      if (p.n == 0) {
+        shift = v;
+        p.min = v;
+        p.max = v;
+      }
+      double d = v - shift;
+      sum += d;
+      sum_sq += d * d;
+      p.min = std::min(p.min, v);
+      p.max = std::max(p.max, v);
+      ++p.n;
+    }
+    if (p.n > 0) {
+      p.mean_x = shift + sum / p.n;
+      p.m2_x = std::max(sum_sq - sum * sum / p.n, 0.0);
+    }
+    return p;
+  }
+
+  //   x, y都非nan的元素
+  static CsMomentPartial FromPairs(size_t begin, size_t end, const double *x,
+                                   const double *y) {
+    CsMomentPartial p;
+    double shift_x = 0.0;
+    double shift_y = 0.0;
+    double sx = 0.0, sy = 0.0, sxx = 0.0, syy = 0.0, sxy = 0.0;
+    for (size_t i = begin; i < end; ++i) {
+      if (std::isnan(x[i]) || std::isnan(y[i])) {
+        continue;
+      }
+      if (p.n == 0) {
+        shift_x = x[i];
+        shift_y = y[i];
+      }
+      double dx = x[i] - shift_x;
+      double dy = y[i] - shift_y;
+      sx += dx;
+      sy += dy;
+      sxx += dx * dx;
+      syy += dy * dy;
+      sxy += dx * dy;
+      ++p.n;
+    }
+    if (p.n > 0) {
+      p.mean_x = shift_x + sx / p.n;
+      p.mean_y = shift_y + sy / p.n;
+      p.m2_x = std::max(sxx - sx * sx / p.n, 0.0);
+      p.m2_y = std::max(syy - sy * sy / p.n, 0.0);
+      p.c_xy = sxy - sx * sy / p.n;
+    }
+    return p;
+  }
+
+  void Merge(const CsMomentPartial &other) {
+    if (other.n == 0) {
+      return;
+    }
+    if (n == 0) {
+      *this = other;
+      return;
+    }
+    double na = static_cast<double>(n);
+    double nb = static_cast<double>(other.n);
+    double total = na + nb;
+    double dx = other.mean_x - mean_x;
+    double dy = other.mean_y - mean_y;
+    mean_x += dx * nb / total;
+    mean_y += dy * nb / total;
+    m2_x += other.m2_x + dx * dx * na * nb / total;
+    m2_y += other.m2_y + dy * dy * na * nb / total;
+    c_xy += other.c_xy + dx * dy * na * nb / total;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    n += other.n;
+  }
+};
+
+} // namespace factor_tree
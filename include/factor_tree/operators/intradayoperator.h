@@ -0,0 +1,221 @@
+#pragma once
+
+#include "tsoperator.h"
+
+#include <cereal/types/vector.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+
+// ema连续收到这么多个nan后遗忘之前的值, 见operators.md中ts_ema的说明
+constexpr int32_t kEmaForgetCount = 100;
+
+// 日内状态按标的打上day_epoch标记, 换日时只递增TreeContext::day_epoch,
+// 不遍历也不清空状态, 每个标的在当天第一次Update时发现标记过期再重置
+struct IntradayLanes {
+  std::shared_ptr<const TreeContext> context;
+  std::vector<size_t> lane_epoch;
+
+  IntradayLanes() = default;
+  explicit IntradayLanes(const InitArgsPtr &config)
+      : IntradayLanes(config, config->nstock) {}
+  IntradayLanes(const InitArgsPtr &config, size_t nlane)
+      : context(GetTreeContext(config)),
+        lane_epoch(nlane, context->day_epoch - 1) {}
+
+  //   固定当前day_epoch的拷贝, 之后树上换日不影响它, 可以在其他线程上
+  //   序列化, 见状态的Detach. 普通的拷贝仍跟随树的TreeContext
+  IntradayLanes Snapshot() const {
+    IntradayLanes copy;
+    copy.lane_epoch = lane_epoch;
+    if (context) {
+      auto frozen = std::make_shared<TreeContext>();
+      frozen->day_epoch = context->day_epoch;
+      copy.context = std::move(frozen);
+    }
+    return copy;
+  }
+
+  //   第i路状态是否需要重置, 返回true后当天不再重置
+  inline bool Stale(size_t i) {
+    if (lane_epoch[i] == context->day_epoch) {
+      return false;
+    }
+    lane_epoch[i] = context->day_epoch;
+    return true;
+  }
+
+  //   day_epoch不序列化, 只保存每路状态距今的天数, 加载后按新树的epoch还原
+  template <class Archive> void save(Archive &ar) const {
+    std::vector<size_t> age(lane_epoch.size());
+    for (size_t i = 0; i < age.size(); ++i) {
+      age[i] = context->day_epoch - lane_epoch[i];
+    }
+    ar(age);
+  }
+
+  template <class Archive> void load(Archive &ar) {
+    std::vector<size_t> age;
+    ar(age);
+    for (size_t i = 0; i < age.size() && i < lane_epoch.size(); ++i) {
+      lane_epoch[i] = context->day_epoch - age[i];
+    }
+  }
+
+};
+
+namespace header_ops {
+
+// in_ts_mean / in_ts_std 公用的日内滑动窗口和
+// 环形缓冲区的写入位置全局共享, 每个标的单独记录当天的观测数
+struct InTsMomentState : public BaseState {
+  static constexpr bool kDayAware = false;
+
+  IntradayLanes lanes;
+  RingBuffer ring;
+  //   当天观测数, nan也算观测, 最多为window
+  std::vector<int32_t> count;
+  std::vector<int32_t> valid_count;
+  std::vector<double> sum;
+  std::vector<double> sum_sq;
+
+  InTsMomentState() = default;
+  InTsMomentState(size_t window, const InitArgsPtr &config)
+      : lanes(config), ring(window, config->nstock), count(config->nstock, 0),
+        valid_count(config->nstock, 0), sum(config->nstock, 0.0),
+        sum_sq(config->nstock, 0.0) {}
+
+  void Push(const Tensor &x) {
+    const int32_t window = static_cast<int32_t>(ring.window);
+    const double *old = ring.Oldest();
+    for (size_t i = 0; i < ring.nstock; ++i) {
+      if (lanes.Stale(i)) {
+        count[i] = 0;
+        valid_count[i] = 0;
+        sum[i] = 0.0;
+        sum_sq[i] = 0.0;
+      }
+      if (count[i] == window) {
+        if (!std::isnan(old[i])) {
+          --valid_count[i];
+          sum[i] -= old[i];
+          sum_sq[i] -= old[i] * old[i];
+        }
+      } else {
+        ++count[i];
+      }
+      double xn = x(i);
+      if (!std::isnan(xn)) {
+        ++valid_count[i];
+        sum[i] += xn;
+        sum_sq[i] += xn * xn;
+      }
+    }
+    ring.Push(x);
+  }
+
+  void Detach() { lanes = lanes.Snapshot(); }
+
+  template <class Archive> void serialize(Archive &ar) {
+    ar(lanes, ring, count, valid_count, sum, sum_sq);
+  }
+};
+
+// in_ts_mean(x, window): min_count=1
+struct InTsMeanState : public InTsMomentState {
+  using InTsMomentState::InTsMomentState;
+
+  void Update(const Tensor &x, Tensor &out) {
+    Push(x);
+    for (size_t i = 0; i < ring.nstock; ++i) {
+      out(i) = valid_count[i] > 0 ? sum[i] / valid_count[i] : kNaN;
+    }
+  }
+};
+
+// in_ts_std(x, window): 样本标准差, min_count=2
+struct InTsStdState : public InTsMomentState {
+  using InTsMomentState::InTsMomentState;
+
+  void Update(const Tensor &x, Tensor &out) {
+    Push(x);
+    for (size_t i = 0; i < ring.nstock; ++i) {
+      if (count[i] < 2 || valid_count[i] < 2) {
+        out(i) = kNaN;
+        continue;
+      }
+      double n = valid_count[i];
+      double var = (sum_sq[i] - sum[i] * sum[i] / n) / (n - 1);
+      out(i) = std::sqrt(std::max(var, 0.0));
+    }
+  }
+};
+
+// in_ts_ema(x, window): alpha = 2 / (1 + window), 当天第一个观测作为初值
+struct InTsEmaState : public BaseState {
+  static constexpr bool kDayAware = false;
+
+  IntradayLanes lanes;
+  double alpha = 1.0;
+  std::vector<double> ema;
+  std::vector<int32_t> nan_streak;
+
+  InTsEmaState() = default;
+  InTsEmaState(size_t window, const InitArgsPtr &config)
+      : lanes(config), alpha(2.0 / (1.0 + static_cast<double>(window))),
+        ema(config->nstock, kNaN), nan_streak(config->nstock, 0) {}
+
+  void Update(const Tensor &x, Tensor &out) {
+    for (size_t i = 0; i < ema.size(); ++i) {
+      if (lanes.Stale(i)) {
+        ema[i] = kNaN;
+        nan_streak[i] = 0;
+      }
+      double xn = x(i);
+      if (std::isnan(xn)) {
+        if (++nan_streak[i] >= kEmaForgetCount) {
+          ema[i] = kNaN;
+        }
+      } else {
+        nan_streak[i] = 0;
+        ema[i] = std::isnan(ema[i]) ? xn : alpha * xn + (1 - alpha) * ema[i];
+      }
+      out(i) = ema[i];
+    }
+  }
+
+  void Detach() { lanes = lanes.Snapshot(); }
+
+  template <class Archive> void serialize(Archive &ar) {
+    ar(lanes, alpha, ema, nan_streak);
+  }
+};
+
+// 不替换库中的in_ts_*, 见baseoperator.h中header_ops的说明
+class InTsMean : public TsWindowUnaryOp<InTsMean, InTsMeanState> {
+public:
+  static constexpr const char *kName = "in_ts_mean";
+  using TsWindowUnaryOp::TsWindowUnaryOp;
+  OperatorType GetType() const override { return OperatorType::InTsMean; }
+};
+
+class InTsStd : public TsWindowUnaryOp<InTsStd, InTsStdState> {
+public:
+  static constexpr const char *kName = "in_ts_std";
+  using TsWindowUnaryOp::TsWindowUnaryOp;
+  OperatorType GetType() const override { return OperatorType::InTsStd; }
+};
+
+class InTsEma : public TsWindowUnaryOp<InTsEma, InTsEmaState> {
+public:
+  static constexpr const char *kName = "in_ts_ema";
+  using TsWindowUnaryOp::TsWindowUnaryOp;
+  OperatorType GetType() const override { return OperatorType::InTsEma; }
+};
+
+} // namespace header_ops
+} // namespace factor_tree
@@ -0,0 +1,236 @@
+#pragma once
+
+#include "tsoperator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace factor_tree {
+namespace header_ops {
+
+// 不替换库中的常量节点和add/subtract/multiply/divide/less/greater,
+// 见baseoperator.h中header_ops的说明. 库的CreateTree不做常量折叠, 也不
+// 选择下面的标量节点
+
+// 常量节点, 表达式中以#开头, 例如 #-1.5
+// 缓冲区在构建时填满, 之后每个批次直接返回
+// 由常量子树折叠得到时expr为原表达式, ToString不变, 去重和子树键不受影响
+class ConstantOp : public BaseOperator, public DagOp {
+public:
+  ConstantOp(double value, const OpInitArgs &init_args, std::string expr = "")
+      : BaseOperator(init_args), value_(value), expr_(std::move(expr)) {
+    std::fill(GetOpResultBuffer()->begin(), GetOpResultBuffer()->end(), value);
+  }
+
+  OpOutput GetResult(RequestIdx idx) override {
+    UpdateRequestIdx(idx);
+    return OpOutput(GetOpResultBuffer());
+  }
+
+  OperatorType GetType() const override { return OperatorType::Constant; }
+
+  std::string ToString() const override {
+    return expr_.empty() ? "#" + FormatDouble(value_) : expr_;
+  }
+
+  double GetValue() const { return value_; }
+
+private:
+  double value_;
+  std::string expr_;
+};
+
+// op是常量节点时取出它的值
+// 非ConstantOp实现的常量节点按ToString()即"#value"解析
+inline bool GetConstantValue(const OperatorPtr &op, double &value) {
+  if (op->GetType() != OperatorType::Constant) {
+    return false;
+  }
+  if (auto constant = dynamic_cast<const ConstantOp *>(op.get())) {
+    value = constant->GetValue();
+    return true;
+  }
+  std::string expr = op->ToString();
+  if (expr.size() < 2 || expr[0] != '#') {
+    return false;
+  }
+  try {
+    size_t pos = 0;
+    value = std::stod(expr.substr(1), &pos);
+    return pos + 1 == expr.size();
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+// 二元逐元素运算, x, y任一为nan时返回nan, 见operators.md
+template <OperatorType kType> struct MathKernel;
+
+template <> struct MathKernel<OperatorType::MathAdd> {
+  static constexpr const char *kName = "add";
+  static inline double Apply(double x, double y) { return x + y; }
+};
+
+template <> struct MathKernel<OperatorType::MathSubtract> {
+  static constexpr const char *kName = "subtract";
+  static inline double Apply(double x, double y) { return x - y; }
+};
+
+template <> struct MathKernel<OperatorType::MathMultiply> {
+  static constexpr const char *kName = "multiply";
+  static inline double Apply(double x, double y) { return x * y; }
+};
+
+template <> struct MathKernel<OperatorType::MathDivide> {
+  static constexpr const char *kName = "divide";
+  //   |y|很小时返回nan
+  static inline double Apply(double x, double y) {
+    return std::abs(y) < kEpsilon ? kNaN : x / y;
+  }
+};
+
+template <> struct MathKernel<OperatorType::MathLess> {
+  static constexpr const char *kName = "less";
+  static inline double Apply(double x, double y) {
+    return (std::isnan(x) || std::isnan(y)) ? kNaN : (x < y ? 1.0 : 0.0);
+  }
+};
+
+template <> struct MathKernel<OperatorType::MathGreater> {
+  static constexpr const char *kName = "greater";
+  static inline double Apply(double x, double y) {
+    return (std::isnan(x) || std::isnan(y)) ? kNaN : (x > y ? 1.0 : 0.0);
+  }
+};
+
+// 两个输入都是变量的一般情况
+template <OperatorType kType>
+class MathBinaryOp : public BinaryOp<MathBinaryOp<kType>> {
+public:
+  using Kernel = MathKernel<kType>;
+  using BinaryOp<MathBinaryOp<kType>>::BinaryOp;
+  using BinaryOp<MathBinaryOp<kType>>::GetLeftChild;
+  using BinaryOp<MathBinaryOp<kType>>::GetRightChild;
+
+  OperatorType GetType() const override { return kType; }
+
+  std::string ToString() const override {
+    return std::string(Kernel::kName) + "(" + GetLeftChild()->ToString() +
+           "," + GetRightChild()->ToString() + ")";
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    const double *x = input.GetLeftColumeData()->data();
+    const double *y = input.GetRightColumeData()->data();
+    Tensor &out_tensor = output.GetTensor();
+    double *out = out_tensor.data();
+    const size_t size = out_tensor.size();
+    for (size_t i = 0; i < size; ++i) {
+      out[i] = Kernel::Apply(x[i], y[i]);
+    }
+  }
+};
+
+// 一侧为常量: 常量节点不作为子节点, 也不读它的缓冲区, 只保留标量
+// kScalarLeft表示常量在左侧, 例如 subtract(#1,@x)
+template <OperatorType kType, bool kScalarLeft>
+class MathScalarOp : public UnaryOp<MathScalarOp<kType, kScalarLeft>> {
+public:
+  using Kernel = MathKernel<kType>;
+  using UnaryOp<MathScalarOp<kType, kScalarLeft>>::GetChild;
+
+  MathScalarOp(OperatorPtr &child, double scalar, std::string scalar_expr,
+               const OpInitArgs &init_args)
+      : UnaryOp<MathScalarOp<kType, kScalarLeft>>(child, init_args),
+        scalar_(scalar), scalar_expr_(std::move(scalar_expr)) {}
+
+  OperatorType GetType() const override { return kType; }
+
+  //   与原表达式一致, 常量保留原来的写法
+  std::string ToString() const override {
+    std::string child = GetChild()->ToString();
+    return std::string(Kernel::kName) + "(" +
+           (kScalarLeft ? scalar_expr_ + "," + child
+                        : child + "," + scalar_expr_) +
+           ")";
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    const double *x = input.GetColumeData()->data();
+    Tensor &out_tensor = output.GetTensor();
+    double *out = out_tensor.data();
+    const size_t size = out_tensor.size();
+    const double c = scalar_;
+    for (size_t i = 0; i < size; ++i) {
+      out[i] = kScalarLeft ? Kernel::Apply(c, x[i]) : Kernel::Apply(x[i], c);
+    }
+  }
+
+  double GetScalar() const { return scalar_; }
+
+private:
+  double scalar_;
+  std::string scalar_expr_;
+};
+
+// 二元逐元素算子的构建入口, 按输入是否为常量选择节点:
+//   两侧都是常量: 直接折叠为常量节点, 值为1/3, ToString仍为divide(#1,#3)
+//     结果为nan或inf时不折叠(例如 divide(#1,#0)), 按一侧是常量处理
+//   一侧是常量: MathScalarOp
+//   否则: MathBinaryOp
+// 子节点先于父节点构建, 嵌套的常量子树会逐层折叠
+template <OperatorType kType> struct MathBinaryFactory {
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    if (args.size() != 2 || args[0].GetType() != ArgType::Operator ||
+        args[1].GetType() != ArgType::Operator) {
+      throw std::invalid_argument(std::string(MathKernel<kType>::kName) +
+                                  " operator should have 2 arguments");
+    }
+    auto left = args[0].GetOperator();
+    auto right = args[1].GetOperator();
+    double lvalue = 0.0;
+    double rvalue = 0.0;
+    bool lconst = GetConstantValue(left, lvalue);
+    bool rconst = GetConstantValue(right, rvalue);
+    double folded = MathKernel<kType>::Apply(lvalue, rvalue);
+    if (lconst && rconst && std::isfinite(folded)) {
+      std::string expr = std::string(MathKernel<kType>::kName) + "(" +
+                         left->ToString() + "," + right->ToString() + ")";
+      return OperatorPtr(new ConstantOp(folded, init_args, std::move(expr)));
+    }
+    if (rconst) {
+      return OperatorPtr(new MathScalarOp<kType, false>(
+          left, rvalue, right->ToString(), init_args));
+    }
+    if (lconst) {
+      return OperatorPtr(new MathScalarOp<kType, true>(
+          right, lvalue, left->ToString(), init_args));
+    }
+    return OperatorPtr(new MathBinaryOp<kType>(left, right, init_args));
+  }
+
+  static std::vector<ArgType> ArgTypes() {
+    return {ArgType::Operator, ArgType::Operator};
+  }
+};
+
+// add(x, y)
+using MathAdd = MathBinaryFactory<OperatorType::MathAdd>;
+// subtract(x, y)
+using MathSubtract = MathBinaryFactory<OperatorType::MathSubtract>;
+// multiply(x, y)
+using MathMultiply = MathBinaryFactory<OperatorType::MathMultiply>;
+// divide(x, y): |y|很小时返回nan
+using MathDivide = MathBinaryFactory<OperatorType::MathDivide>;
+// less(x, y): x < y返回1, 否则返回0
+using MathLess = MathBinaryFactory<OperatorType::MathLess>;
+// greater(x, y): x > y返回1, 否则返回0
+using MathGreater = MathBinaryFactory<OperatorType::MathGreater>;
+
+} // namespace header_ops
+} // namespace factor_tree
@@ -0,0 +1,522 @@
+#pragma once
+
+#include "csoperator.h"
+#include "csparallel.h"
+#include "tsoperator.h"
+
+#include <cereal/types/vector.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+
+// 多元回归算子: cs_ols_res_k / ts_ols_*_k
+// 第一个子节点为y, 之后依次为x1..xk, 回归 y = a + b1 * x1 + ... + bk * xk + e
+
+// 解析 name(y, x1, ..., xk, p1, ..., pm), 至少一个x, 末尾为nparam个整数参数
+inline std::vector<OperatorPtr> ParseOlsArgs(const char *name,
+                                             const std::vector<Arg> &args,
+                                             size_t nparam,
+                                             std::vector<int> &params) {
+  if (args.size() < 2 + nparam) {
+    throw std::invalid_argument(std::string(name) +
+                                " operator should have at least " +
+                                std::to_string(2 + nparam) + " arguments");
+  }
+  const size_t nchild = args.size() - nparam;
+  std::vector<OperatorPtr> childs;
+  for (size_t k = 0; k < nchild; ++k) {
+    if (args[k].GetType() != ArgType::Operator) {
+      throw std::invalid_argument(std::string(name) + " argument " +
+                                  std::to_string(k + 1) +
+                                  " should be an operator");
+    }
+    childs.push_back(args[k].GetOperator());
+  }
+  params.clear();
+  for (size_t k = nchild; k < args.size(); ++k) {
+    if (args[k].GetType() != ArgType::Integer) {
+      throw std::invalid_argument(std::string(name) + " argument " +
+                                  std::to_string(k + 1) +
+                                  " should be an integer");
+    }
+    params.push_back(args[k].GetInteger());
+  }
+  return childs;
+}
+
+// 原地求解对称正定方程组 a * x = b, a按行存放, 只使用下三角
+// a被改写为Cholesky因子L, b被改写为解; 主元相对原对角元过小(共线)时返回false
+inline bool CholeskySolve(double *a, double *b, size_t dim) {
+  for (size_t j = 0; j < dim; ++j) {
+    double *row_j = a + j * dim;
+    double diag = row_j[j];
+    double d = diag;
+    for (size_t p = 0; p < j; ++p) {
+      d -= row_j[p] * row_j[p];
+    }
+    if (!(d > kEpsilon * diag)) {
+      return false;
+    }
+    row_j[j] = std::sqrt(d);
+    for (size_t i = j + 1; i < dim; ++i) {
+      double *row_i = a + i * dim;
+      double v = row_i[j];
+      for (size_t p = 0; p < j; ++p) {
+        v -= row_i[p] * row_j[p];
+      }
+      row_i[j] = v / row_j[j];
+    }
+  }
+  for (size_t i = 0; i < dim; ++i) {
+    double v = b[i];
+    for (size_t p = 0; p < i; ++p) {
+      v -= a[i * dim + p] * b[p];
+    }
+    b[i] = v / a[i * dim + i];
+  }
+  for (size_t i = dim; i-- > 0;) {
+    double v = b[i];
+    for (size_t p = i + 1; p < dim; ++p) {
+      v -= a[p * dim + i] * b[p];
+    }
+    b[i] = v / a[i * dim + i];
+  }
+  return true;
+}
+
+// cs_ols_res_k(y, x1, ..., xk): 截面多元回归, 返回e
+// y和所有x均非nan的标的参与回归, 有效值不多于k个或x共线时为nan
+// 先求均值, 再累加中心化后的 Σx'x 与 Σx'y, 截距不进入方程组;
+// 两遍都按块统计后依次合并, 是否并行结果都相同
+class CsOLSResK : public NaryOp<CsOLSResK> {
+public:
+  static constexpr const char *kName = "cs_ols_res_k";
+
+  CsOLSResK(const std::vector<OperatorPtr> &childs,
+            const OpInitArgs &init_args)
+      : NaryOp(childs, init_args), k_(childs.size() - 1),
+        parallel_(init_args) {}
+
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    std::vector<int> params;
+    auto childs = ParseOlsArgs(kName, args, 0, params);
+    return OperatorPtr(new CsOLSResK(childs, init_args));
+  }
+
+  //   x的个数可变, 这里只列出最少的参数
+  static std::vector<ArgType> ArgTypes() {
+    return {ArgType::Operator, ArgType::Operator};
+  }
+
+  OperatorType GetType() const override { return OperatorType::CsOLSResK; }
+
+  std::string ToString() const override {
+    std::string expr = std::string(kName) + "(";
+    for (size_t c = 0; c < GetChilds().size(); ++c) {
+      expr += (c > 0 ? "," : "") + GetChilds()[c]->ToString();
+    }
+    return expr + ")";
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    const size_t dim = k_ + 1;
+    const size_t size = Nstock();
+    const size_t nblock = CsParallel::NumBlocks(size);
+    cols_.resize(dim);
+    for (size_t c = 0; c < dim; ++c) {
+      cols_[c] = input.GetColumeData(c)->data();
+    }
+    double *out = output.GetTensor().data();
+
+    // 第一遍: 每块的有效行数和各列之和, [count, Σy, Σx1, ..., Σxk]
+    block_sum_.assign(nblock * (dim + 1), 0.0);
+    parallel_.ForBlocks(size, [this, dim](size_t block, size_t begin,
+                                          size_t end) {
+      double *sum = block_sum_.data() + block * (dim + 1);
+      for (size_t i = begin; i < end; ++i) {
+        if (!RowValid(i)) {
+          continue;
+        }
+        sum[0] += 1.0;
+        for (size_t c = 0; c < dim; ++c) {
+          sum[c + 1] += cols_[c][i];
+        }
+      }
+    });
+    mean_.assign(dim + 1, 0.0);
+    for (size_t block = 0; block < nblock; ++block) {
+      for (size_t c = 0; c <= dim; ++c) {
+        mean_[c] += block_sum_[block * (dim + 1) + c];
+      }
+    }
+    const double n = mean_[0];
+    if (n <= static_cast<double>(k_)) {
+      std::fill(out, out + size, kNaN);
+      return;
+    }
+    for (size_t c = 1; c <= dim; ++c) {
+      mean_[c] /= n;
+    }
+
+    // 第二遍: 每块中心化后的 Σx'x (k x k, 下三角) 与 Σx'y (k)
+    const size_t stride = k_ * k_ + k_;
+    block_cross_.assign(nblock * stride, 0.0);
+    block_dev_.resize(nblock * dim);
+    parallel_.ForBlocks(size, [this, dim, stride](size_t block, size_t begin,
+                                                  size_t end) {
+      double *xx = block_cross_.data() + block * stride;
+      double *xy = xx + k_ * k_;
+      double *d = block_dev_.data() + block * dim;
+      for (size_t i = begin; i < end; ++i) {
+        if (!RowValid(i)) {
+          continue;
+        }
+        for (size_t c = 0; c < dim; ++c) {
+          d[c] = cols_[c][i] - mean_[c + 1];
+        }
+        for (size_t a = 0; a < k_; ++a) {
+          xy[a] += d[a + 1] * d[0];
+          for (size_t b = 0; b <= a; ++b) {
+            xx[a * k_ + b] += d[a + 1] * d[b + 1];
+          }
+        }
+      }
+    });
+    xx_.assign(k_ * k_, 0.0);
+    beta_.assign(k_, 0.0);
+    for (size_t block = 0; block < nblock; ++block) {
+      const double *cross = block_cross_.data() + block * stride;
+      for (size_t j = 0; j < k_ * k_; ++j) {
+        xx_[j] += cross[j];
+      }
+      for (size_t j = 0; j < k_; ++j) {
+        beta_[j] += cross[k_ * k_ + j];
+      }
+    }
+    const bool solved = CholeskySolve(xx_.data(), beta_.data(), k_);
+
+    parallel_.ForBlocks(size, [this, dim, out, solved](size_t, size_t begin,
+                                                       size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        if (!solved || !RowValid(i)) {
+          out[i] = kNaN;
+          continue;
+        }
+        double res = cols_[0][i] - mean_[1];
+        for (size_t c = 1; c < dim; ++c) {
+          res -= beta_[c - 1] * (cols_[c][i] - mean_[c + 1]);
+        }
+        out[i] = res;
+      }
+    });
+  }
+
+private:
+  inline bool RowValid(size_t i) const {
+    for (const double *col : cols_) {
+      if (std::isnan(col[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t k_;
+  CsParallel parallel_;
+  std::vector<const double *> cols_;
+  //   mean_[0]为有效行数, mean_[c + 1]为第c列均值
+  std::vector<double> mean_;
+  std::vector<double> block_sum_;
+  std::vector<double> block_cross_;
+  //   第二遍每块一行中心化后的值, 各块互不重叠
+  std::vector<double> block_dev_;
+  std::vector<double> xx_;
+  std::vector<double> beta_;
+};
+
+// ts_ols_*_k 的滚动状态, 每个标的维护一组增广正规方程
+// z = (1, x1, ..., xk), 累加 Σzz' 与 Σzy, 进出窗口时加减一行, 每次Update
+// 对每个标的做一次(k+1)维的Cholesky分解
+// 为减小大均值带来的抵消误差, 各列先减去每个标的的参考值(重算时取窗口内
+// 最新的有效行), 斜率不受影响, 截距在输出时换算回原值
+struct TsOlsKState : public RollingSumState {
+  //   coef为-1时输出当前时刻的残差, 否则输出z中第coef个系数(0为截距)
+  static constexpr int kResidual = -1;
+
+  size_t k = 0;
+  int coef = kResidual;
+  //   ring存y, x_rings[j]存x_{j+1}
+  std::vector<RingBuffer> x_rings;
+  //   nstock x (k + 1), 第0列为y的参考值
+  std::vector<double> shift;
+  //   nstock x (k + 1) x (k + 1), 只使用下三角
+  std::vector<double> zz;
+  //   nstock x (k + 1)
+  std::vector<double> zy;
+  std::vector<int32_t> valid_count;
+
+  TsOlsKState() = default;
+  TsOlsKState(size_t k, size_t window, int coef, const InitArgs &config)
+      : RollingSumState(window, config.nstock), k(k), coef(coef),
+        x_rings(k, RingBuffer(window, config.nstock)),
+        shift(config.nstock * (k + 1), 0.0),
+        zz(config.nstock * (k + 1) * (k + 1), 0.0),
+        zy(config.nstock * (k + 1), 0.0), valid_count(config.nstock, 0) {}
+
+  void Update(OpInput &input, Tensor &out) {
+    const size_t dim = k + 1;
+    const size_t nstock = ring.nstock;
+    cols_.resize(dim);
+    for (size_t c = 0; c < dim; ++c) {
+      cols_[c] = input.GetColumeData(c)->data();
+    }
+    row_.resize(dim);
+    if (ring.Full()) {
+      old_.resize(dim);
+      old_[0] = ring.Oldest();
+      for (size_t j = 0; j < k; ++j) {
+        old_[j + 1] = x_rings[j].Oldest();
+      }
+      for (size_t i = 0; i < nstock; ++i) {
+        AddRow(old_, i, -1);
+      }
+    }
+    for (size_t i = 0; i < nstock; ++i) {
+      AddRow(cols_, i, 1);
+    }
+    ring.Push(*input.GetColumeData(0));
+    for (size_t j = 0; j < k; ++j) {
+      x_rings[j].Push(*input.GetColumeData(j + 1));
+    }
+    if (NeedRefresh()) {
+      Refresh();
+    }
+
+    if (!ring.Full()) {
+      std::fill(out.begin(), out.end(), kNaN);
+      return;
+    }
+    a_.resize(dim * dim);
+    b_.resize(dim);
+    const int32_t window = static_cast<int32_t>(ring.window);
+    for (size_t i = 0; i < nstock; ++i) {
+      if (valid_count[i] < window) {
+        out(i) = kNaN;
+        continue;
+      }
+      std::copy_n(zz.begin() + i * dim * dim, dim * dim, a_.begin());
+      std::copy_n(zy.begin() + i * dim, dim, b_.begin());
+      if (!CholeskySolve(a_.data(), b_.data(), dim)) {
+        out(i) = kNaN;
+        continue;
+      }
+      const double *s = shift.data() + i * dim;
+      if (coef == kResidual) {
+        double res = cols_[0][i] - s[0] - b_[0];
+        for (size_t c = 1; c < dim; ++c) {
+          res -= b_[c] * (cols_[c][i] - s[c]);
+        }
+        out(i) = res;
+      } else if (coef == 0) {
+        double alpha = b_[0] + s[0];
+        for (size_t c = 1; c < dim; ++c) {
+          alpha -= b_[c] * s[c];
+        }
+        out(i) = alpha;
+      } else {
+        out(i) = b_[coef];
+      }
+    }
+  }
+
+  void Refresh() {
+    const size_t dim = k + 1;
+    const size_t nstock = ring.nstock;
+    std::fill(zz.begin(), zz.end(), 0.0);
+    std::fill(zy.begin(), zy.end(), 0.0);
+    std::fill(valid_count.begin(), valid_count.end(), 0);
+    std::fill(shift.begin(), shift.end(), 0.0);
+    std::vector<const double *> rows(dim);
+    // 从新到旧找到每个标的最新的有效行作为参考值
+    std::vector<char> found(nstock, 0);
+    for (size_t t = ring.count; t-- > 0;) {
+      RowsAt(t, rows);
+      for (size_t i = 0; i < nstock; ++i) {
+        if (found[i] || !RowValid(rows, i)) {
+          continue;
+        }
+        found[i] = 1;
+        for (size_t c = 0; c < dim; ++c) {
+          shift[i * dim + c] = rows[c][i];
+        }
+      }
+    }
+    for (size_t t = 0; t < ring.count; ++t) {
+      RowsAt(t, rows);
+      for (size_t i = 0; i < nstock; ++i) {
+        AddRow(rows, i, 1);
+      }
+    }
+  }
+
+  template <class Archive> void serialize(Archive &ar) {
+    RollingSumState::serialize(ar);
+    ar(k, x_rings, shift, zz, zy, valid_count);
+  }
+
+private:
+  void RowsAt(size_t t, std::vector<const double *> &rows) const {
+    rows[0] = ring.At(t);
+    for (size_t j = 0; j < k; ++j) {
+      rows[j + 1] = x_rings[j].At(t);
+    }
+  }
+
+  static inline bool RowValid(const std::vector<const double *> &rows,
+                              size_t i) {
+    for (const double *col : rows) {
+      if (std::isnan(col[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  //   把第i个标的在rows中的一行加入(sign=1)或移出(sign=-1)正规方程
+  inline void AddRow(const std::vector<const double *> &rows, size_t i,
+                     int sign) {
+    if (!RowValid(rows, i)) {
+      return;
+    }
+    const size_t dim = k + 1;
+    const double *s = shift.data() + i * dim;
+    double *a = zz.data() + i * dim * dim;
+    double *b = zy.data() + i * dim;
+    const double y = (rows[0][i] - s[0]) * sign;
+    row_[0] = 1.0;
+    for (size_t c = 1; c < dim; ++c) {
+      row_[c] = rows[c][i] - s[c];
+    }
+    for (size_t p = 0; p < dim; ++p) {
+      b[p] += row_[p] * y;
+      const double zp = row_[p] * sign;
+      for (size_t q = 0; q <= p; ++q) {
+        a[p * dim + q] += zp * row_[q];
+      }
+    }
+    valid_count[i] += sign;
+  }
+
+  std::vector<const double *> cols_;
+  std::vector<const double *> old_;
+  std::vector<double> row_;
+  std::vector<double> a_;
+  std::vector<double> b_;
+};
+
+// ts_ols_*_k 公共部分, 参数为 (y, x1, ..., xk, RealOp::kNumParams个整数)
+// 最后一个整数为window, min_count=window
+template <typename RealOp>
+class TsOlsKOp : public StatefulNaryOp<RealOp, TsOlsKState> {
+public:
+  using StatefulNaryOp<RealOp, TsOlsKState>::GetChilds;
+  using StatefulNaryOp<RealOp, TsOlsKState>::GetState;
+
+  TsOlsKOp(const std::vector<OperatorPtr> &childs, std::vector<int> params,
+           const OpInitArgs &init_args)
+      : StatefulNaryOp<RealOp, TsOlsKState>(
+            childs,
+            TsOlsKState(childs.size() - 1, Window(params),
+                        RealOp::Coef(params), *init_args.config),
+            init_args),
+        params_(std::move(params)) {}
+
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    std::vector<int> params;
+    auto childs = ParseOlsArgs(RealOp::kName, args, RealOp::kNumParams, params);
+    if (params.back() < 1) {
+      throw std::invalid_argument(std::string(RealOp::kName) +
+                                  " window should be positive");
+    }
+    RealOp::CheckParams(childs.size() - 1, params);
+    return OperatorPtr(new RealOp(childs, std::move(params), init_args));
+  }
+
+  //   x的个数可变, 这里只列出最少的参数
+  static std::vector<ArgType> ArgTypes() {
+    std::vector<ArgType> types{ArgType::Operator, ArgType::Operator};
+    types.insert(types.end(), RealOp::kNumParams, ArgType::Integer);
+    return types;
+  }
+
+  std::string ToString() const override {
+    std::string expr = std::string(RealOp::kName) + "(";
+    for (size_t c = 0; c < GetChilds().size(); ++c) {
+      expr += (c > 0 ? "," : "") + GetChilds()[c]->ToString();
+    }
+    for (int param : params_) {
+      expr += "," + std::to_string(param);
+    }
+    return expr + ")";
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    GetState().Update(input, output.GetTensor());
+  }
+
+  size_t GetWindow() const { return Window(params_); }
+
+  static void CheckParams(size_t, const std::vector<int> &) {}
+
+private:
+  static size_t Window(const std::vector<int> &params) {
+    return static_cast<size_t>(params.back());
+  }
+
+  std::vector<int> params_;
+};
+
+// ts_ols_res_k(y, x1, ..., xk, window): 当前时刻的残差e
+class TsOLSResK : public TsOlsKOp<TsOLSResK> {
+public:
+  static constexpr const char *kName = "ts_ols_res_k";
+  static constexpr size_t kNumParams = 1;
+  using TsOlsKOp::TsOlsKOp;
+  OperatorType GetType() const override { return OperatorType::TsOLSResK; }
+  static int Coef(const std::vector<int> &) { return TsOlsKState::kResidual; }
+};
+
+// ts_ols_alpha_k(y, x1, ..., xk, window): 截距a
+class TsOLSAlphaK : public TsOlsKOp<TsOLSAlphaK> {
+public:
+  static constexpr const char *kName = "ts_ols_alpha_k";
+  static constexpr size_t kNumParams = 1;
+  using TsOlsKOp::TsOlsKOp;
+  OperatorType GetType() const override { return OperatorType::TsOLSAlphaK; }
+  static int Coef(const std::vector<int> &) { return 0; }
+};
+
+// ts_ols_beta_k(y, x1, ..., xk, j, window): xj的系数bj, j从1开始
+class TsOLSBetaK : public TsOlsKOp<TsOLSBetaK> {
+public:
+  static constexpr const char *kName = "ts_ols_beta_k";
+  static constexpr size_t kNumParams = 2;
+  using TsOlsKOp::TsOlsKOp;
+  OperatorType GetType() const override { return OperatorType::TsOLSBetaK; }
+  static int Coef(const std::vector<int> &params) { return params[0]; }
+
+  static void CheckParams(size_t k, const std::vector<int> &params) {
+    if (params[0] < 1 || static_cast<size_t>(params[0]) > k) {
+      throw std::invalid_argument("ts_ols_beta_k j should be in [1, k]");
+    }
+  }
+};
+
+} // namespace factor_tree
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "baseoperator.h"
+
+#include <cereal/types/vector.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+
+// 分母绝对值小于epsilon时返回nan, 见operators.md
+constexpr double kEpsilon = 1e-9;
+constexpr double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+// 浮点参数转为表达式中的写法, 保证ToString的结果可以重新解析为相同的值
+inline std::string FormatDouble(double value) {
+  std::ostringstream os;
+  os.precision(15);
+  os << value;
+  if (std::stod(os.str()) != value) {
+    os.str("");
+    os.precision(17);
+    os << value;
+  }
+  return os.str();
+}
+
+// 滑动窗口环形缓冲区, 按 window x nstock 存储
+// 同一时间步的所有标的连续存放, 每次Update只写一行
+struct RingBuffer {
+  size_t window = 0;
+  size_t nstock = 0;
+  //   下一个写入位置, 窗口写满后即最旧的时间步
+  size_t pos = 0;
+  //   已有观测数, nan也算观测, 最多为window
+  size_t count = 0;
+  std::vector<double> data;
+
+  RingBuffer() = default;
+  RingBuffer(size_t window, size_t nstock)
+      : window(window), nstock(nstock), data(window * nstock, kNaN) {}
+
+  inline bool Full() const { return count == window; }
+
+  //   将要被覆盖的时间步, 只有Full()时才有意义
+  inline const double *Oldest() const { return data.data() + pos * nstock; }
+
+  //   从旧到新第k个时间步
+  inline const double *At(size_t k) const {
+    size_t start = Full() ? pos : 0;
+    return data.data() + (start + k) % window * nstock;
+  }
+
+  inline void Push(const Tensor &x) {
+    std::copy(x.begin(), x.end(), data.begin() + pos * nstock);
+    pos = (pos + 1) % window;
+    if (count < window) {
+      ++count;
+    }
+  }
+
+  template <class Archive> void serialize(Archive &ar) {
+    ar(window, nstock, pos, count, data);
+  }
+};
+
+// 增量算子的滚动和会有浮点误差累积, 每隔window步从环形缓冲区重算一次,
+// 均摊下来仍是O(1)
+struct RollingSumState : public BaseState {
+  static constexpr bool kDayAware = false;
+
+  RingBuffer ring;
+  size_t steps_since_refresh = 0;
+
+  RollingSumState() = default;
+  RollingSumState(size_t window, size_t nstock) : ring(window, nstock) {}
+
+  inline bool NeedRefresh() {
+    if (++steps_since_refresh < ring.window) {
+      return false;
+    }
+    steps_since_refresh = 0;
+    return true;
+  }
+
+  template <class Archive> void serialize(Archive &ar) {
+    ar(ring, steps_since_refresh);
+  }
+};
+
+// 带window参数的有状态一元时序算子公共部分
+// State需要提供 State(size_t window, const InitArgsPtr &config)
+template <typename RealOp, typename State>
+class TsWindowUnaryOp : public StatefulUnaryOp<RealOp, State> {
+public:
+  using StatefulUnaryOp<RealOp, State>::GetChild;
+  using StatefulUnaryOp<RealOp, State>::GetState;
+
+  TsWindowUnaryOp(OperatorPtr &child, int window, const OpInitArgs &init_args)
+      : StatefulUnaryOp<RealOp, State>(
+            child, State(CheckWindow(window), init_args.config),
+            init_args),
+        window_(window) {}
+
+  static OperatorPtr Create(const std::vector<Arg> &args,
+                            const OpInitArgs &init_args) {
+    if (args.size() != 2 || args[0].GetType() != ArgType::Operator ||
+        args[1].GetType() != ArgType::Integer) {
+      throw std::invalid_argument(std::string(RealOp::kName) +
+                                  " operator should have 2 arguments");
+    }
+    auto child = args[0].GetOperator();
+    return OperatorPtr(new RealOp(child, args[1].GetInteger(), init_args));
+  }
+
+  static std::vector<ArgType> ArgTypes() {
+    return {ArgType::Operator, ArgType::Integer};
+  }
+
+  std::string ToString() const override {
+    return std::string(RealOp::kName) + "(" + GetChild()->ToString() + "," +
+           std::to_string(window_) + ")";
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    GetState().Update(*input.GetColumeData(), output.GetTensor());
+  }
+
+  int GetWindow() const { return window_; }
+
+private:
+  static size_t CheckWindow(int window) {
+    if (window < 1) {
+      throw std::invalid_argument(std::string(RealOp::kName) +
+                                  " window should be positive");
+    }
+    return static_cast<size_t>(window);
+  }
+
+  int window_;
+};
+
+namespace header_ops {
+
+// ts_tcorr(x, window): corr(x, range(window)), min_count=window
+// 维护 Σx, Σx², Σ(i·x), 窗口滑动时下标整体减一:
+//   Σ(i·x)' = Σ(i·x) - (Σx - x_old) + (window - 1) * x_new
+struct TsTcorrState : public RollingSumState {
+  std::vector<double> sum_x;
+  std::vector<double> sum_xx;
+  std::vector<double> sum_ix;
+  std::vector<int32_t> nan_count;
+
+  TsTcorrState() = default;
+  TsTcorrState(size_t window, const InitArgsPtr &config)
+      : RollingSumState(window, config->nstock), sum_x(config->nstock, 0.0),
+        sum_xx(config->nstock, 0.0), sum_ix(config->nstock, 0.0),
+        nan_count(config->nstock, 0) {}
+
+  void Update(const Tensor &x, Tensor &out) {
+    const size_t window = ring.window;
+    const bool full = ring.Full();
+    const double *old = ring.Oldest();
+    const double w_new = static_cast<double>(full ? window - 1 : ring.count);
+    for (size_t i = 0; i < ring.nstock; ++i) {
+      if (full) {
+        double xo = old[i];
+        if (std::isnan(xo)) {
+          --nan_count[i];
+          sum_ix[i] -= sum_x[i];
+        } else {
+          sum_ix[i] -= sum_x[i] - xo;
+          sum_x[i] -= xo;
+          sum_xx[i] -= xo * xo;
+        }
+      }
+      double xn = x(i);
+      if (std::isnan(xn)) {
+        ++nan_count[i];
+      } else {
+        sum_x[i] += xn;
+        sum_xx[i] += xn * xn;
+        sum_ix[i] += w_new * xn;
+      }
+    }
+    ring.Push(x);
+    if (NeedRefresh()) {
+      Refresh();
+    }
+
+    if (!ring.Full()) {
+      std::fill(out.begin(), out.end(), kNaN);
+      return;
+    }
+    const double n = static_cast<double>(window);
+    const double sum_t = n * (n - 1) / 2;
+    const double var_t = n * ((n - 1) * n * (2 * n - 1) / 6) - sum_t * sum_t;
+    for (size_t i = 0; i < ring.nstock; ++i) {
+      if (nan_count[i] > 0) {
+        out(i) = kNaN;
+        continue;
+      }
+      double cov = n * sum_ix[i] - sum_t * sum_x[i];
+      double var_x = n * sum_xx[i] - sum_x[i] * sum_x[i];
+      double denom = std::sqrt(std::max(var_t * var_x, 0.0));
+      out(i) = denom < kEpsilon ? kNaN : cov / denom;
+    }
+  }
+
+  void Refresh() {
+    std::fill(sum_x.begin(), sum_x.end(), 0.0);
+    std::fill(sum_xx.begin(), sum_xx.end(), 0.0);
+    std::fill(sum_ix.begin(), sum_ix.end(), 0.0);
+    std::fill(nan_count.begin(), nan_count.end(), 0);
+    for (size_t k = 0; k < ring.count; ++k) {
+      const double *row = ring.At(k);
+      for (size_t i = 0; i < ring.nstock; ++i) {
+        if (std::isnan(row[i])) {
+          ++nan_count[i];
+          continue;
+        }
+        sum_x[i] += row[i];
+        sum_xx[i] += row[i] * row[i];
+        sum_ix[i] += static_cast<double>(k) * row[i];
+      }
+    }
+  }
+
+  template <class Archive> void serialize(Archive &ar) {
+    RollingSumState::serialize(ar);
+    ar(sum_x, sum_xx, sum_ix, nan_count);
+  }
+};
+
+// ts_concent(x, window): Σ(|x| / Σ|x|)² = Σx² / (Σ|x|)², nan不参与计算
+struct TsConcentState : public RollingSumState {
+  std::vector<double> sum_abs;
+  std::vector<double> sum_xx;
+  std::vector<int32_t> valid_count;
+
+  TsConcentState() = default;
+  TsConcentState(size_t window, const InitArgsPtr &config)
+      : RollingSumState(window, config->nstock), sum_abs(config->nstock, 0.0),
+        sum_xx(config->nstock, 0.0), valid_count(config->nstock, 0) {}
+
+  void Update(const Tensor &x, Tensor &out) {
+    const bool full = ring.Full();
+    const double *old = ring.Oldest();
+    for (size_t i = 0; i < ring.nstock; ++i) {
+      if (full && !std::isnan(old[i])) {
+        sum_abs[i] -= std::abs(old[i]);
+        sum_xx[i] -= old[i] * old[i];
+        --valid_count[i];
+      }
+      double xn = x(i);
+      if (!std::isnan(xn)) {
+        sum_abs[i] += std::abs(xn);
+        sum_xx[i] += xn * xn;
+        ++valid_count[i];
+      }
+    }
+    ring.Push(x);
+    if (NeedRefresh()) {
+      Refresh();
+    }
+
+    for (size_t i = 0; i < ring.nstock; ++i) {
+      if (valid_count[i] == 0 || sum_abs[i] < kEpsilon) {
+        out(i) = kNaN;
+        continue;
+      }
+      out(i) = sum_xx[i] / (sum_abs[i] * sum_abs[i]);
+    }
+  }
+
+  void Refresh() {
+    std::fill(sum_abs.begin(), sum_abs.end(), 0.0);
+    std::fill(sum_xx.begin(), sum_xx.end(), 0.0);
+    std::fill(valid_count.begin(), valid_count.end(), 0);
+    for (size_t k = 0; k < ring.count; ++k) {
+      const double *row = ring.At(k);
+      for (size_t i = 0; i < ring.nstock; ++i) {
+        if (std::isnan(row[i])) {
+          continue;
+        }
+        sum_abs[i] += std::abs(row[i]);
+        sum_xx[i] += row[i] * row[i];
+        ++valid_count[i];
+      }
+    }
+  }
+
+  template <class Archive> void serialize(Archive &ar) {
+    RollingSumState::serialize(ar);
+    ar(sum_abs, sum_xx, valid_count);
+  }
+};
+
+// 不替换库中的ts_tcorr/ts_concent, 见baseoperator.h中header_ops的说明
+class TsTcorr : public TsWindowUnaryOp<TsTcorr, TsTcorrState> {
+public:
+  static constexpr const char *kName = "ts_tcorr";
+  using TsWindowUnaryOp::TsWindowUnaryOp;
+  OperatorType GetType() const override { return OperatorType::TsTcorr; }
+};
+
+class TsConcent : public TsWindowUnaryOp<TsConcent, TsConcentState> {
+public:
+  static constexpr const char *kName = "ts_concent";
+  using TsWindowUnaryOp::TsWindowUnaryOp;
+  OperatorType GetType() const override { return OperatorType::TsConcent; }
+};
+
+} // namespace header_ops
+} // namespace factor_tree
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace factor_tree {
+
+// npy v1.0文件头, 长度固定为kNpyHeaderSize, 改写shape时数据偏移不变
+constexpr size_t kNpyHeaderSize = 128;
+
+inline std::string NpyHeader(size_t rows, size_t cols) {
+  std::string header("\x93NUMPY\x01\x00", 8);
+  const size_t length = kNpyHeaderSize - 10;
+  header.push_back(static_cast<char>(length & 0xff));
+  header.push_back(static_cast<char>(length >> 8));
+  header += "{'descr': '<f8', 'fortran_order': False, 'shape': (" +
+            std::to_string(rows) + ", " + std::to_string(cols) + "), }";
+  header.append(kNpyHeaderSize - 1 - header.size(), ' ');
+  header.push_back('\n');
+  return header;
+}
+
+// 预分配并映射的 rows x nstock 的.npy文件, 逐行写入
+class NpyChunk {
+public:
+  NpyChunk(const std::string &filename, size_t rows, size_t nstock)
+      : filename_(filename), capacity_(rows), nstock_(nstock),
+        size_(kNpyHeaderSize + rows * nstock * sizeof(double)) {
+    fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("cannot create " + filename);
+    }
+    if (::ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+      ::close(fd_);
+      throw std::runtime_error("cannot allocate " + filename);
+    }
+    void *data =
+        ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd_);
+      throw std::runtime_error("cannot mmap " + filename);
+    }
+    data_ = static_cast<char *>(data);
+    std::string header = NpyHeader(rows, nstock);
+    std::memcpy(data_, header.data(), header.size());
+  }
+
+  NpyChunk(const NpyChunk &) = delete;
+  NpyChunk &operator=(const NpyChunk &) = delete;
+
+  virtual ~NpyChunk() {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+      ::close(fd_);
+    }
+  }
+
+  size_t Capacity() const { return capacity_; }
+
+  double *Row(size_t r) {
+    return reinterpret_cast<double *>(data_ + kNpyHeaderSize) + r * nstock_;
+  }
+
+  //   只写了rows行时改写文件头并截断文件; msync会阻塞, 由后台线程调用
+  virtual void Finish(size_t rows) {
+    if (rows < capacity_) {
+      std::string header = NpyHeader(rows, nstock_);
+      std::memcpy(data_, header.data(), header.size());
+    }
+    bool ok = ::msync(data_, size_, MS_SYNC) == 0;
+    ::munmap(data_, size_);
+    data_ = nullptr;
+    if (rows < capacity_) {
+      off_t size = kNpyHeaderSize + rows * nstock_ * sizeof(double);
+      ok = ::ftruncate(fd_, size) == 0 && ok;
+    }
+    ok = ::close(fd_) == 0 && ok;
+    if (!ok) {
+      throw std::runtime_error("failed to write " + filename_);
+    }
+  }
+
+private:
+  std::string filename_;
+  size_t capacity_;
+  size_t nstock_;
+  size_t size_;
+  int fd_ = -1;
+  char *data_ = nullptr;
+};
+
+// 把结果逐批写入分块的.npy文件: <dir>/<factor>/<chunk>.npy, 每块
+// rows_per_chunk x nstock, 与NpyHistory读取的布局一致
+// 写入只是拷贝到映射的内存, 写满的分块交给后台线程落盘
+// 不同因子可以在不同线程中写入, 同一个因子只能在一个线程中写入
+class OutputSink {
+public:
+  OutputSink(const std::string &dir, size_t nstock, size_t rows_per_chunk)
+      : dir_(dir), nstock_(nstock), rows_per_chunk_(rows_per_chunk) {
+    if (nstock == 0 || rows_per_chunk == 0) {
+      throw std::invalid_argument("nstock and rows_per_chunk should be > 0");
+    }
+    std::filesystem::create_directories(dir);
+    flusher_ = std::thread([this] { FlushLoop(); });
+  }
+
+  OutputSink(const OutputSink &) = delete;
+  OutputSink &operator=(const OutputSink &) = delete;
+
+  virtual ~OutputSink() {
+    try {
+      Close();
+    } catch (const std::exception &) {
+    }
+  }
+
+  //   factor作为目录名, 不能包含'/'
+  void Append(const std::string &factor, const double *values, size_t size) {
+    if (size != nstock_) {
+      throw std::invalid_argument("output of " + factor + " has " +
+                                  std::to_string(size) + " values, expect " +
+                                  std::to_string(nstock_));
+    }
+    RethrowFlushError();
+    Factor &state = GetFactor(factor);
+    if (!state.chunk) {
+      char name[32];
+      std::snprintf(name, sizeof(name), "%06zu.npy", state.next_chunk++);
+      state.chunk = NewChunk(state.dir + "/" + name);
+      state.rows = 0;
+    }
+    std::memcpy(state.chunk->Row(state.rows), values, size * sizeof(double));
+    if (++state.rows == state.chunk->Capacity()) {
+      Submit(std::move(state.chunk), state.rows);
+    }
+  }
+
+  template <typename Tensor>
+  void Append(const std::string &factor, const Tensor &values) {
+    Append(factor, values.data(), values.size());
+  }
+
+  //   写入未满的分块并等待全部落盘, 落盘失败时抛出异常
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(factors_mutex_);
+      closed_ = true;
+      for (auto &[name, state] : factors_) {
+        if (state.chunk) {
+          Submit(std::move(state.chunk), state.rows);
+        }
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if (flusher_.joinable()) {
+      flusher_.join();
+    }
+    RethrowFlushError();
+  }
+
+protected:
+  //   新建一个分块文件, 测试中替换为落盘失败的分块
+  virtual std::unique_ptr<NpyChunk> NewChunk(const std::string &filename) {
+    return std::make_unique<NpyChunk>(filename, rows_per_chunk_, nstock_);
+  }
+
+private:
+  struct Factor {
+    std::string dir;
+    std::unique_ptr<NpyChunk> chunk;
+    size_t rows = 0;
+    size_t next_chunk = 0;
+  };
+
+  Factor &GetFactor(const std::string &factor) {
+    std::lock_guard<std::mutex> lock(factors_mutex_);
+    if (closed_) {
+      throw std::runtime_error("output sink is closed");
+    }
+    auto it = factors_.find(factor);
+    if (it == factors_.end()) {
+      Factor state;
+      state.dir = dir_ + "/" + factor;
+      std::filesystem::create_directories(state.dir);
+      it = factors_.emplace(factor, std::move(state)).first;
+    }
+    return it->second;
+  }
+
+  void Submit(std::unique_ptr<NpyChunk> chunk, size_t rows) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.emplace_back(std::move(chunk), rows);
+    }
+    cv_.notify_one();
+  }
+
+  void FlushLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      auto [chunk, rows] = std::move(pending_.front());
+      pending_.pop_front();
+      lock.unlock();
+      try {
+        chunk->Finish(rows);
+      } catch (...) {
+        std::lock_guard<std::mutex> error_lock(error_mutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+      }
+      chunk.reset();
+      lock.lock();
+    }
+  }
+
+  void RethrowFlushError() {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+  std::string dir_;
+  size_t nstock_;
+  size_t rows_per_chunk_;
+
+  std::mutex factors_mutex_;
+  std::unordered_map<std::string, Factor> factors_;
+  bool closed_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::pair<std::unique_ptr<NpyChunk>, size_t>> pending_;
+  bool stop_ = false;
+  std::thread flusher_;
+
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+};
+
+} // namespace factor_tree
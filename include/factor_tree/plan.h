@@ -0,0 +1,270 @@
+#pragma once
+
+#include "expression.h"
+#include "mappedfile.h"
+#include "operators/baseoperator.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace factor_tree {
+
+// 计算计划的检查转储: 解析、展开、规范化、去重之后的DAG
+// 用于离线检查和分发因子集合: 节点数、共享关系和参数都可以直接从文件读出,
+// 不用再解析表达式。计划只记录算子名和参数, 不含缓冲区和状态布局,
+// 算子注册表也只在库中, 因此不提供按计划实例化算子的接口, 建树仍走CreateTree,
+// 启动时间与不用计划时相同
+//
+// 文件布局(小端, 全部定长记录, 可以直接mmap使用):
+//   PlanHeader
+//   PlanNode[node_count]   子节点先于父节点, 下标即OperatorId
+//   PlanArg[arg_count]     每个节点的参数连续存放
+//   uint32_t[root_count]   根节点下标
+//   char[string_size]      字符串表
+constexpr char kPlanMagic[8] = {'F', 'T', 'P', 'L', 'A', 'N', '\0', '\0'};
+// 文件格式变化时递增, 版本不一致的计划拒绝加载
+constexpr uint32_t kPlanVersion = 1;
+
+struct PlanHeader {
+  char magic[8];
+  uint32_t version;
+  //   生成计划时的库标识, 加载时必须与调用方给出的一致
+  uint32_t tag_size;
+  uint64_t tag_offset;
+  uint64_t node_count;
+  uint64_t arg_count;
+  uint64_t root_count;
+  uint64_t string_size;
+};
+
+struct PlanNode {
+  //   ExprNode::Kind, 只会是Call/Field/Constant
+  uint32_t kind;
+  uint32_t name_size;
+  uint64_t name_offset;
+  uint32_t first_arg;
+  uint32_t arg_count;
+};
+
+struct PlanArg {
+  //   ArgType
+  uint32_t type;
+  uint32_t size;
+  //   Operator: 子节点下标, Integer/Double: 数值, String: 字符串表偏移
+  union {
+    uint64_t node;
+    int64_t integer;
+    double real;
+    uint64_t offset;
+  };
+};
+
+// 把一组表达式编译为计划, 相同的子表达式只保留一个节点
+// options.inline_combined_ops时需要给出expander, 见PrepareExpression
+class PlanCompiler {
+public:
+  explicit PlanCompiler(std::string tag, BuildOptions options = {},
+                        const CombExpander *expander = nullptr)
+      : tag_(std::move(tag)), options_(options), expander_(expander) {}
+
+  //   返回根节点下标
+  uint32_t AddExpression(const std::string &expression) {
+    ExprNode node =
+        ParseExprTree(PrepareExpression(expression, options_, expander_));
+    uint32_t root = AddNode(node);
+    roots_.push_back(root);
+    return root;
+  }
+
+  void Save(const std::string &filename) const {
+    std::string strings = tag_;
+    PlanHeader header{};
+    std::memcpy(header.magic, kPlanMagic, sizeof(kPlanMagic));
+    header.version = kPlanVersion;
+    header.tag_size = static_cast<uint32_t>(tag_.size());
+    header.tag_offset = 0;
+    header.node_count = nodes_.size();
+    header.arg_count = args_.size();
+    header.root_count = roots_.size();
+    std::vector<PlanNode> nodes = nodes_;
+    std::vector<PlanArg> args = args_;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      nodes[i].name_offset = strings.size();
+      strings += names_[i];
+    }
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (args[i].type == static_cast<uint32_t>(ArgType::String)) {
+        args[i].offset = strings.size();
+        strings += arg_strings_.at(i);
+      }
+    }
+    header.string_size = strings.size();
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("cannot open plan file " + filename);
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(nodes.data()),
+              nodes.size() * sizeof(PlanNode));
+    out.write(reinterpret_cast<const char *>(args.data()),
+              args.size() * sizeof(PlanArg));
+    out.write(reinterpret_cast<const char *>(roots_.data()),
+              roots_.size() * sizeof(uint32_t));
+    out.write(strings.data(), strings.size());
+    if (!out) {
+      throw std::runtime_error("failed to write plan file " + filename);
+    }
+  }
+
+  size_t NodeCount() const { return nodes_.size(); }
+
+private:
+  uint32_t AddNode(const ExprNode &node) {
+    std::string key = node.ToString();
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      return it->second;
+    }
+    std::vector<PlanArg> args;
+    std::vector<std::string> strings;
+    for (const auto &arg : node.args) {
+      PlanArg plan_arg{};
+      switch (arg.kind) {
+      case ExprNode::Kind::Integer:
+        plan_arg.type = static_cast<uint32_t>(ArgType::Integer);
+        plan_arg.integer = std::stoll(arg.text);
+        break;
+      case ExprNode::Kind::Double:
+        plan_arg.type = static_cast<uint32_t>(ArgType::Double);
+        plan_arg.real = std::stod(arg.text);
+        break;
+      case ExprNode::Kind::String:
+        plan_arg.type = static_cast<uint32_t>(ArgType::String);
+        plan_arg.size = static_cast<uint32_t>(arg.text.size());
+        break;
+      default:
+        plan_arg.type = static_cast<uint32_t>(ArgType::Operator);
+        plan_arg.node = AddNode(arg);
+      }
+      args.push_back(plan_arg);
+      strings.push_back(arg.kind == ExprNode::Kind::String ? arg.text : "");
+    }
+    //   空字符串参数也要记录, Save按参数类型取字符串
+    PlanNode plan_node{};
+    plan_node.kind = static_cast<uint32_t>(node.kind);
+    plan_node.name_size = static_cast<uint32_t>(node.text.size());
+    plan_node.first_arg = static_cast<uint32_t>(args_.size());
+    plan_node.arg_count = static_cast<uint32_t>(args.size());
+    for (size_t k = 0; k < args.size(); ++k) {
+      if (args[k].type == static_cast<uint32_t>(ArgType::String)) {
+        arg_strings_[args_.size()] = strings[k];
+      }
+      args_.push_back(args[k]);
+    }
+    uint32_t id = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back(plan_node);
+    names_.push_back(node.text);
+    index_.emplace(std::move(key), id);
+    return id;
+  }
+
+  std::string tag_;
+  BuildOptions options_;
+  const CombExpander *expander_;
+  std::vector<PlanNode> nodes_;
+  std::vector<std::string> names_;
+  std::vector<PlanArg> args_;
+  std::unordered_map<size_t, std::string> arg_strings_;
+  std::vector<uint32_t> roots_;
+  std::unordered_map<std::string, uint32_t> index_;
+};
+
+// 只读映射计划文件, 打开时校验格式版本、库标识和各段长度
+class PlanFile {
+public:
+  PlanFile(const std::string &filename, const std::string &tag)
+      : file_(filename) {
+    if (file_.Size() < sizeof(PlanHeader)) {
+      throw std::runtime_error("invalid plan file " + filename);
+    }
+    data_ = file_.Data();
+    Validate(filename, tag);
+  }
+
+  const PlanHeader &Header() const {
+    return *reinterpret_cast<const PlanHeader *>(data_);
+  }
+  const PlanNode *Nodes() const {
+    return reinterpret_cast<const PlanNode *>(data_ + sizeof(PlanHeader));
+  }
+  const PlanArg *Args() const {
+    return reinterpret_cast<const PlanArg *>(Nodes() + Header().node_count);
+  }
+  const uint32_t *Roots() const {
+    return reinterpret_cast<const uint32_t *>(Args() + Header().arg_count);
+  }
+  const char *Strings() const {
+    return reinterpret_cast<const char *>(Roots() + Header().root_count);
+  }
+
+private:
+  void Validate(const std::string &filename, const std::string &tag) const {
+    const PlanHeader &header = Header();
+    if (std::memcmp(header.magic, kPlanMagic, sizeof(kPlanMagic)) != 0) {
+      throw std::runtime_error(filename + " is not a plan file");
+    }
+    if (header.version != kPlanVersion) {
+      throw std::runtime_error("plan file " + filename + " version " +
+                               std::to_string(header.version) +
+                               " does not match " +
+                               std::to_string(kPlanVersion));
+    }
+    size_t expected = sizeof(PlanHeader) +
+                      header.node_count * sizeof(PlanNode) +
+                      header.arg_count * sizeof(PlanArg) +
+                      header.root_count * sizeof(uint32_t) + header.string_size;
+    if (expected != file_.Size()) {
+      throw std::runtime_error("plan file " + filename + " is truncated");
+    }
+    if (header.tag_offset + header.tag_size > header.string_size ||
+        std::string(Strings() + header.tag_offset, header.tag_size) != tag) {
+      throw std::runtime_error("plan file " + filename +
+                               " was built for a different library");
+    }
+    const PlanNode *nodes = Nodes();
+    const PlanArg *args = Args();
+    for (size_t i = 0; i < header.node_count; ++i) {
+      if (nodes[i].name_offset + nodes[i].name_size > header.string_size ||
+          static_cast<uint64_t>(nodes[i].first_arg) + nodes[i].arg_count >
+              header.arg_count) {
+        throw std::runtime_error("plan file " + filename + " is corrupted");
+      }
+      for (uint32_t k = 0; k < nodes[i].arg_count; ++k) {
+        const PlanArg &arg = args[nodes[i].first_arg + k];
+        bool ok = arg.type != static_cast<uint32_t>(ArgType::Operator) ||
+                  arg.node < i;
+        ok = ok && (arg.type != static_cast<uint32_t>(ArgType::String) ||
+                    arg.offset + arg.size <= header.string_size);
+        if (!ok || arg.type > static_cast<uint32_t>(ArgType::String)) {
+          throw std::runtime_error("plan file " + filename + " is corrupted");
+        }
+      }
+    }
+    for (size_t r = 0; r < header.root_count; ++r) {
+      if (Roots()[r] >= header.node_count) {
+        throw std::runtime_error("plan file " + filename + " is corrupted");
+      }
+    }
+  }
+
+  MappedFile file_;
+  const char *data_ = nullptr;
+};
+
+} // namespace factor_tree
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// 按算子统计耗时, 默认关闭, 用OpProfiler::Instance().SetEnabled(true)开启.
+// UnaryOp/BinaryOp/NaryOp的每次实际计算(不含子节点)和组合算子的整个子树
+// 各记一次. 开关在运行期检查, 内联函数体与编译选项无关, 库和调用方的
+// 翻译单元可以混用; 关闭时每次计算只多一次原子读
+// 只有用这些头文件编译的算子会计数: 库中编译的算子要库本身也用这些头文件
+// 重新编译, 否则CreateTree建出的树没有数据
+#define FACTOR_TREE_PROFILE_OP(op, bytes)                                      \
+  ::factor_tree::ProfileScope factor_tree_profile_scope(op, bytes, false)
+#define FACTOR_TREE_PROFILE_SUBTREE(op)                                        \
+  ::factor_tree::ProfileScope factor_tree_profile_scope(op, 0, true)
+
+namespace factor_tree {
+
+// 耗时直方图, 按2的幂分档, 每档再等分4份, 分位数的相对误差不超过25%
+class LatencyHistogram {
+public:
+  static constexpr size_t kSubBuckets = 4;
+  static constexpr size_t kBuckets = 64 * kSubBuckets;
+  using Counts = std::array<uint64_t, kBuckets>;
+
+  void Add(uint64_t ns) {
+    buckets_[Index(ns)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void MergeInto(Counts &counts) const {
+    for (size_t i = 0; i < kBuckets; ++i) {
+      counts[i] += buckets_[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  //   [0, 8)每个值一档, 之后每个2的幂区间分4档
+  static size_t Index(uint64_t ns) {
+    if (ns < 2 * kSubBuckets) {
+      return static_cast<size_t>(ns);
+    }
+    const size_t octave = 63 - static_cast<size_t>(__builtin_clzll(ns));
+    const size_t sub = static_cast<size_t>(ns >> (octave - 2)) & 3;
+    return (octave - 1) * kSubBuckets + sub;
+  }
+
+  //   第i档的上界, 报告分位数时取上界
+  static uint64_t UpperBound(size_t i) {
+    if (i < 2 * kSubBuckets) {
+      return i;
+    }
+    const size_t octave = i / kSubBuckets + 1;
+    const uint64_t width = uint64_t(1) << (octave - 2);
+    return (kSubBuckets + i % kSubBuckets) * width + width - 1;
+  }
+
+  static uint64_t Quantile(const Counts &counts, double q) {
+    uint64_t total = 0;
+    for (auto count : counts) {
+      total += count;
+    }
+    if (total == 0) {
+      return 0;
+    }
+    //   第rank个样本(从1开始)所在的档
+    const auto rank = std::max<uint64_t>(
+        1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(total))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return UpperBound(i);
+      }
+    }
+    return UpperBound(kBuckets - 1);
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+};
+
+// 一个线程中一个节点的计数, 只由该线程写入, 报告时可以并发读取
+struct OpProfileCounters {
+  const void *node = nullptr;
+  //   节点所属的树, 即它的InitArgs
+  const void *tree = nullptr;
+  size_t op_id = 0;
+  std::string expression;
+  bool inclusive = false;
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> bytes{0};
+  LatencyHistogram latency;
+
+  void Record(uint64_t ns, uint64_t touched) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    bytes.fetch_add(touched, std::memory_order_relaxed);
+    latency.Add(ns);
+  }
+};
+
+// 合并各线程后一个节点的统计
+struct OpProfile {
+  size_t op_id = 0;
+  std::string expression;
+  //   true: 组合算子, 耗时包含展开后的整个子树, 不计字节数
+  bool inclusive = false;
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t p99_ns = 0;
+  //   读写输入输出缓冲区的字节数, 不含算子内部状态
+  uint64_t bytes = 0;
+
+  double MeanNs() const {
+    return count > 0 ? static_cast<double>(total_ns) / count : 0.0;
+  }
+};
+
+// 进程内的统计表. 节点按地址区分, 各线程有自己的计数, 热路径不加锁
+// 重建计算树后旧节点的地址可能被复用, 需要先Reset
+class OpProfiler {
+public:
+  static OpProfiler &Instance() {
+    static OpProfiler profiler;
+    return profiler;
+  }
+
+  static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  void SetEnabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  //   op可以是任意一层基类指针, 按完整对象的地址区分节点
+  template <typename Op>
+  OpProfileCounters &Counters(const Op *op, bool inclusive) {
+    const void *node = dynamic_cast<const void *>(op);
+    LocalCache &cache = Local();
+    const uint64_t generation = generation_.load(std::memory_order_acquire);
+    if (cache.generation != generation) {
+      cache.counters.clear();
+      cache.generation = generation;
+    }
+    auto it = cache.counters.find(node);
+    if (it != cache.counters.end()) {
+      return *it->second;
+    }
+    auto counters = std::make_shared<OpProfileCounters>();
+    counters->node = node;
+    counters->tree = op->GetInitArgs().get();
+    counters->op_id = op->GetOperatorId();
+    counters->expression = op->ToString();
+    counters->inclusive = inclusive;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      counters_.push_back(counters);
+    }
+    return *cache.counters.emplace(node, std::move(counters)).first->second;
+  }
+
+  //   按累计耗时降序, top_n为0时返回全部; tree不为空时只统计InitArgs为
+  //   tree的节点, 即同一棵树的节点, 包括不登记子节点的库中算子
+  std::vector<OpProfile> Report(size_t top_n = 0,
+                                const void *tree = nullptr) const {
+    std::vector<std::shared_ptr<OpProfileCounters>> counters;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      counters = counters_;
+    }
+    std::map<std::pair<const void *, std::string>,
+             std::pair<OpProfile, LatencyHistogram::Counts>>
+        merged;
+    for (const auto &c : counters) {
+      if (tree != nullptr && c->tree != tree) {
+        continue;
+      }
+      auto &[profile, latency] = merged[{c->node, c->expression}];
+      profile.op_id = c->op_id;
+      profile.expression = c->expression;
+      profile.inclusive = c->inclusive;
+      profile.count += c->count.load(std::memory_order_relaxed);
+      profile.total_ns += c->total_ns.load(std::memory_order_relaxed);
+      profile.bytes += c->bytes.load(std::memory_order_relaxed);
+      c->latency.MergeInto(latency);
+    }
+    std::vector<OpProfile> report;
+    report.reserve(merged.size());
+    for (auto &[key, value] : merged) {
+      value.first.p99_ns = LatencyHistogram::Quantile(value.second, 0.99);
+      report.push_back(std::move(value.first));
+    }
+    std::sort(report.begin(), report.end(),
+              [](const OpProfile &a, const OpProfile &b) {
+                return a.total_ns > b.total_ns;
+              });
+    if (top_n > 0 && report.size() > top_n) {
+      report.resize(top_n);
+    }
+    return report;
+  }
+
+  //   清空统计, 各线程下次计数时丢弃自己缓存的旧计数
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    counters_.clear();
+    generation_.fetch_add(1, std::memory_order_release);
+  }
+
+private:
+  struct LocalCache {
+    uint64_t generation = 0;
+    std::unordered_map<const void *, std::shared_ptr<OpProfileCounters>>
+        counters;
+  };
+
+  static LocalCache &Local() {
+    thread_local LocalCache cache;
+    return cache;
+  }
+
+  static inline std::atomic<bool> enabled_{false};
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<OpProfileCounters>> counters_;
+  std::atomic<uint64_t> generation_{0};
+};
+
+// 开启统计时构造时开始计时, 析构时记入op的计数; 关闭时不计时
+class ProfileScope {
+public:
+  template <typename Op>
+  ProfileScope(const Op *op, size_t bytes, bool inclusive)
+      : counters_(OpProfiler::Enabled()
+                      ? &OpProfiler::Instance().Counters(op, inclusive)
+                      : nullptr),
+        bytes_(bytes) {
+    if (counters_ != nullptr) {
+      begin_ = Clock::now();
+    }
+  }
+
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+
+  ~ProfileScope() {
+    if (counters_ == nullptr) {
+      return;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  Clock::now() - begin_)
+                  .count();
+    counters_->Record(static_cast<uint64_t>(ns), bytes_);
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+  OpProfileCounters *counters_;
+  uint64_t bytes_;
+  Clock::time_point begin_;
+};
+
+inline std::string FormatProfile(const std::vector<OpProfile> &report) {
+  std::ostringstream os;
+  os << std::setw(8) << "op_id" << std::setw(12) << "count" << std::setw(14)
+     << "total_us" << std::setw(12) << "mean_ns" << std::setw(12) << "p99_ns"
+     << std::setw(14) << "MB" << "  expression\n";
+  for (const auto &p : report) {
+    os << std::setw(8) << p.op_id << std::setw(12) << p.count << std::setw(14)
+       << p.total_ns / 1000 << std::setw(12)
+       << static_cast<uint64_t>(p.MeanNs()) << std::setw(12) << p.p99_ns
+       << std::setw(14) << std::fixed << std::setprecision(1)
+       << static_cast<double>(p.bytes) / (1 << 20) << "  "
+       << (p.inclusive ? "[subtree] " : "") << p.expression << "\n";
+  }
+  return os.str();
+}
+
+} // namespace factor_tree
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace factor_tree {
+
+// 固定线程数的线程池, 只提供阻塞式的ParallelFor
+// [0, n)按线程数静态切分, 同样的n和线程数总是得到同样的切分, 结果可复现
+class ThreadPool {
+public:
+  //   nthread包含调用线程, 为1时ParallelFor直接在调用线程执行
+  explicit ThreadPool(size_t nthread) : nthread_(nthread == 0 ? 1 : nthread) {
+    for (size_t w = 1; w < nthread_; ++w) {
+      workers_.emplace_back([this, w] { WorkerLoop(w); });
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    start_cv_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  inline size_t Size() const { return nthread_; }
+
+  //   第w个分块为[w * n / Size(), (w + 1) * n / Size()), 调用线程执行第0块
+  //   fn(chunk, begin, end), 返回前所有分块都已完成, 分块抛出的异常在这里重新抛出
+  void ParallelFor(size_t n,
+                   const std::function<void(size_t, size_t, size_t)> &fn) {
+    std::lock_guard<std::mutex> call_lock(call_mutex_);
+    Dispatch(n, fn);
+  }
+
+  //   线程池正被其他线程使用时不等待, 直接返回false, 由调用方自行串行计算
+  bool TryParallelFor(size_t n,
+                      const std::function<void(size_t, size_t, size_t)> &fn) {
+    std::unique_lock<std::mutex> call_lock(call_mutex_, std::try_to_lock);
+    if (!call_lock.owns_lock()) {
+      return false;
+    }
+    Dispatch(n, fn);
+    return true;
+  }
+
+private:
+  void Dispatch(size_t n,
+                const std::function<void(size_t, size_t, size_t)> &fn) {
+    if (nthread_ == 1 || n < 2) {
+      fn(0, 0, n);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &fn;
+      task_size_ = n;
+      pending_ = nthread_ - 1;
+      error_ = nullptr;
+      ++generation_;
+    }
+    start_cv_.notify_all();
+    RunChunk(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return pending_ == 0; });
+    task_ = nullptr;
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+  void WorkerLoop(size_t w) {
+    size_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_cv_.wait(lock,
+                       [this, seen] { return stop_ || generation_ != seen; });
+        if (stop_) {
+          return;
+        }
+        seen = generation_;
+      }
+      RunChunk(w);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_ == 0) {
+        done_cv_.notify_one();
+      }
+    }
+  }
+
+  void RunChunk(size_t w) {
+    size_t begin = w * task_size_ / nthread_;
+    size_t end = (w + 1) * task_size_ / nthread_;
+    if (begin == end) {
+      return;
+    }
+    try {
+      (*task_)(w, begin, end);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+    }
+  }
+
+  size_t nthread_;
+  std::vector<std::thread> workers_;
+  //   同一时刻只允许一个调用方派发任务
+  std::mutex call_mutex_;
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  bool stop_ = false;
+  size_t generation_ = 0;
+  size_t pending_ = 0;
+  const std::function<void(size_t, size_t, size_t)> *task_ = nullptr;
+  size_t task_size_ = 0;
+  std::exception_ptr error_;
+};
+
+} // namespace factor_tree
@@ -0,0 +1,311 @@
+#pragma once
+
+#include "factortree.h"
+
+#include <xtensor/xarray.hpp>
+#include <xtensor/xnpy.hpp>
+#include <xtensor/xtensor.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace factor_tree {
+
+// 读取.npy二维数组, 支持float64和float32, 统一转为行主序的double
+inline xt::xtensor<double, 2> LoadNpyMatrix(const std::string &filename) {
+  xt::xarray<double> array;
+  try {
+    array = xt::load_npy<double>(filename);
+  } catch (const std::runtime_error &) {
+    //   类型不是float64时再按float32读一次
+    array = xt::load_npy<float>(filename);
+  }
+  if (array.dimension() != 2) {
+    throw std::invalid_argument(filename + " should be a 2-d array");
+  }
+  return array;
+}
+
+// 只读.npy文件头, 返回第一维的长度, 不读数据
+inline size_t NpyRows(const std::string &filename) {
+  std::ifstream in(filename, std::ios::binary);
+  char prefix[10];
+  if (!in.read(prefix, sizeof(prefix)) ||
+      std::string(prefix, 6) != "\x93NUMPY") {
+    throw std::runtime_error(filename + " is not a .npy file");
+  }
+  //   v1.0的头长度为2字节, v2.0起为4字节
+  size_t length = static_cast<uint8_t>(prefix[8]) |
+                  static_cast<size_t>(static_cast<uint8_t>(prefix[9])) << 8;
+  if (prefix[6] != 1) {
+    char high[2];
+    if (!in.read(high, sizeof(high))) {
+      throw std::runtime_error(filename + " is truncated");
+    }
+    length |= static_cast<size_t>(static_cast<uint8_t>(high[0])) << 16 |
+              static_cast<size_t>(static_cast<uint8_t>(high[1])) << 24;
+  }
+  std::string header(length, '\0');
+  if (!in.read(header.data(), length)) {
+    throw std::runtime_error(filename + " is truncated");
+  }
+  size_t pos = header.find("'shape':");
+  pos = pos == std::string::npos ? pos : header.find('(', pos);
+  if (pos == std::string::npos) {
+    throw std::runtime_error(filename + " has no shape in its header");
+  }
+  return std::stoull(header.substr(pos + 1));
+}
+
+// 历史数据目录, 每个字段(文件名即Update时的字段名)一份 T x nstock 的数组:
+//   <dir>/<field>.npy            整段历史一个文件
+//   <dir>/<field>/<chunk>.npy    按文件名排序的分块, 各字段对应分块的行数相同
+// <dir>/day_starts.npy: int64, 每个交易日第一行的全局行号, 升序且第一个为0;
+// 没有这个文件时整段历史视为同一天
+// 分块逐块读入, 内存占用与分块大小有关, 与历史长度无关
+class NpyHistory {
+public:
+  static constexpr const char *kDayStartsFile = "day_starts.npy";
+
+  explicit NpyHistory(const std::string &dir) {
+    namespace fs = std::filesystem;
+    if (!fs::is_directory(dir)) {
+      throw std::invalid_argument(dir + " is not a directory");
+    }
+    std::vector<fs::directory_entry> entries;
+    for (const auto &entry : fs::directory_iterator(dir)) {
+      entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end());
+    for (const auto &entry : entries) {
+      const auto &path = entry.path();
+      if (entry.is_regular_file() && path.extension() == ".npy") {
+        if (path.filename() == kDayStartsFile) {
+          LoadDayStarts(path.string());
+          continue;
+        }
+        fields_.push_back(path.stem().string());
+        chunk_files_.push_back(std::vector<std::string>{path.string()});
+      } else if (entry.is_directory()) {
+        std::vector<std::string> chunks;
+        for (const auto &chunk : fs::directory_iterator(path)) {
+          if (chunk.is_regular_file() && chunk.path().extension() == ".npy") {
+            chunks.push_back(chunk.path().string());
+          }
+        }
+        if (chunks.empty()) {
+          continue;
+        }
+        std::sort(chunks.begin(), chunks.end());
+        fields_.push_back(path.filename().string());
+        chunk_files_.push_back(std::move(chunks));
+      }
+    }
+    if (fields_.empty()) {
+      throw std::invalid_argument("no .npy field found in " + dir);
+    }
+    for (const auto &chunks : chunk_files_) {
+      if (chunks.size() != chunk_files_[0].size()) {
+        throw std::invalid_argument("fields in " + dir +
+                                    " have different chunk counts");
+      }
+    }
+    has_day_starts_ = !day_starts_.empty();
+    if (day_starts_.empty()) {
+      day_starts_.push_back(0);
+    }
+  }
+
+  const std::vector<std::string> &Fields() const { return fields_; }
+
+  size_t NumChunks() const { return chunk_files_[0].size(); }
+
+  const std::vector<size_t> &DayStarts() const { return day_starts_; }
+
+  //   目录中没有day_starts.npy时为false, 此时DayStarts()只有0
+  bool HasDayStarts() const { return has_day_starts_; }
+
+  //   历史的总行数, 只读第一个字段各分块的文件头
+  size_t NumRows() const {
+    size_t rows = 0;
+    for (const auto &chunk : chunk_files_[0]) {
+      rows += NpyRows(chunk);
+    }
+    return rows;
+  }
+
+  //   第k块各字段的数据, 行数和nstock不一致时抛出异常
+  std::vector<xt::xtensor<double, 2>> LoadChunk(size_t k) const {
+    std::vector<xt::xtensor<double, 2>> chunk;
+    chunk.reserve(fields_.size());
+    for (size_t f = 0; f < fields_.size(); ++f) {
+      chunk.push_back(LoadNpyMatrix(chunk_files_[f][k]));
+      if (chunk[f].shape() != chunk[0].shape()) {
+        throw std::invalid_argument(chunk_files_[f][k] + " and " +
+                                    chunk_files_[0][k] +
+                                    " have different shapes");
+      }
+    }
+    return chunk;
+  }
+
+private:
+  void LoadDayStarts(const std::string &filename) {
+    auto starts = xt::load_npy<int64_t>(filename);
+    for (auto start : starts) {
+      if (start < 0 ||
+          (!day_starts_.empty() &&
+           static_cast<size_t>(start) <= day_starts_.back()) ||
+          (day_starts_.empty() && start != 0)) {
+        throw std::invalid_argument(filename +
+                                    " should be increasing and start at 0");
+      }
+      day_starts_.push_back(static_cast<size_t>(start));
+    }
+  }
+
+  std::vector<std::string> fields_;
+  //   [字段][分块]
+  std::vector<std::vector<std::string>> chunk_files_;
+  std::vector<size_t> day_starts_;
+  bool has_day_starts_ = false;
+};
+
+// 把整段历史的day_starts按分块切开, WarmUp按返回值逐块调用UpdateBlock
+class ChunkDaySplitter {
+public:
+  struct Chunk {
+    //   块内每天第一行的行号
+    std::vector<size_t> day_starts;
+    //   第0行在当天的序号, 一天跨越分块时不为0
+    size_t first_tidx = 0;
+    //   块的第0行是新的一天, 上一块结束的那一天要先收尾
+    bool close_previous = false;
+  };
+
+  explicit ChunkDaySplitter(std::vector<size_t> day_starts)
+      : day_starts_(std::move(day_starts)) {}
+
+  //   下一块有rows行
+  Chunk Next(size_t rows) {
+    Chunk chunk;
+    chunk.first_tidx = rows_ - day_start_;
+    while (next_day_ < day_starts_.size() &&
+           day_starts_[next_day_] < rows_ + rows) {
+      chunk.day_starts.push_back(day_starts_[next_day_++] - rows_);
+    }
+    chunk.close_previous = !chunk.day_starts.empty() &&
+                           chunk.day_starts[0] == 0 && rows_ > 0;
+    if (!chunk.day_starts.empty()) {
+      day_start_ = rows_ + chunk.day_starts.back();
+    }
+    rows_ += rows;
+    return chunk;
+  }
+
+  size_t Rows() const { return rows_; }
+
+  size_t Days() const { return next_day_; }
+
+  //   所有分块之后调用, day_starts超出历史长度时抛出异常
+  void Finish() const {
+    if (next_day_ < day_starts_.size()) {
+      throw std::invalid_argument("day_starts exceeds the history length " +
+                                  std::to_string(rows_));
+    }
+  }
+
+private:
+  std::vector<size_t> day_starts_;
+  size_t next_day_ = 0;
+  //   已切分的行数和当前这一天第一行的全局行号
+  size_t rows_ = 0;
+  size_t day_start_ = 0;
+};
+
+struct WarmupReport {
+  size_t rows = 0;
+  size_t days = 0;
+  size_t nstock = 0;
+  //   读文件和计算的耗时
+  double load_seconds = 0.0;
+  double update_seconds = 0.0;
+
+  double RowsPerSecond() const {
+    return update_seconds > 0.0 ? static_cast<double>(rows) / update_seconds
+                                : 0.0;
+  }
+
+  std::string ToString() const {
+    std::ostringstream os;
+    os << rows << " rows, " << days << " days, nstock " << nstock
+       << ", load " << load_seconds << " s, update " << update_seconds
+       << " s, " << RowsPerSecond() << " rows/s, "
+       << RowsPerSecond() * static_cast<double>(nstock) << " values/s";
+    return os.str();
+  }
+};
+
+// 用历史数据预热: 每块交给FactorTree::UpdateBlock, tidx为行在当天的序号;
+// 在day_starts处调用OnDayEnd/OnDayBegin, 第一行之前调用OnDayBegin, 历史的
+// 最后一天视为完整的一天, 结束时调用OnDayEnd. 一天可以跨越分块
+// 给出sink时每行的结果写入sink中名为factor的输出, 即回补历史因子值
+inline WarmupReport WarmUp(FactorTree &tree, const NpyHistory &history,
+                           OutputSink *sink = nullptr,
+                           const std::string &factor = "") {
+  using Clock = std::chrono::steady_clock;
+  WarmupReport report;
+  const auto &fields = history.Fields();
+  ChunkDaySplitter splitter(history.DayStarts());
+  for (size_t k = 0; k < history.NumChunks(); ++k) {
+    auto load_begin = Clock::now();
+    auto chunk = history.LoadChunk(k);
+    auto update_begin = Clock::now();
+    report.load_seconds +=
+        std::chrono::duration<double>(update_begin - load_begin).count();
+    const size_t rows = chunk[0].shape()[0];
+    const size_t nstock = chunk[0].shape()[1];
+    if (report.rows > 0 && nstock != report.nstock) {
+      throw std::invalid_argument("chunk " + std::to_string(k) +
+                                  " has a different nstock");
+    }
+    report.nstock = nstock;
+
+    auto days = splitter.Next(rows);
+    if (days.close_previous) {
+      tree.OnDayEnd();
+    }
+    std::unordered_map<std::string, xt::xtensor<double, 2>> data;
+    for (size_t f = 0; f < fields.size(); ++f) {
+      data.emplace(fields[f], std::move(chunk[f]));
+    }
+    auto result =
+        tree.UpdateBlock(data, days.day_starts, days.first_tidx, false);
+    if (sink != nullptr) {
+      for (size_t r = 0; r < rows; ++r) {
+        sink->Append(factor, result.data() + r * nstock, nstock);
+      }
+    }
+    report.rows += rows;
+    report.update_seconds +=
+        std::chrono::duration<double>(Clock::now() - update_begin).count();
+  }
+  if (report.rows > 0) {
+    tree.OnDayEnd();
+  }
+  splitter.Finish();
+  report.days = splitter.Days();
+  return report;
+}
+
+} // namespace factor_tree
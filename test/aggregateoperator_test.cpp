@@ -0,0 +1,181 @@
+// ad_mean/ad_sum按时间槽维护的窗口与逐槽保存历史的直接计算相同,
+// 包括半天交易日、缺失的bar和同一时间槽的重复写入
+#include "factor_tree/operators/aggregateoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <deque>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::AdMean;
+using header_ops::AdSum;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+constexpr size_t kNstock = 4;
+constexpr size_t kBatchPerDay = 6;
+constexpr size_t kWindow = 3;
+constexpr double kTolerance = 1e-12;
+
+struct AdTree {
+  InitArgsPtr config = std::make_shared<InitArgs>(kNstock, kBatchPerDay);
+  std::shared_ptr<TreeContext> context = GetTreeContext(config);
+  std::shared_ptr<InputOp> x;
+  OperatorPtr mean;
+  OperatorPtr sum;
+  RequestIdx next_idx = 1;
+
+  AdTree() {
+    x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+    OperatorPtr input = x;
+    mean = AdMean::Create({Arg(input), Arg(int(kWindow))},
+                          OpInitArgs{1, config});
+    sum = AdSum::Create({Arg(input), Arg(int(kWindow))},
+                        OpInitArgs{2, config});
+  }
+
+  void OnDayBegin() {
+    DayCycle(mean).OnDayBegin();
+    DayCycle(sum).OnDayBegin();
+  }
+
+  //   返回 {ad_mean, ad_sum}
+  std::pair<Tensor, Tensor> Step(const Tensor &values, size_t tidx) {
+    ScopedValue<size_t> scoped_tidx(context->tidx, tidx);
+    x->Feed(next_idx, values);
+    Tensor m = mean->GetResult(next_idx).GetTensor();
+    Tensor s = sum->GetResult(next_idx).GetTensor();
+    ++next_idx;
+    return {m, s};
+  }
+};
+
+// 每个时间槽最近kWindow个有该时间槽的交易日, 同一天重复写入时取最后一次
+struct BruteAd {
+  std::vector<std::deque<Tensor>> slots =
+      std::vector<std::deque<Tensor>>(kBatchPerDay);
+  std::vector<bool> written = std::vector<bool>(kBatchPerDay, false);
+
+  void OnDayBegin() { std::fill(written.begin(), written.end(), false); }
+
+  std::pair<Tensor, Tensor> Step(const Tensor &values, size_t tidx) {
+    auto &days = slots[tidx];
+    if (written[tidx]) {
+      days.back() = values;
+    } else {
+      days.push_back(values);
+      if (days.size() > kWindow) {
+        days.pop_front();
+      }
+      written[tidx] = true;
+    }
+    auto mean = Tensor::from_shape({kNstock});
+    auto sum = Tensor::from_shape({kNstock});
+    for (size_t i = 0; i < kNstock; ++i) {
+      double total = 0.0;
+      int valid = 0;
+      for (const auto &day : days) {
+        if (!std::isnan(day(i))) {
+          total += day(i);
+          ++valid;
+        }
+      }
+      mean(i) = valid > 0 ? total / valid : kNaN;
+      sum(i) = valid > 0 ? total : kNaN;
+    }
+    return {mean, sum};
+  }
+};
+
+Tensor Values(std::mt19937 &gen) {
+  std::normal_distribution<double> dist(0.0, 1.0);
+  auto values = Tensor::from_shape({kNstock});
+  for (size_t i = 0; i < kNstock; ++i) {
+    values(i) = gen() % 4 == 0 ? kNaN : dist(gen);
+  }
+  return values;
+}
+
+// 当天的时间槽: 完整交易日、半天交易日(只有前一半)、随机缺失的bar,
+// 以及补发的bar(同一时间槽再写一次)
+std::vector<size_t> DaySlots(size_t day, std::mt19937 &gen) {
+  std::vector<size_t> slots;
+  const size_t kind = day % 4;
+  for (size_t t = 0; t < kBatchPerDay; ++t) {
+    if (kind == 1 && t >= kBatchPerDay / 2) {
+      break;
+    }
+    if (kind == 2 && gen() % 3 == 0) {
+      continue;
+    }
+    slots.push_back(t);
+    if (kind == 3 && t == 2) {
+      slots.push_back(t);
+    }
+  }
+  return slots;
+}
+
+TEST(AdWindowStateTest, MatchesBruteForceWithExplicitTidx) {
+  AdTree tree;
+  BruteAd brute;
+  std::mt19937 gen(5);
+  for (size_t day = 0; day < 5 * kWindow; ++day) {
+    tree.OnDayBegin();
+    brute.OnDayBegin();
+    for (size_t tidx : DaySlots(day, gen)) {
+      auto values = Values(gen);
+      auto [mean, sum] = tree.Step(values, tidx);
+      auto [expected_mean, expected_sum] = brute.Step(values, tidx);
+      SCOPED_TRACE("day " + std::to_string(day) + " tidx " +
+                   std::to_string(tidx));
+      ExpectSameValues(expected_mean, mean, kTolerance);
+      ExpectSameValues(expected_sum, sum, kTolerance);
+    }
+  }
+}
+
+// 不指定tidx时按当天Update次数推算, 与依次给出0, 1, 2, ...相同
+TEST(AdWindowStateTest, AutoTidxCountsUpdatesSinceDayBegin) {
+  AdTree automatic;
+  AdTree explicit_tidx;
+  std::mt19937 gen(9);
+  for (size_t day = 0; day < 2 * kWindow; ++day) {
+    automatic.OnDayBegin();
+    explicit_tidx.OnDayBegin();
+    //   提前收盘的交易日, 第二天仍从0开始
+    const size_t batches = day % 2 == 0 ? kBatchPerDay : kBatchPerDay / 2;
+    for (size_t t = 0; t < batches; ++t) {
+      auto values = Values(gen);
+      auto [mean, sum] = automatic.Step(values, kAutoTidx);
+      auto [expected_mean, expected_sum] = explicit_tidx.Step(values, t);
+      ExpectSameValues(expected_mean, mean);
+      ExpectSameValues(expected_sum, sum);
+    }
+  }
+}
+
+TEST(AdWindowStateTest, RejectsTidxBeyondBatchPerDay) {
+  AdTree tree;
+  std::mt19937 gen(3);
+  tree.OnDayBegin();
+  EXPECT_THROW(tree.Step(Values(gen), kBatchPerDay), std::out_of_range);
+
+  AdTree automatic;
+  automatic.OnDayBegin();
+  for (size_t t = 0; t < kBatchPerDay; ++t) {
+    automatic.Step(Values(gen), kAutoTidx);
+  }
+  EXPECT_THROW(automatic.Step(Values(gen), kAutoTidx), std::out_of_range);
+}
+
+} // namespace
+} // namespace factor_tree
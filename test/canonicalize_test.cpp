@@ -0,0 +1,44 @@
+// 规范化前后的两棵树在含nan的输入上逐批次结果相同
+// 需要链接FactorTree
+#include "factor_tree/factortree.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace factor_tree {
+namespace {
+
+using testing::ExpectSameTrees;
+
+constexpr size_t kNstock = 6;
+constexpr size_t kBatchPerDay = 5;
+
+class CanonicalizeNanTest : public ::testing::TestWithParam<const char *> {};
+
+TEST_P(CanonicalizeNanTest, SameResults) {
+  const std::string expression = GetParam();
+  InitArgs args(kNstock);
+  args.batch_per_day = kBatchPerDay;
+  FactorTree plain(args);
+  plain.CreateTree(expression);
+  FactorTree canonical(args);
+  BuildOptions options;
+  options.canonicalize = true;
+  canonical.CreateTree(expression, options);
+  ASSERT_NE(plain.ToString(), canonical.ToString());
+  ExpectSameTrees(plain, canonical, {"x"}, kNstock, kBatchPerDay);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Rewrites, CanonicalizeNanTest,
+    ::testing::Values("add(@x,#0)", "add(#0,@x)", "subtract(@x,#0)",
+                      "multiply(@x,#1)", "multiply(#1,@x)", "divide(@x,#1)",
+                      "null(@x)", "minus(minus(@x))", "abs(abs(@x))",
+                      "relu(relu(@x))", "sign(sign(@x))", "ts_mean(@x,1)",
+                      "ts_min(@x,1)", "ts_max(@x,1)", "in_ts_mean(@x,1)",
+                      "ts_delay(@x,0)", "ts_delay(ts_delay(@x,2),3)"));
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,396 @@
+// 按节点保存的各种checkpoint在共享子树的DAG上保存再加载, 之后继续计算的
+// 结果与没有中断的树逐批次相同
+#include "factor_tree/checkpoint.h"
+#include "factor_tree/operators/intradayoperator.h"
+#include "factor_tree/operators/mathoperator.h"
+#include "factor_tree/operators/tsoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <cereal/types/deque.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::InTsMean;
+using header_ops::MathAdd;
+using header_ops::MathMultiply;
+using header_ops::TsConcent;
+using header_ops::TsTcorr;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+constexpr size_t kNstock = 7;
+constexpr size_t kBatchPerDay = 6;
+
+// 模拟库中编译的有状态算子: 没有DagOp, 按原有接口递归保存子树
+// 输出子节点的累计和(跳过nan)
+class OpaqueCumSumOp : public BaseOperator {
+public:
+  OpaqueCumSumOp(const OperatorPtr &child, const OpInitArgs &init_args)
+      : BaseOperator(init_args), child_(child), sum_(Nstock(), 0.0) {}
+
+  OpOutput GetResult(RequestIdx idx) override {
+    if (GetOpCacheIdx() == idx) {
+      return OpOutput(GetOpResultBuffer());
+    }
+    const Tensor &x = child_->GetResult(idx).GetTensor();
+    Tensor &out = *GetOpResultBuffer();
+    for (size_t i = 0; i < Nstock(); ++i) {
+      if (!std::isnan(x(i))) {
+        sum_[i] += x(i);
+      }
+      out(i) = sum_[i];
+    }
+    UpdateRequestIdx(idx);
+    return OpOutput(GetOpResultBuffer());
+  }
+
+  OperatorType GetType() const override { return OperatorType::TsSum; }
+
+  std::string ToString() const override {
+    return "opaque_cumsum(" + child_->ToString() + ")";
+  }
+
+  void LoadCheckpoint(cereal::BinaryInputArchive &ar) override {
+    child_->LoadCheckpoint(ar);
+    ar(sum_);
+  }
+
+  void SaveCheckpoint(cereal::BinaryOutputArchive &ar) const override {
+    child_->SaveCheckpoint(ar);
+    ar(sum_);
+  }
+
+private:
+  OperatorPtr child_;
+  std::vector<double> sum_;
+};
+
+// 状态长度随批次增长: history记录全部输入, 之后是两页多的固定数据
+// history变长时后面的数据整体后移, 增量中的页都与基准不同
+struct GrowingState : public BaseState {
+  static constexpr bool kDayAware = false;
+  std::deque<double> history;
+  std::vector<double> tail = std::vector<double>(1200, 1.0);
+
+  template <class Archive> void serialize(Archive &ar) { ar(history, tail); }
+};
+
+// 输出当前值加上已记录的个数
+class GrowingOp : public StatefulUnaryOp<GrowingOp, GrowingState> {
+public:
+  GrowingOp(OperatorPtr &child, const OpInitArgs &init_args)
+      : StatefulUnaryOp<GrowingOp, GrowingState>(child, GrowingState(),
+                                                 init_args) {}
+
+  OperatorType GetType() const override { return OperatorType::TsSum; }
+
+  std::string ToString() const override {
+    return "growing(" + GetChild()->ToString() + ")";
+  }
+
+  void Update(OpInput &input, OpOutput &output) {
+    const Tensor &x = *input.GetColumeData();
+    auto &history = GetState().history;
+    const double count = static_cast<double>(history.size());
+    for (size_t i = 0; i < x.size(); ++i) {
+      output.GetTensor()(i) = x(i) + count;
+      history.push_back(x(i));
+    }
+  }
+};
+
+// add(add(a, b), multiply(in_ts_mean(a, 3), opaque_cumsum(a)))
+// a = ts_tcorr(@x, 5) 被三个父节点共享, 其中一个父节点没有DagOp
+struct SharedDag {
+  InitArgsPtr config = std::make_shared<InitArgs>(kNstock, kBatchPerDay);
+  std::shared_ptr<InputOp> x;
+  OperatorPtr root;
+  RequestIdx next_idx = 1;
+
+  SharedDag() {
+    OperatorId id = 0;
+    auto next = [this, &id] { return OpInitArgs{id++, config}; };
+    x = std::make_shared<InputOp>("@x", next());
+    OperatorPtr input = x;
+    auto a = TsTcorr::Create({Arg(input), Arg(5)}, next());
+    auto b = TsConcent::Create({Arg(input), Arg(4)}, next());
+    auto m = InTsMean::Create({Arg(a), Arg(3)}, next());
+    OperatorPtr o(new OpaqueCumSumOp(a, next()));
+    auto s1 = MathAdd::Create({Arg(a), Arg(b)}, next());
+    auto s2 = MathMultiply::Create({Arg(m), Arg(o)}, next());
+    root = MathAdd::Create({Arg(s1), Arg(s2)}, next());
+  }
+
+  //   第batch个批次(从0开始), 每kBatchPerDay个批次换日
+  Tensor Step(size_t batch, const Tensor &values) {
+    if (batch % kBatchPerDay == 0) {
+      DayCycle days(root);
+      if (batch > 0) {
+        days.OnDayEnd();
+      }
+      days.OnDayBegin();
+    }
+    x->Feed(next_idx, values);
+    return root->GetResult(next_idx++).GetTensor();
+  }
+};
+
+Tensor Batch(size_t batch) {
+  std::mt19937 gen(static_cast<unsigned>(batch) + 1);
+  std::normal_distribution<double> dist(0.0, 1.0);
+  auto values = Tensor::from_shape({kNstock});
+  for (size_t i = 0; i < kNstock; ++i) {
+    values(i) = gen() % 5 == 0 ? kNaN : dist(gen);
+  }
+  return values;
+}
+
+void RunBatches(SharedDag &dag, size_t begin, size_t end) {
+  for (size_t t = begin; t < end; ++t) {
+    dag.Step(t, Batch(t));
+  }
+}
+
+// source已计算到batch并保存, restored由load恢复, 之后两棵树的结果相同
+// 状态按不同的历史重新累计时, 滚动和的舍入不同, 用tolerance比较
+template <typename LoadFn>
+void ExpectSameContinuation(SharedDag &source, size_t batch, LoadFn load,
+                            double tolerance = 0.0) {
+  SharedDag restored;
+  //   换日按批次号进行, 恢复的树从当天的中间开始
+  if (batch % kBatchPerDay != 0) {
+    DayCycle(restored.root).OnDayBegin();
+  }
+  load(restored);
+  for (size_t t = batch; t < batch + 3 * kBatchPerDay; ++t) {
+    auto expected = source.Step(t, Batch(t));
+    auto actual = restored.Step(t, Batch(t));
+    ExpectSameValues(expected, actual, tolerance);
+  }
+}
+
+TEST(CheckpointTest, CollectsSharedNodesOnce) {
+  SharedDag dag;
+  //   ts_tcorr, ts_concent, in_ts_mean各一次, 没有DagOp的节点整体保存
+  auto ops = CollectStatefulOps(dag.root);
+  ASSERT_EQ(ops.size(), 4u);
+  EXPECT_EQ(ops[0]->ToString(), "ts_tcorr(@x,5)");
+  EXPECT_EQ(ops.back()->ToString(), "opaque_cumsum(ts_tcorr(@x,5))");
+}
+
+TEST(CheckpointTest, DagRoundTrip) {
+  SharedDag source;
+  RunBatches(source, 0, 9);
+  std::stringstream buffer;
+  SaveDagCheckpoint(source.root, buffer);
+  ExpectSameContinuation(source, 9, [&buffer](SharedDag &dag) {
+    LoadDagCheckpoint(dag.root, buffer);
+  });
+}
+
+TEST(CheckpointTest, MappedRoundTrip) {
+  const std::string filename = ::testing::TempDir() + "mapped.ckpt";
+  SharedDag source;
+  RunBatches(source, 0, 10);
+  SaveMappedCheckpoint(source.root, filename, 3);
+  ExpectSameContinuation(source, 10, [&filename](SharedDag &dag) {
+    EXPECT_EQ(LoadMappedCheckpoint(dag.root, filename, 3), 10u);
+  });
+}
+
+TEST(CheckpointTest, MappedRejectsOtherConfig) {
+  const std::string filename = ::testing::TempDir() + "mapped_config.ckpt";
+  SharedDag source;
+  RunBatches(source, 0, 4);
+  SaveMappedCheckpoint(source.root, filename);
+  for (auto config : {std::make_shared<InitArgs>(kNstock + 1, kBatchPerDay),
+                      std::make_shared<InitArgs>(kNstock, kBatchPerDay + 1)}) {
+    OperatorPtr x(new InputOp("@x", OpInitArgs{0, config}));
+    auto root = TsTcorr::Create({Arg(x), Arg(5)}, OpInitArgs{1, config});
+    EXPECT_THROW(LoadMappedCheckpoint(root, filename), std::runtime_error);
+  }
+}
+
+TEST(CheckpointTest, DeltaRoundTrip) {
+  const std::string base = ::testing::TempDir() + "delta_base.ckpt";
+  const std::string delta = ::testing::TempDir() + "delta.ckpt";
+  SharedDag source;
+  RunBatches(source, 0, 10);
+  SaveMappedCheckpoint(source.root, base);
+  RunBatches(source, 10, 13);
+  WriteDeltaCheckpoint(SnapshotStates(source.root), base, delta);
+  ExpectSameContinuation(source, 13, [&](SharedDag &dag) {
+    EXPECT_EQ(LoadDeltaCheckpoint(dag.root, base, delta), 13u);
+  });
+}
+
+// 基准之后状态变长, 节点的数据整体后移: 增量保存该节点的全部页,
+// 加载增量和合并后的新基准都还原出完整的状态
+TEST(CheckpointTest, DeltaAfterStateGrows) {
+  const std::string base = ::testing::TempDir() + "grow_base.ckpt";
+  const std::string delta = ::testing::TempDir() + "grow_delta.ckpt";
+  const std::string compact = ::testing::TempDir() + "grow_compact.ckpt";
+  auto config = std::make_shared<InitArgs>(kNstock, kBatchPerDay);
+  auto x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+  OperatorPtr input = x;
+  OperatorPtr source(new GrowingOp(input, OpInitArgs{1, config}));
+  RequestIdx idx = 1;
+  for (; idx <= 10; ++idx) {
+    x->Feed(idx, Batch(idx));
+    source->GetResult(idx);
+  }
+  SaveMappedCheckpoint(source, base);
+  for (; idx <= 60; ++idx) {
+    x->Feed(idx, Batch(idx));
+    source->GetResult(idx);
+  }
+  auto snapshot = SnapshotStates(source);
+  ASSERT_EQ(snapshot.blobs.size(), 1u);
+  WriteDeltaCheckpoint(snapshot, base, delta);
+  DeltaCheckpointHeader header;
+  std::ifstream(delta, std::ios::binary)
+      .read(reinterpret_cast<char *>(&header), sizeof(header));
+  EXPECT_EQ(header.page_count,
+            AlignToPage(snapshot.blobs[0].size()) / kCheckpointPageSize);
+  CompactCheckpoint(base, delta, compact);
+
+  const auto &expected =
+      std::dynamic_pointer_cast<GrowingOp>(source)->GetState().history;
+  //   新建的树经load恢复, history相同, 下一批次的结果也相同
+  auto expect_restored = [&](auto load) {
+    auto y = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+    OperatorPtr restored_input = y;
+    auto restored =
+        std::make_shared<GrowingOp>(restored_input, OpInitArgs{1, config});
+    EXPECT_EQ(load(OperatorPtr(restored)), 60u);
+    const auto &history = restored->GetState().history;
+    EXPECT_TRUE(std::equal(history.begin(), history.end(), expected.begin(),
+                           expected.end(), [](double a, double b) {
+                             return a == b || (std::isnan(a) && std::isnan(b));
+                           }));
+    y->Feed(idx, Batch(idx));
+    ExpectSameValues(Batch(idx) + static_cast<double>(expected.size()),
+                     restored->GetResult(idx).GetTensor());
+  };
+  expect_restored([&](const OperatorPtr &root) {
+    return LoadDeltaCheckpoint(root, base, delta);
+  });
+  expect_restored([&](const OperatorPtr &root) {
+    return LoadMappedCheckpoint(root, compact);
+  });
+}
+
+// 增量只能叠加在生成它的那个基准上, 同一RequestIdx重新保存的基准也不行
+TEST(CheckpointTest, DeltaRejectsOtherBase) {
+  const std::string base = ::testing::TempDir() + "other_base.ckpt";
+  const std::string delta = ::testing::TempDir() + "other_delta.ckpt";
+  SharedDag source;
+  RunBatches(source, 0, 10);
+  SaveMappedCheckpoint(source.root, base);
+  RunBatches(source, 10, 12);
+  WriteDeltaCheckpoint(SnapshotStates(source.root), base, delta);
+
+  SharedDag other;
+  RunBatches(other, 0, 10);
+  SaveMappedCheckpoint(other.root, base);
+  SharedDag restored;
+  EXPECT_THROW(LoadDeltaCheckpoint(restored.root, base, delta),
+               std::runtime_error);
+}
+
+// 后台序列化的是保存时状态的拷贝, 之后继续Update不影响写出的内容
+TEST(CheckpointTest, AsyncRoundTrip) {
+  const std::string filename = ::testing::TempDir() + "async.ckpt";
+  SharedDag source;
+  SharedDag reference;
+  RunBatches(source, 0, 10);
+  RunBatches(reference, 0, 10);
+  AsyncCheckpointWriter writer;
+  writer.Save(source.root, filename, 2);
+  RunBatches(source, 10, 13);
+  writer.Wait();
+  ExpectSameContinuation(reference, 10, [&filename](SharedDag &dag) {
+    EXPECT_EQ(LoadMappedCheckpoint(dag.root, filename), 10u);
+  });
+}
+
+TEST(CheckpointTest, SubtreeRoundTrip) {
+  const std::string filename = ::testing::TempDir() + "subtree.ckpt";
+  SharedDag source;
+  RunBatches(source, 0, 8);
+  SaveSubtreeCheckpoint(source.root, filename);
+  ExpectSameContinuation(source, 8, [&filename](SharedDag &dag) {
+    auto result = LoadSubtreeCheckpoint(dag.root, filename);
+    EXPECT_EQ(result.restored, 4u);
+    EXPECT_TRUE(result.cold.empty());
+  });
+}
+
+TEST(CheckpointTest, SubtreeRejectsOtherBatchPerDay) {
+  const std::string filename = ::testing::TempDir() + "subtree_bpd.ckpt";
+  SharedDag source;
+  RunBatches(source, 0, 8);
+  SaveSubtreeCheckpoint(source.root, filename);
+  auto config = std::make_shared<InitArgs>(kNstock, kBatchPerDay + 1);
+  OperatorPtr x(new InputOp("@x", OpInitArgs{0, config}));
+  auto other = TsTcorr::Create({Arg(x), Arg(5)}, OpInitArgs{1, config});
+  EXPECT_THROW(LoadSubtreeCheckpoint(other, filename), std::runtime_error);
+}
+
+// 旧树为add(a, opaque_cumsum(a)), 新树中的ts_concent和in_ts_mean是cold节点:
+// 另建的树从窗口够用的位置开始预热到同一批次, 先加载它的状态,
+// 再加载旧checkpoint
+TEST(CheckpointTest, SubtreeWarmsColdNodes) {
+  const std::string old_file = ::testing::TempDir() + "subtree_old.ckpt";
+  const std::string warm_file = ::testing::TempDir() + "subtree_warm.ckpt";
+  constexpr size_t kBatch = 8;
+  {
+    auto config = std::make_shared<InitArgs>(kNstock, kBatchPerDay);
+    auto x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+    OperatorPtr input = x;
+    auto a = TsTcorr::Create({Arg(input), Arg(5)}, OpInitArgs{1, config});
+    OperatorPtr o(new OpaqueCumSumOp(a, OpInitArgs{2, config}));
+    auto old_root = MathAdd::Create({Arg(a), Arg(o)}, OpInitArgs{3, config});
+    for (size_t t = 0; t < kBatch; ++t) {
+      x->Feed(t + 1, Batch(t));
+      old_root->GetResult(t + 1);
+    }
+    SaveSubtreeCheckpoint(old_root, old_file);
+  }
+  SharedDag source;
+  RunBatches(source, 0, kBatch);
+  //   in_ts_mean在第6个批次换日后重新开始, 但它的输入ts_tcorr需要5个批次,
+  //   ts_concent的窗口为4: 从第2个批次开始预热
+  SharedDag warm;
+  DayCycle(warm.root).OnDayBegin();
+  RunBatches(warm, kBatch - 6, kBatch);
+  SaveSubtreeCheckpoint(warm.root, warm_file);
+
+  ExpectSameContinuation(
+      source, kBatch,
+      [&](SharedDag &dag) {
+        EXPECT_EQ(LoadSubtreeCheckpoint(dag.root, warm_file).restored, 4u);
+        auto result = LoadSubtreeCheckpoint(dag.root, old_file);
+        EXPECT_EQ(result.restored, 2u);
+        EXPECT_EQ(result.cold.size(), 2u);
+      },
+      1e-12);
+}
+
+} // namespace
+} // namespace factor_tree
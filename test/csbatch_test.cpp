@@ -0,0 +1,149 @@
+// 截面批量执行与逐个节点计算的结果相同; 输入抛出异常后之后的批次照常执行,
+// 批量执行过程中释放的节点不再被计算
+#include "factor_tree/operators/csbatch.h"
+#include "factor_tree/operators/csoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::CsRank;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+constexpr size_t kNstock = 50;
+
+// 每次求值时先调用on_result, 用来在批量执行中途抛出异常或释放节点
+class HookedInput : public InputOp {
+public:
+  using InputOp::InputOp;
+
+  OpOutput GetResult(RequestIdx idx) override {
+    if (on_result) {
+      on_result();
+    }
+    return InputOp::GetResult(idx);
+  }
+
+  std::function<void()> on_result;
+};
+
+// nfield个输入, 每个输入上一个cs_rank, 开启批量执行
+struct BatchTree {
+  InitArgsPtr config = std::make_shared<InitArgs>(kNstock);
+  std::vector<std::shared_ptr<HookedInput>> inputs;
+  std::vector<OperatorPtr> ranks;
+  std::mt19937 gen{3};
+
+  explicit BatchTree(size_t nfield) {
+    GetTreeContext(config)->cs_batch_threads = 2;
+    for (size_t k = 0; k < nfield; ++k) {
+      auto input = std::make_shared<HookedInput>(
+          "@x" + std::to_string(k), OpInitArgs{OperatorId(2 * k), config});
+      OperatorPtr child = input;
+      inputs.push_back(input);
+      ranks.push_back(
+          CsRank::Create({Arg(child)}, OpInitArgs{OperatorId(2 * k + 1),
+                                                  config}));
+    }
+  }
+
+  std::vector<Tensor> Feed(RequestIdx idx) {
+    std::normal_distribution<double> dist(0.0, 1.0);
+    std::vector<Tensor> values;
+    for (auto &input : inputs) {
+      auto x = Tensor::from_shape({kNstock});
+      for (auto &v : x) {
+        v = gen() % 6 == 0 ? kNaN : dist(gen);
+      }
+      input->Feed(idx, x);
+      values.push_back(x);
+    }
+    return values;
+  }
+
+  CsBatchRegistry &Registry() { return *GetTreeContext(config)->cs_batch; }
+};
+
+// 不开启批量执行的cs_rank
+Tensor SerialRank(const Tensor &x) {
+  auto config = std::make_shared<InitArgs>(x.size());
+  auto input = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+  OperatorPtr child = input;
+  auto rank = CsRank::Create({Arg(child)}, OpInitArgs{1, config});
+  input->Feed(1, x);
+  return rank->GetResult(1).GetTensor();
+}
+
+TEST(CsBatchTest, MatchesSerialAndKeepsRegistryBounded) {
+  BatchTree tree(4);
+  for (RequestIdx idx = 1; idx <= 20; ++idx) {
+    auto values = tree.Feed(idx);
+    for (size_t k = 0; k < tree.ranks.size(); ++k) {
+      ExpectSameValues(SerialRank(values[k]),
+                       tree.ranks[k]->GetResult(idx).GetTensor());
+    }
+  }
+  EXPECT_EQ(tree.Registry().NumRegistered(), 4u);
+}
+
+TEST(CsBatchTest, RecoversAfterInputThrows) {
+  BatchTree tree(3);
+  tree.Feed(1);
+  for (auto &rank : tree.ranks) {
+    rank->GetResult(1);
+  }
+  auto values = tree.Feed(2);
+  bool fail = true;
+  tree.inputs[2]->on_result = [&fail] {
+    if (fail) {
+      throw std::runtime_error("input failed");
+    }
+  };
+  EXPECT_THROW(tree.ranks[0]->GetResult(2), std::runtime_error);
+  //   同一批次重试时逐个计算
+  fail = false;
+  for (size_t k = 0; k < tree.ranks.size(); ++k) {
+    ExpectSameValues(SerialRank(values[k]),
+                     tree.ranks[k]->GetResult(2).GetTensor());
+  }
+  values = tree.Feed(3);
+  for (size_t k = 0; k < tree.ranks.size(); ++k) {
+    ExpectSameValues(SerialRank(values[k]),
+                     tree.ranks[k]->GetResult(3).GetTensor());
+  }
+}
+
+TEST(CsBatchTest, NodeReleasedDuringBatch) {
+  BatchTree tree(3);
+  tree.Feed(1);
+  for (auto &rank : tree.ranks) {
+    rank->GetResult(1);
+  }
+  //   批量执行求第1个节点的输入时释放第2个节点
+  tree.inputs[1]->on_result = [&tree] { tree.ranks[2].reset(); };
+  auto values = tree.Feed(2);
+  for (size_t k = 0; k < 2; ++k) {
+    ExpectSameValues(SerialRank(values[k]),
+                     tree.ranks[k]->GetResult(2).GetTensor());
+  }
+  EXPECT_EQ(tree.Registry().NumRegistered(), 2u);
+  tree.inputs[1]->on_result = nullptr;
+  values = tree.Feed(3);
+  for (size_t k = 0; k < 2; ++k) {
+    ExpectSameValues(SerialRank(values[k]),
+                     tree.ranks[k]->GetResult(3).GetTensor());
+  }
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,162 @@
+// 分组索引(CSR)在group列变化时重建, 同一group算子的cs_group_*共用一份索引,
+// 组内统计和排名与按组直接计算的结果相同
+#include "factor_tree/operators/csgroupoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::CsGroupMean;
+using header_ops::CsGroupRank;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+TEST(GroupIndexTest, BuildsCsrByGroupValue) {
+  GroupIndex index;
+  Tensor group = {2.0, kNaN, 0.0, 2.0, -1.0, 0.5, -0.0};
+  index.Refresh(group, 1);
+  ASSERT_EQ(index.NumGroups(), 3u);
+  EXPECT_EQ(index.group_id, (std::vector<int32_t>{2, -1, 0, 2, -1, 1, 0}));
+  EXPECT_EQ(index.offsets, (std::vector<uint32_t>{0, 2, 3, 5}));
+  EXPECT_EQ(index.members, (std::vector<uint32_t>{2, 6, 5, 0, 3}));
+}
+
+TEST(GroupIndexTest, RebuildsOnlyWhenGroupChanges) {
+  GroupIndex index;
+  Tensor group = {1.0, 2.0, 1.0};
+  index.Refresh(group, 1);
+  EXPECT_EQ(index.version, 1u);
+  //   同一批次不再比较, 内容相同的新批次不重建
+  index.Refresh(Tensor{5.0, 5.0, 5.0}, 1);
+  index.Refresh(group, 2);
+  EXPECT_EQ(index.version, 1u);
+
+  index.Refresh(Tensor{2.0, 2.0, kNaN}, 3);
+  EXPECT_EQ(index.version, 2u);
+  EXPECT_EQ(index.group_id, (std::vector<int32_t>{0, 0, -1}));
+  EXPECT_EQ(index.offsets, (std::vector<uint32_t>{0, 2}));
+  EXPECT_EQ(index.members, (std::vector<uint32_t>{0, 1}));
+
+  index.Refresh(Tensor{kNaN, -1.0, kNaN}, 4);
+  EXPECT_EQ(index.version, 3u);
+  EXPECT_EQ(index.NumGroups(), 0u);
+}
+
+TEST(GroupIndexRegistryTest, SharesIndexAndDropsExpiredEntries) {
+  auto config = std::make_shared<InitArgs>(4);
+  OperatorPtr x(new InputOp("@x", OpInitArgs{0, config}));
+  OperatorPtr group(new InputOp("@g", OpInitArgs{1, config}));
+  auto mean = CsGroupMean::Create({Arg(x), Arg(group)}, OpInitArgs{2, config});
+  auto rank = CsGroupRank::Create({Arg(x), Arg(group)}, OpInitArgs{3, config});
+  EXPECT_EQ(std::dynamic_pointer_cast<CsGroupMean>(mean)->GetGroupIndex(),
+            std::dynamic_pointer_cast<CsGroupRank>(rank)->GetGroupIndex());
+  auto &indices = GetTreeContext(config)->group_indices->indices;
+  EXPECT_EQ(indices.size(), 1u);
+
+  //   反复建树时释放的group算子不会留在表中
+  for (OperatorId id = 4; id < 20; id += 2) {
+    OperatorPtr other(new InputOp("@h", OpInitArgs{id, config}));
+    CsGroupMean::Create({Arg(x), Arg(other)}, OpInitArgs{id + 1, config});
+  }
+  mean.reset();
+  rank.reset();
+  OperatorPtr other(new InputOp("@h", OpInitArgs{30, config}));
+  auto kept = CsGroupMean::Create({Arg(x), Arg(other)}, OpInitArgs{31, config});
+  EXPECT_EQ(indices.size(), 1u);
+}
+
+// 按组直接计算: 组内有效x的均值, 以及按值排序的平均排名
+void BruteGroup(const Tensor &x, const Tensor &group, Tensor &mean,
+                Tensor &rank) {
+  std::map<double, std::vector<size_t>> members;
+  for (size_t i = 0; i < x.size(); ++i) {
+    mean(i) = kNaN;
+    rank(i) = kNaN;
+    if (group(i) >= 0 && !std::isnan(x(i))) {
+      members[group(i) + 0.0].push_back(i);
+    }
+  }
+  for (auto &[g, idx] : members) {
+    double sum = 0.0;
+    for (size_t i : idx) {
+      sum += x(i);
+    }
+    std::stable_sort(idx.begin(), idx.end(),
+                     [&x](size_t a, size_t b) { return x(a) < x(b); });
+    const size_t n = idx.size();
+    const double scale = n > 1 ? 1.0 / static_cast<double>(n - 1) : 0.0;
+    for (size_t begin = 0; begin < n;) {
+      size_t end = begin;
+      while (end < n && x(idx[end]) == x(idx[begin])) {
+        ++end;
+      }
+      for (size_t j = begin; j < end; ++j) {
+        mean(idx[j]) = sum / static_cast<double>(n);
+        rank(idx[j]) =
+            n == 1 ? 0.0
+                   : 0.5 * static_cast<double>(begin + end - 1) * scale - 0.5;
+      }
+      begin = end;
+    }
+  }
+}
+
+// group列每隔几个批次整体改变, 索引随之重建; 串行与按组并行的结果相同
+TEST(CsGroupOpTest, FollowsGroupChanges) {
+  const size_t n = kCsBlockSize + 300;
+  for (size_t threads : {1, 4}) {
+    auto config = std::make_shared<InitArgs>(n);
+    auto context = GetTreeContext(config);
+    context->cs_parallel_threads = threads;
+    context->cs_parallel_threshold = 1;
+    auto x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+    auto group = std::make_shared<InputOp>("@g", OpInitArgs{1, config});
+    OperatorPtr x_op = x;
+    OperatorPtr group_op = group;
+    auto mean =
+        CsGroupMean::Create({Arg(x_op), Arg(group_op)}, OpInitArgs{2, config});
+    auto rank =
+        CsGroupRank::Create({Arg(x_op), Arg(group_op)}, OpInitArgs{3, config});
+    std::mt19937 gen(17);
+    std::normal_distribution<double> dist(0.0, 1.0);
+    auto xs = Tensor::from_shape({n});
+    auto groups = Tensor::from_shape({n});
+    auto expected_mean = Tensor::from_shape({n});
+    auto expected_rank = Tensor::from_shape({n});
+    for (RequestIdx idx = 1; idx <= 6; ++idx) {
+      if (idx % 3 == 1) {
+        const size_t ngroup = 3 + idx * 5;
+        for (size_t i = 0; i < n; ++i) {
+          groups(i) = gen() % 10 == 0 ? kNaN
+                                      : static_cast<double>(gen() % ngroup);
+        }
+      }
+      for (size_t i = 0; i < n; ++i) {
+        xs(i) = gen() % 7 == 0   ? kNaN
+                : gen() % 2 == 0 ? static_cast<double>(gen() % 4)
+                                 : dist(gen);
+      }
+      x->Feed(idx, xs);
+      group->Feed(idx, groups);
+      BruteGroup(xs, groups, expected_mean, expected_rank);
+      SCOPED_TRACE("threads " + std::to_string(threads) + " batch " +
+                   std::to_string(idx));
+      ExpectSameValues(expected_mean, mean->GetResult(idx).GetTensor(),
+                       1e-12);
+      ExpectSameValues(expected_rank, rank->GetResult(idx).GetTensor());
+    }
+  }
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,255 @@
+// cs_winsorize与先算均值标准差再逐个截断的直接计算相同, 包括大量重复值
+// 和全nan的截面; 串行与按块并行的统计结果相同
+// FuseCsNormalize只合并只有一个消费者的嵌套节点, 合并前后结果相同
+#include "factor_tree/operators/csnormoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::CsDemean;
+using header_ops::CsOLSRes;
+using header_ops::CsPosition;
+using header_ops::CsWinsorize;
+using header_ops::CsZscore;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+constexpr double kTolerance = 1e-9;
+
+// @x之上的截面归一化树; threads大于1时按块并行
+struct NormTree {
+  InitArgsPtr config;
+  std::shared_ptr<InputOp> x;
+  OperatorPtr input;
+  RequestIdx next_idx = 1;
+  OperatorId next_id = 1;
+
+  NormTree(size_t nstock, size_t threads)
+      : config(std::make_shared<InitArgs>(nstock)) {
+    auto context = GetTreeContext(config);
+    context->cs_parallel_threads = threads;
+    context->cs_parallel_threshold = 1;
+    x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+    input = x;
+  }
+
+  template <typename Op> OperatorPtr Add(std::vector<Arg> args) {
+    return Op::Create(args, OpInitArgs{next_id++, config});
+  }
+
+  Tensor Step(const OperatorPtr &op, const Tensor &values) {
+    x->Feed(next_idx, values);
+    return op->GetResult(next_idx++).GetTensor();
+  }
+};
+
+// 两遍计算非nan元素的均值和样本标准差, 截断到mean ± nstd * sd
+// 有效值少于2个时原样输出
+Tensor Winsorize(const Tensor &x, double nstd) {
+  double sum = 0.0;
+  size_t n = 0;
+  for (double v : x) {
+    if (!std::isnan(v)) {
+      sum += v;
+      ++n;
+    }
+  }
+  Tensor out = x;
+  if (n < 2) {
+    return out;
+  }
+  const double mean = sum / static_cast<double>(n);
+  double ss = 0.0;
+  for (double v : x) {
+    if (!std::isnan(v)) {
+      ss += (v - mean) * (v - mean);
+    }
+  }
+  const double sd = std::sqrt(ss / static_cast<double>(n - 1));
+  for (auto &v : out) {
+    if (!std::isnan(v)) {
+      v = std::clamp(v, mean - nstd * sd, mean + nstd * sd);
+    }
+  }
+  return out;
+}
+
+Tensor Demean(const Tensor &x) {
+  double sum = 0.0;
+  size_t n = 0;
+  for (double v : x) {
+    if (!std::isnan(v)) {
+      sum += v;
+      ++n;
+    }
+  }
+  Tensor out = x;
+  for (auto &v : out) {
+    v -= n > 0 ? sum / static_cast<double>(n) : kNaN;
+  }
+  return out;
+}
+
+Tensor Zscore(const Tensor &x) {
+  double sum = 0.0;
+  size_t n = 0;
+  for (double v : x) {
+    if (!std::isnan(v)) {
+      sum += v;
+      ++n;
+    }
+  }
+  const double mean = sum / static_cast<double>(n);
+  double ss = 0.0;
+  for (double v : x) {
+    if (!std::isnan(v)) {
+      ss += (v - mean) * (v - mean);
+    }
+  }
+  const double sd = std::sqrt(ss / static_cast<double>(n - 1));
+  Tensor out = x;
+  for (auto &v : out) {
+    v = (v - mean) / sd;
+  }
+  return out;
+}
+
+Tensor Position(const Tensor &x) {
+  double lo = kNaN;
+  double hi = kNaN;
+  for (double v : x) {
+    if (!std::isnan(v)) {
+      lo = std::isnan(lo) ? v : std::min(lo, v);
+      hi = std::isnan(hi) ? v : std::max(hi, v);
+    }
+  }
+  Tensor out = x;
+  for (auto &v : out) {
+    v = (v - lo) / (hi - lo);
+  }
+  return out;
+}
+
+const CsNormalizeOp &AsNorm(const OperatorPtr &op) {
+  return dynamic_cast<const CsNormalizeOp &>(*op);
+}
+
+// 厚尾分布, 每个截面都有被截断的值; 约1/5为nan
+Tensor HeavyTail(size_t n, std::mt19937 &gen) {
+  std::student_t_distribution<double> dist(2.0);
+  auto x = Tensor::from_shape({n});
+  for (size_t i = 0; i < n; ++i) {
+    x(i) = gen() % 5 == 0 ? kNaN : dist(gen);
+  }
+  return x;
+}
+
+TEST(CsWinsorizeTest, MatchesTwoPassClip) {
+  const size_t n = 2 * kCsBlockSize + 100;
+  for (size_t threads : {1, 4}) {
+    NormTree tree(n, threads);
+    auto winsorize = tree.Add<CsWinsorize>({Arg(tree.input), Arg(2.5)});
+    auto demeaned = tree.Add<CsWinsorize>(
+        {Arg(tree.Add<CsDemean>({Arg(tree.input)})), Arg(3)});
+    std::mt19937 gen(21);
+    for (int batch = 0; batch < 3; ++batch) {
+      auto x = HeavyTail(n, gen);
+      SCOPED_TRACE("threads " + std::to_string(threads) + " batch " +
+                   std::to_string(batch));
+      ExpectSameValues(Winsorize(x, 2.5), tree.Step(winsorize, x),
+                       kTolerance);
+      ExpectSameValues(Winsorize(Demean(x), 3.0), tree.Step(demeaned, x),
+                       kTolerance);
+    }
+  }
+}
+
+// 只有少数几个不同的值, 常数截面(标准差为0时截断到均值), 全nan和只有
+// 一个有效值的截面
+TEST(CsWinsorizeTest, DuplicatesAndAllNaN) {
+  const size_t n = 500;
+  NormTree tree(n, 1);
+  auto op = tree.Add<CsWinsorize>({Arg(tree.input), Arg(1.0)});
+  std::mt19937 gen(4);
+  auto x = Tensor::from_shape({n});
+  for (size_t i = 0; i < n; ++i) {
+    x(i) = gen() % 4 == 0 ? kNaN : static_cast<double>(gen() % 3) * 10;
+  }
+  x(0) = 1000.0;
+  ExpectSameValues(Winsorize(x, 1.0), tree.Step(op, x), kTolerance);
+  std::fill(x.begin(), x.end(), 2.0);
+  ExpectSameValues(x, tree.Step(op, x), kTolerance);
+  std::fill(x.begin(), x.end(), kNaN);
+  ExpectSameValues(x, tree.Step(op, x));
+  x(7) = 5.0;
+  ExpectSameValues(x, tree.Step(op, x));
+}
+
+// 嵌套的临时节点只有一个消费者, 整条链合并为一个节点, 直接读@x
+TEST(FuseCsNormalizeTest, FusesSingleConsumerChain) {
+  const size_t n = kCsBlockSize + 50;
+  for (size_t threads : {1, 4}) {
+    NormTree tree(n, threads);
+    auto root = tree.Add<CsZscore>({Arg(tree.Add<CsWinsorize>(
+        {Arg(tree.Add<CsDemean>({Arg(tree.input)})), Arg(3)}))});
+    const std::string expr = root->ToString();
+    FuseCsNormalize(root);
+    EXPECT_EQ(AsNorm(root).GetSteps().size(), 3u);
+    EXPECT_EQ(AsNorm(root).GetChild(), tree.input);
+    EXPECT_EQ(root->GetChilds(), std::vector<OperatorPtr>{tree.input});
+    EXPECT_EQ(root->ToString(), expr);
+    std::mt19937 gen(8);
+    for (int batch = 0; batch < 2; ++batch) {
+      auto x = HeavyTail(n, gen);
+      ExpectSameValues(Zscore(Winsorize(Demean(x), 3.0)), tree.Step(root, x),
+                       kTolerance);
+    }
+  }
+}
+
+// 共享的内层节点照常输出, 外层在它的结果上计算; 再往外只有一个消费者的
+// 节点仍然合并
+TEST(FuseCsNormalizeTest, KeepsSharedChild) {
+  const size_t n = 300;
+  NormTree tree(n, 1);
+  auto shared = tree.Add<CsDemean>({Arg(tree.input)});
+  auto position = tree.Add<CsPosition>({Arg(tree.Add<CsZscore>(
+      {Arg(shared)}))});
+  auto root = tree.Add<CsOLSRes>({Arg(position), Arg(shared)});
+  FuseCsNormalize(root);
+  EXPECT_EQ(AsNorm(position).GetSteps().size(), 2u);
+  EXPECT_EQ(AsNorm(position).GetChild(), shared);
+  EXPECT_EQ(AsNorm(shared).GetChild(), tree.input);
+  std::mt19937 gen(12);
+  auto x = HeavyTail(n, gen);
+  tree.Step(root, x);
+  ExpectSameValues(Position(Zscore(Demean(x))),
+                   position->GetResult(tree.next_idx - 1).GetTensor(),
+                   kTolerance);
+  ExpectSameValues(Demean(x),
+                   shared->GetResult(tree.next_idx - 1).GetTensor(),
+                   kTolerance);
+}
+
+TEST(CsWinsorizeTest, RejectsBadArguments) {
+  NormTree tree(4, 1);
+  EXPECT_THROW(tree.Add<CsWinsorize>({Arg(tree.input)}),
+               std::invalid_argument);
+  EXPECT_THROW(
+      tree.Add<CsWinsorize>({Arg(tree.input), Arg(std::string("6"))}),
+      std::invalid_argument);
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,297 @@
+// 基数排序和分块并行归并的截面排名与std::sort排序后的平均排名相同,
+// 包括并列、nan、±0和±inf, 截面跨越多个kCsBlockSize块;
+// 多路nth_element的分位点与全排序后取分位点相同; 截面回归按块统计后合并,
+// 串行与并行都与两遍计算的回归相同
+#include "factor_tree/operators/csoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::CsOLSRes;
+using header_ops::CsQuantilize;
+using header_ops::CsRank;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+constexpr double kInf = std::numeric_limits<double>::infinity();
+
+// 单个截面算子的树; threads大于1时按块并行, params为算子的其余参数
+struct CsTree {
+  InitArgsPtr config;
+  std::shared_ptr<InputOp> x;
+  OperatorPtr op;
+  RequestIdx next_idx = 1;
+
+  template <typename Op>
+  static CsTree Make(size_t nstock, size_t threads,
+                     const std::vector<Arg> &params = {}) {
+    CsTree tree;
+    tree.config = std::make_shared<InitArgs>(nstock);
+    auto context = GetTreeContext(tree.config);
+    context->cs_parallel_threads = threads;
+    context->cs_parallel_threshold = 1;
+    tree.x = std::make_shared<InputOp>("@x", OpInitArgs{0, tree.config});
+    OperatorPtr input = tree.x;
+    std::vector<Arg> args = {Arg(input)};
+    args.insert(args.end(), params.begin(), params.end());
+    tree.op = Op::Create(args, OpInitArgs{1, tree.config});
+    return tree;
+  }
+
+  Tensor Step(const Tensor &values) {
+    x->Feed(next_idx, values);
+    return op->GetResult(next_idx++).GetTensor();
+  }
+};
+
+// 按值排序后并列取平均排名, 缩放到[-0.5, 0.5]
+Tensor SortRank(const Tensor &x) {
+  std::vector<size_t> order;
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (!std::isnan(x(i))) {
+      order.push_back(i);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&x](size_t a, size_t b) { return x(a) < x(b); });
+  auto out = Tensor::from_shape({x.size()});
+  std::fill(out.begin(), out.end(), kNaN);
+  const size_t n = order.size();
+  const double scale = n > 1 ? 1.0 / static_cast<double>(n - 1) : 0.0;
+  for (size_t begin = 0; begin < n;) {
+    size_t end = begin;
+    while (end < n && x(order[end]) == x(order[begin])) {
+      ++end;
+    }
+    double rank = n == 1 ? 0.0
+                         : 0.5 * static_cast<double>(begin + end - 1) * scale -
+                               0.5;
+    for (size_t j = begin; j < end; ++j) {
+      out(order[j]) = rank;
+    }
+    begin = end;
+  }
+  return out;
+}
+
+// 大量并列值和特殊值; 第二块全为nan, 并行归并时有空段
+Tensor Values(size_t n, unsigned seed) {
+  const double specials[] = {-kInf, kInf, -0.0, 0.0, kNaN, 1.0, -1.0};
+  std::mt19937 gen(seed);
+  std::normal_distribution<double> dist(0.0, 1.0);
+  auto values = Tensor::from_shape({n});
+  for (size_t i = 0; i < n; ++i) {
+    if (i >= kCsBlockSize && i < 2 * kCsBlockSize) {
+      values(i) = kNaN;
+    } else if (gen() % 3 == 0) {
+      values(i) = specials[gen() % 7];
+    } else if (gen() % 2 == 0) {
+      values(i) = static_cast<double>(gen() % 50) / 8;
+    } else {
+      values(i) = dist(gen);
+    }
+  }
+  return values;
+}
+
+// 全排序后第k * n / bins个值为第k个分位点, 不小于它的x落入第k组及以上
+Tensor SortQuantilize(const Tensor &x, int bins) {
+  std::vector<double> sorted;
+  for (double v : x) {
+    if (!std::isnan(v)) {
+      sorted.push_back(v);
+    }
+  }
+  std::sort(sorted.begin(), sorted.end());
+  const size_t n = sorted.size();
+  auto out = Tensor::from_shape({x.size()});
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (std::isnan(x(i))) {
+      out(i) = kNaN;
+      continue;
+    }
+    int group = 0;
+    for (int k = 1; k < bins; ++k) {
+      if (x(i) >= sorted[static_cast<size_t>(k) * n / bins]) {
+        group = k;
+      }
+    }
+    out(i) = group;
+  }
+  return out;
+}
+
+TEST(CsRankTest, SerialAndParallelMatchSortedRank) {
+  const size_t n = 3 * kCsBlockSize + 517;
+  auto serial = CsTree::Make<CsRank>(n, 1);
+  auto parallel = CsTree::Make<CsRank>(n, 4);
+  for (unsigned seed = 1; seed <= 3; ++seed) {
+    auto x = Values(n, seed);
+    auto expected = SortRank(x);
+    SCOPED_TRACE("seed " + std::to_string(seed));
+    ExpectSameValues(expected, serial.Step(x));
+    ExpectSameValues(expected, parallel.Step(x));
+  }
+}
+
+TEST(CsRankTest, SmallCrossSections) {
+  auto tree = CsTree::Make<CsRank>(4, 1);
+  Tensor x = {kNaN, kNaN, kNaN, kNaN};
+  ExpectSameValues(x, tree.Step(x));
+  x = {kNaN, 2.0, kNaN, kNaN};
+  ExpectSameValues(Tensor{kNaN, 0.0, kNaN, kNaN}, tree.Step(x));
+  x = {-0.0, 0.0, -kInf, kInf};
+  ExpectSameValues(SortRank(x), tree.Step(x));
+}
+
+// 两遍计算x, y均非nan的标的上的回归, 返回 y - (a + b * x)
+Tensor TwoPassOLSRes(const Tensor &x, const Tensor &y) {
+  double sx = 0.0;
+  double sy = 0.0;
+  size_t n = 0;
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (!std::isnan(x(i)) && !std::isnan(y(i))) {
+      sx += x(i);
+      sy += y(i);
+      ++n;
+    }
+  }
+  const double mx = sx / static_cast<double>(n);
+  const double my = sy / static_cast<double>(n);
+  double sxx = 0.0;
+  double sxy = 0.0;
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (!std::isnan(x(i)) && !std::isnan(y(i))) {
+      sxx += (x(i) - mx) * (x(i) - mx);
+      sxy += (x(i) - mx) * (y(i) - my);
+    }
+  }
+  auto out = Tensor::from_shape({x.size()});
+  const bool valid = n > 1 && sxx >= kEpsilon;
+  const double beta = valid ? sxy / sxx : kNaN;
+  const double alpha = valid ? my - beta * mx : kNaN;
+  for (size_t i = 0; i < x.size(); ++i) {
+    out(i) = y(i) - (alpha + beta * x(i));
+  }
+  return out;
+}
+
+// cs_ols_res(@x, @y), threads大于1时按块并行
+struct OLSTree {
+  InitArgsPtr config;
+  std::shared_ptr<InputOp> x;
+  std::shared_ptr<InputOp> y;
+  OperatorPtr op;
+  RequestIdx next_idx = 1;
+
+  OLSTree(size_t nstock, size_t threads)
+      : config(std::make_shared<InitArgs>(nstock)) {
+    auto context = GetTreeContext(config);
+    context->cs_parallel_threads = threads;
+    context->cs_parallel_threshold = 1;
+    x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+    y = std::make_shared<InputOp>("@y", OpInitArgs{1, config});
+    OperatorPtr left = x;
+    OperatorPtr right = y;
+    op = CsOLSRes::Create({Arg(left), Arg(right)}, OpInitArgs{2, config});
+  }
+
+  Tensor Step(const Tensor &xs, const Tensor &ys) {
+    x->Feed(next_idx, xs);
+    y->Feed(next_idx, ys);
+    return op->GetResult(next_idx++).GetTensor();
+  }
+};
+
+TEST(CsOLSResTest, SerialAndParallelMatchTwoPass) {
+  const size_t n = 3 * kCsBlockSize + 517;
+  OLSTree serial(n, 1);
+  OLSTree parallel(n, 4);
+  std::mt19937 gen(13);
+  std::normal_distribution<double> dist(0.0, 1.0);
+  auto x = Tensor::from_shape({n});
+  auto y = Tensor::from_shape({n});
+  for (int batch = 0; batch < 3; ++batch) {
+    for (size_t i = 0; i < n; ++i) {
+      //   第二块x全为nan, 并行合并时有空块
+      x(i) = (i >= kCsBlockSize && i < 2 * kCsBlockSize) || gen() % 9 == 0
+                 ? kNaN
+                 : 100.0 + dist(gen);
+      y(i) = gen() % 7 == 0 ? kNaN : 0.5 * x(i) + dist(gen);
+    }
+    auto expected = TwoPassOLSRes(x, y);
+    auto serial_res = serial.Step(x, y);
+    SCOPED_TRACE("batch " + std::to_string(batch));
+    ExpectSameValues(expected, serial_res, 1e-9);
+    //   分块方式与线程数无关, 并行与串行逐位相同
+    ExpectSameValues(serial_res, parallel.Step(x, y));
+  }
+}
+
+// 有效值少于2个或x没有波动时为nan
+TEST(CsOLSResTest, DegenerateCrossSections) {
+  OLSTree tree(4, 1);
+  Tensor all_nan = {kNaN, kNaN, kNaN, kNaN};
+  ExpectSameValues(all_nan, tree.Step(Tensor{1.0, kNaN, 3.0, kNaN},
+                                      Tensor{kNaN, 2.0, 1.0, 5.0}));
+  ExpectSameValues(all_nan, tree.Step(Tensor{2.0, 2.0, 2.0, 2.0},
+                                      Tensor{1.0, 2.0, 3.0, 4.0}));
+  ExpectSameValues(Tensor{0.0, 0.0, 0.0, kNaN},
+                   tree.Step(Tensor{1.0, 2.0, 3.0, 4.0},
+                             Tensor{3.0, 5.0, 7.0, kNaN}),
+                   1e-12);
+}
+
+TEST(CsQuantilizeTest, MatchesSortedQuantiles) {
+  const size_t n = 3 * kCsBlockSize + 517;
+  for (int bins : {1, 2, 5, 10, 64}) {
+    auto tree = CsTree::Make<CsQuantilize>(n, 1, {Arg(bins)});
+    for (unsigned seed = 1; seed <= 2; ++seed) {
+      auto x = Values(n, seed);
+      SCOPED_TRACE("bins " + std::to_string(bins) + " seed " +
+                   std::to_string(seed));
+      ExpectSameValues(SortQuantilize(x, bins), tree.Step(x));
+    }
+  }
+}
+
+// 大量重复值时同值落入同一组, 组数可能少于bins; 全nan时输出全nan
+TEST(CsQuantilizeTest, DuplicatesAndAllNaN) {
+  const size_t n = 1000;
+  auto tree = CsTree::Make<CsQuantilize>(n, 1, {Arg(10)});
+  std::mt19937 gen(7);
+  auto x = Tensor::from_shape({n});
+  for (size_t i = 0; i < n; ++i) {
+    x(i) = gen() % 5 == 0 ? kNaN : static_cast<double>(gen() % 3);
+  }
+  ExpectSameValues(SortQuantilize(x, 10), tree.Step(x));
+  std::fill(x.begin(), x.end(), 1.5);
+  ExpectSameValues(SortQuantilize(x, 10), tree.Step(x));
+  std::fill(x.begin(), x.end(), kNaN);
+  ExpectSameValues(x, tree.Step(x));
+  x(3) = -2.0;
+  ExpectSameValues(SortQuantilize(x, 10), tree.Step(x));
+}
+
+TEST(CsQuantilizeTest, RejectsBadArguments) {
+  EXPECT_THROW(CsTree::Make<CsQuantilize>(4, 1, {Arg(0)}),
+               std::invalid_argument);
+  EXPECT_THROW(CsTree::Make<CsQuantilize>(4, 1, {Arg(2.5)}),
+               std::invalid_argument);
+}
+
+} // namespace
+} // namespace factor_tree
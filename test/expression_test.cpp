@@ -0,0 +1,70 @@
+// 表达式规范化的改写结果
+#include "factor_tree/expression.h"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace factor_tree {
+namespace {
+
+TEST(CanonicalizeTest, RemovesIdentities) {
+  EXPECT_EQ(CanonicalizeExpression("add(@x,#0.0)"), "@x");
+  EXPECT_EQ(CanonicalizeExpression("subtract(@x,#0)"), "@x");
+  EXPECT_EQ(CanonicalizeExpression("multiply(#1,@x)"), "@x");
+  EXPECT_EQ(CanonicalizeExpression("divide(@x,#1)"), "@x");
+  EXPECT_EQ(CanonicalizeExpression("null(@x)"), "@x");
+  EXPECT_EQ(CanonicalizeExpression("minus(minus(add(@x,#0)))"), "@x");
+  EXPECT_EQ(CanonicalizeExpression("abs(abs(@x))"), "abs(@x)");
+  EXPECT_EQ(CanonicalizeExpression("relu(relu(@x))"), "relu(@x)");
+  EXPECT_EQ(CanonicalizeExpression("sign(sign(@x))"), "sign(@x)");
+}
+
+TEST(CanonicalizeTest, MergesTrivialWindows) {
+  for (const char *name : {"ts_mean", "ts_min", "ts_max", "in_ts_mean"}) {
+    EXPECT_EQ(CanonicalizeExpression(std::string(name) + "(@x,1)"), "@x");
+  }
+  EXPECT_EQ(CanonicalizeExpression("ts_delay(@x,0)"), "@x");
+  EXPECT_EQ(CanonicalizeExpression("ts_delay(ts_delay(@x,2),3)"),
+            "ts_delay(@x,5)");
+}
+
+// nan窗口的ts_sum为0, 与x不同
+TEST(CanonicalizeTest, KeepsTsSum) {
+  EXPECT_EQ(CanonicalizeExpression("ts_sum(@x,1)"), "ts_sum(@x,1)");
+}
+
+TEST(CanonicalizeTest, SortsCommutativeArgs) {
+  EXPECT_EQ(CanonicalizeExpression("add(@b,@a)"), "add(@a,@b)");
+  EXPECT_EQ(CanonicalizeExpression("ts_corr(@y,@x,5)"), "ts_corr(@x,@y,5)");
+  EXPECT_EQ(CanonicalizeExpression("subtract(@b,@a)"), "subtract(@b,@a)");
+}
+
+TEST(CombExpanderTest, ExpandsNestedTemplates) {
+  CombExpander expander;
+  expander.Register("ts_squaremean", "ts_mean(power2(@child_data),{param})");
+  expander.Register("ts_wave", "divide(ts_squaremean(ts_diff(@child_data,1),"
+                               "{param}),ts_squaremean(@child_data,{param}))");
+  expander.Register("ts_conv", "ts_mean(multiply(@child_data1,@child_data2),"
+                               "{param})");
+  EXPECT_EQ(expander.Expand("ts_wave(abs(@x),5)"),
+            "divide(ts_mean(power2(ts_diff(abs(@x),1)),5),"
+            "ts_mean(power2(abs(@x)),5))");
+  EXPECT_EQ(expander.Expand("ts_conv(@x,@y,3)"),
+            "ts_mean(multiply(@x,@y),3)");
+  EXPECT_THROW(expander.Expand("ts_conv(@x,3)"), std::invalid_argument);
+}
+
+TEST(CombExpanderTest, InlineNeedsTemplates) {
+  BuildOptions options;
+  options.inline_combined_ops = true;
+  EXPECT_THROW(PrepareExpression("ts_rs(@x,5)", options),
+               std::invalid_argument);
+  CombExpander expander;
+  EXPECT_EQ(PrepareExpression("ts_rs(@x,5)", options, &expander),
+            "ts_rs(@x,5)");
+}
+
+} // namespace
+} // namespace factor_tree
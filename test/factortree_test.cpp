@@ -0,0 +1,111 @@
+// FactorTree中不依赖库的部分
+#include "factor_tree/factortree.h"
+#include "factor_tree/operators/aggregateoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <xtensor/xadapt.hpp>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::AdMean;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+TEST(UpdateBuffersTest, ReusesTensors) {
+  std::vector<double> x{1, 2, 3};
+  std::vector<double> y{4, 5, 6};
+  UpdateBuffers buffers;
+  std::unordered_map<std::string, const double *> data{{"x", x.data()},
+                                                       {"y", y.data()}};
+  const auto &first = buffers.Fill(data, 3);
+  const double *x_buffer = first.at("x")->data();
+  EXPECT_EQ((*first.at("y"))(2), 6.0);
+
+  x[0] = 10;
+  const auto &second = buffers.Fill(data, 3);
+  EXPECT_EQ(second.at("x")->data(), x_buffer);
+  EXPECT_EQ((*second.at("x"))(0), 10.0);
+}
+
+TEST(UpdateBuffersTest, FollowsFieldChanges) {
+  std::vector<double> x{1, 2, 3};
+  UpdateBuffers buffers;
+  buffers.Fill({{"x", x.data()}, {"y", x.data()}}, 3);
+  //   字段减少时不能把过期的字段传给Update
+  const auto &tensors = buffers.Fill({{"x", x.data()}}, 3);
+  EXPECT_EQ(tensors.size(), 1u);
+  EXPECT_EQ(buffers.Fill({{"x", x.data()}}, 2).at("x")->size(), 2u);
+}
+
+// 记录换日(B/E)和每行的tidx
+struct DayLog {
+  std::string events;
+  void OnDayBegin() { events += "B"; }
+  void OnDayEnd() { events += "E"; }
+};
+
+TEST(RunBlockRowsTest, ResetsTidxAtDayStarts) {
+  DayLog days;
+  auto log_tidx = [&days](size_t, size_t tidx) {
+    days.events += std::to_string(tidx);
+  };
+  //   前两行属于进行中的一天, tidx从3开始
+  RunBlockRows(days, 7, {2, 5}, 3, true, log_tidx);
+  EXPECT_EQ(days.events, "34EB012EB01E");
+  days.events.clear();
+  //   第0行换日时不先收尾, close_day为false时最后不收尾
+  RunBlockRows(days, 3, {0}, 7, false, log_tidx);
+  EXPECT_EQ(days.events, "B012");
+}
+
+TEST(RunBlockRowsTest, RejectsBadDayStarts) {
+  DayLog days;
+  size_t calls = 0;
+  auto count = [&calls](size_t, size_t) { ++calls; };
+  for (const auto &day_starts : std::vector<std::vector<size_t>>{
+           {3, 3}, {2, 1}, {5}}) {
+    EXPECT_THROW(RunBlockRows(days, 5, day_starts, 0, true, count),
+                 std::invalid_argument);
+  }
+  EXPECT_EQ(calls, 0u);
+  EXPECT_TRUE(days.events.empty());
+}
+
+// 手工组装的ad_mean(@x, 2)按RunBlockRows给出的tidx取时间槽: 每天3行,
+// 第r行的值为r, 分两块计算, 第二天跨越两块
+TEST(RunBlockRowsTest, AdMeanFollowsTidxAcrossBlocks) {
+  auto config = std::make_shared<InitArgs>(2, 3);
+  auto context = GetTreeContext(config);
+  auto x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+  OperatorPtr input = x;
+  auto mean = AdMean::Create({Arg(input), Arg(2)}, OpInitArgs{1, config});
+  DayCycle days(mean);
+  RequestIdx idx = 1;
+  std::vector<double> results;
+  auto update = [&](size_t first_row) {
+    return [&, first_row](size_t r, size_t tidx) {
+      ScopedValue<size_t> scoped_tidx(context->tidx, tidx);
+      const double value = static_cast<double>(first_row + r);
+      x->Feed(idx, Tensor{value, value});
+      results.push_back(mean->GetResult(idx++).GetTensor()(0));
+    };
+  };
+  RunBlockRows(days, 5, {0, 3}, 0, false, update(0));
+  RunBlockRows(days, 4, {1}, 2, true, update(5));
+  //   第一天为当天的值, 之后为同一时间槽前一天与当天的平均
+  std::vector<double> expected{0, 1, 2, 1.5, 2.5, 3.5, 4.5, 5.5, 6.5};
+  ExpectSameValues(Tensor(xt::adapt(expected)),
+                   Tensor(xt::adapt(results)));
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,55 @@
+// 组合算子展开前后的两棵树逐批次结果相同
+// 需要链接FactorTree
+#include "factor_tree/factortree.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace factor_tree {
+namespace {
+
+using testing::ExpectSameTrees;
+
+constexpr size_t kNstock = 6;
+constexpr size_t kBatchPerDay = 8;
+
+TEST(LibraryCombExpanderTest, ProbesLibraryTemplates) {
+  const CombExpander &expander = LibraryCombExpander();
+  EXPECT_TRUE(expander.Contains("ts_rs"));
+  EXPECT_TRUE(expander.Contains("ts_conv"));
+  //   展开结果只含基础算子
+  std::string expanded = expander.Expand("ts_wave(@x,5)");
+  EXPECT_EQ(expanded.find("ts_wave"), std::string::npos);
+  EXPECT_EQ(expanded.find("ts_squaremean"), std::string::npos);
+}
+
+class InlineCombTest : public ::testing::TestWithParam<const char *> {};
+
+TEST_P(InlineCombTest, SameResults) {
+  const std::string expression = GetParam();
+  InitArgs args(kNstock);
+  args.batch_per_day = kBatchPerDay;
+  FactorTree plain(args);
+  plain.CreateTree(expression);
+  FactorTree inlined(args);
+  BuildOptions options;
+  options.inline_combined_ops = true;
+  inlined.CreateTree(expression, options);
+  ASSERT_NE(plain.ToString(), inlined.ToString());
+  ExpectSameTrees(plain, inlined, {"x", "y"}, kNstock, kBatchPerDay);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    CombOps, InlineCombTest,
+    ::testing::Values("ts_meanstd(@x,3)", "ts_squaremean(@x,3)",
+                      "ts_autocorr(@x,4)", "ts_rs(@x,3)", "ts_rsi(@x,3)",
+                      "ts_wave(@x,3)", "ts_gammaalpha(@x,3)",
+                      "ts_gammabeta(@x,3)", "ts_downvarpct(@x,3)",
+                      "ts_min_max_cps(@x,3)", "ts_conv(@x,@y,3)",
+                      "ts_twapywap(@x,@y,3)",
+                      "add(ts_rs(@x,5),add(ts_rsi(@x,5),ts_diff(@x,1)))"));
+
+} // namespace
+} // namespace factor_tree
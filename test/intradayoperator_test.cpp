@@ -0,0 +1,109 @@
+// 日内算子换日时不清空状态, 每个标的在当天第一次Update时才按day_epoch重置
+#include "factor_tree/operators/intradayoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::InTsEma;
+using header_ops::InTsMean;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+constexpr size_t kNstock = 3;
+
+// in_ts_*(@x, 3)的单节点树, 逐批次输入
+template <typename Op> struct IntradayTree {
+  InitArgsPtr config = std::make_shared<InitArgs>(kNstock, 4);
+  std::shared_ptr<InputOp> x;
+  std::shared_ptr<Op> op;
+  RequestIdx next_idx = 1;
+
+  IntradayTree() {
+    x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+    OperatorPtr input = x;
+    op = std::dynamic_pointer_cast<Op>(
+        Op::Create({Arg(input), Arg(3)}, OpInitArgs{1, config}));
+  }
+
+  Tensor Step(const Tensor &values) {
+    x->Feed(next_idx, values);
+    return op->GetResult(next_idx++).GetTensor();
+  }
+};
+
+Tensor Filled(double value) {
+  auto values = Tensor::from_shape({kNstock});
+  std::fill(values.begin(), values.end(), value);
+  return values;
+}
+
+TEST(IntradayLanesTest, ResetsOnFirstUpdateOfTheDay) {
+  IntradayTree<InTsMean> tree;
+  DayCycle days(tree.op);
+  days.OnDayBegin();
+  tree.Step(Filled(1.0));
+  tree.Step(Filled(3.0));
+  days.OnDayEnd();
+  days.OnDayBegin();
+  //   换日只递增day_epoch, 前一天的累计值还在, 没有被遍历清空
+  auto &state = tree.op->GetState();
+  EXPECT_EQ(state.valid_count[0], 2);
+  EXPECT_DOUBLE_EQ(state.sum[0], 4.0);
+  for (size_t i = 0; i < kNstock; ++i) {
+    EXPECT_NE(state.lanes.lane_epoch[i], state.lanes.context->day_epoch);
+  }
+  ExpectSameValues(Filled(5.0), tree.Step(Filled(5.0)));
+  EXPECT_EQ(state.valid_count[0], 1);
+  ExpectSameValues(Filled(6.0), tree.Step(Filled(7.0)));
+}
+
+// 几天没有Update的标的只在再次Update时重置一次
+TEST(IntradayLanesTest, ResetsLaneSkippedForSeveralDays) {
+  IntradayTree<InTsEma> tree;
+  DayCycle days(tree.op);
+  days.OnDayBegin();
+  tree.Step(Filled(2.0));
+  for (int day = 0; day < 3; ++day) {
+    days.OnDayEnd();
+    days.OnDayBegin();
+  }
+  EXPECT_DOUBLE_EQ(tree.op->GetState().ema[0], 2.0);
+  auto x = Filled(4.0);
+  x(1) = kNaN;
+  auto expected = Filled(4.0);
+  expected(1) = kNaN;
+  ExpectSameValues(expected, tree.Step(x));
+  //   alpha = 2 / (1 + 3) = 0.5, 当天第一个观测作为初值
+  expected = Filled(5.0);
+  expected(1) = 6.0;
+  ExpectSameValues(expected, tree.Step(Filled(6.0)));
+}
+
+// 普通拷贝跟随树的TreeContext, Snapshot固定拷贝时的day_epoch
+TEST(IntradayLanesTest, SnapshotKeepsDayEpoch) {
+  IntradayTree<InTsMean> tree;
+  DayCycle days(tree.op);
+  days.OnDayBegin();
+  tree.Step(Filled(1.0));
+  const auto &lanes = tree.op->GetState().lanes;
+  IntradayLanes copy = lanes;
+  IntradayLanes snapshot = lanes.Snapshot();
+  const size_t epoch = lanes.context->day_epoch;
+  days.OnDayEnd();
+  days.OnDayBegin();
+  EXPECT_EQ(copy.context, lanes.context);
+  EXPECT_EQ(copy.context->day_epoch, epoch + 1);
+  EXPECT_EQ(snapshot.context->day_epoch, epoch);
+  EXPECT_EQ(snapshot.lane_epoch, lanes.lane_epoch);
+  EXPECT_FALSE(snapshot.Stale(0));
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,159 @@
+// CreateTree建出的树经按节点的checkpoint、mmap格式和增量保存、加载后,
+// 与一直运行的树结果相同; 按子表达式保存时只有整个表达式一个键
+// 库中编译的算子不登记子节点, 整棵树作为根节点一项保存
+// 需要链接FactorTree
+#include "factor_tree/factortree.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+namespace factor_tree {
+namespace {
+
+using testing::ExpectSameValues;
+
+constexpr size_t kNstock = 6;
+constexpr size_t kBatchPerDay = 5;
+constexpr const char *kExpression =
+    "add(ts_mean(@x,3),multiply(ts_mean(@x,3),ts_std(@y,4)))";
+
+InitArgs Args() {
+  InitArgs args(kNstock);
+  args.batch_per_day = kBatchPerDay;
+  return args;
+}
+
+std::unordered_map<std::string, TensorPtr> RandomData(std::mt19937 &gen) {
+  std::normal_distribution<double> dist(0.0, 1.0);
+  std::unordered_map<std::string, TensorPtr> data;
+  for (const char *field : {"x", "y"}) {
+    auto x = std::make_shared<Tensor>(Tensor::from_shape({kNstock}));
+    for (auto &v : *x) {
+      v = gen() % 5 == 0 ? kNaN : dist(gen);
+    }
+    data.emplace(field, std::move(x));
+  }
+  return data;
+}
+
+// 两棵树输入相同的数据, 逐批次结果相同
+void ExpectSameRun(FactorTree &expected, FactorTree &actual, size_t batches,
+                   std::mt19937 &gen) {
+  for (size_t batch = 0; batch < batches; ++batch) {
+    auto data = RandomData(gen);
+    SCOPED_TRACE("batch " + std::to_string(batch));
+    ExpectSameValues(*expected.Update(data), *actual.Update(data));
+  }
+}
+
+TEST(LibraryCheckpointTest, DagCheckpointRoundTrip) {
+  const std::string filename = "library_dag_checkpoint.bin";
+  FactorTree running(Args());
+  running.CreateTree(kExpression);
+  //   库中的算子没有DagOp, 只有根节点一项
+  EXPECT_EQ(CollectStatefulOps(running.GetRoot()).size(), 1u);
+  std::mt19937 gen(5);
+  for (size_t batch = 0; batch < 7; ++batch) {
+    running.Update(RandomData(gen));
+  }
+  running.SaveDagCheckpoint(filename);
+
+  FactorTree restored(Args());
+  restored.CreateTree(kExpression);
+  restored.LoadDagCheckpoint(filename);
+  ExpectSameRun(running, restored, 6, gen);
+  std::remove(filename.c_str());
+}
+
+// mmap格式同样只有根节点一项, nthread大于1时结果不变
+TEST(LibraryCheckpointTest, MappedCheckpointRoundTrip) {
+  const std::string filename = "library_mapped_checkpoint.bin";
+  FactorTree running(Args());
+  running.CreateTree(kExpression);
+  std::mt19937 gen(6);
+  for (size_t batch = 0; batch < 7; ++batch) {
+    running.Update(RandomData(gen));
+  }
+  running.SaveMappedCheckpoint(filename, 4);
+  EXPECT_EQ(MappedCheckpointReader(filename).Header().count, 1u);
+
+  FactorTree restored(Args());
+  restored.CreateTree(kExpression);
+  restored.LoadMappedCheckpoint(filename, 4);
+  ExpectSameRun(running, restored, 6, gen);
+  std::remove(filename.c_str());
+}
+
+// 基准之后再运行几个批次保存增量, 合并为新基准, 从增量和新基准恢复都与
+// 一直运行的树相同
+TEST(LibraryCheckpointTest, DeltaAndCompactRoundTrip) {
+  const std::string base = "library_delta_base.bin";
+  const std::string delta = "library_delta.bin";
+  const std::string compact = "library_delta_compact.bin";
+  FactorTree running(Args());
+  running.CreateTree(kExpression);
+  std::mt19937 gen(7);
+  for (size_t batch = 0; batch < 7; ++batch) {
+    running.Update(RandomData(gen));
+  }
+  running.SaveMappedCheckpoint(base);
+  for (size_t batch = 0; batch < 4; ++batch) {
+    running.Update(RandomData(gen));
+  }
+  running.SaveDeltaCheckpoint(base, delta);
+  CompactCheckpoint(base, delta, compact);
+
+  FactorTree from_delta(Args());
+  from_delta.CreateTree(kExpression);
+  from_delta.LoadDeltaCheckpoint(base, delta);
+  FactorTree from_compact(Args());
+  from_compact.CreateTree(kExpression);
+  from_compact.LoadMappedCheckpoint(compact);
+  for (size_t batch = 0; batch < 6; ++batch) {
+    auto data = RandomData(gen);
+    SCOPED_TRACE("batch " + std::to_string(batch));
+    auto expected = *running.Update(data);
+    ExpectSameValues(expected, *from_delta.Update(data));
+    ExpectSameValues(expected, *from_compact.Update(data));
+  }
+  for (const auto &filename : {base, delta, compact}) {
+    std::remove(filename.c_str());
+  }
+}
+
+// 按子表达式保存时只有整个表达式一个键: 表达式不变时恢复根节点,
+// 修改后即使ts_mean(@x,3)相同也不能复用, 整棵树为cold节点
+TEST(LibraryCheckpointTest, SubtreeCheckpointHasOneKey) {
+  const std::string filename = "library_subtree_checkpoint.bin";
+  FactorTree running(Args());
+  running.CreateTree(kExpression);
+  std::mt19937 gen(8);
+  for (size_t batch = 0; batch < 7; ++batch) {
+    running.Update(RandomData(gen));
+  }
+  running.SaveSubtreeCheckpoint(filename);
+
+  FactorTree same(Args());
+  same.CreateTree(kExpression);
+  auto result = same.LoadSubtreeCheckpoint(filename);
+  EXPECT_EQ(result.restored, 1u);
+  EXPECT_TRUE(result.cold.empty());
+  ExpectSameRun(running, same, 6, gen);
+
+  FactorTree changed(Args());
+  changed.CreateTree("add(ts_mean(@x,3),ts_std(@y,4))");
+  result = changed.LoadSubtreeCheckpoint(filename);
+  EXPECT_EQ(result.restored, 0u);
+  ASSERT_EQ(result.cold.size(), 1u);
+  EXPECT_EQ(result.cold[0], changed.GetRoot());
+  std::remove(filename.c_str());
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,96 @@
+// 同一段历史按分块和整段一个文件预热, 一天跨越分块时结果与不分块相同
+// 需要链接FactorTree
+#include "factor_tree/warmup.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <xtensor/xnpy.hpp>
+#include <xtensor/xtensor.hpp>
+#include <xtensor/xview.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+namespace fs = std::filesystem;
+using testing::ExpectSameValues;
+
+constexpr size_t kNstock = 4;
+constexpr size_t kBatchPerDay = 5;
+//   in_ts_mean在换日时重置, ad_mean按当天的批次序号取时间槽
+constexpr const char *kExpression = "add(in_ts_mean(@x,3),ad_mean(@x,2))";
+
+// 12行, 每天4到5行: day_starts = {0, 3, 7, 11}
+xt::xtensor<double, 2> RandomHistory(std::mt19937 &gen) {
+  std::normal_distribution<double> dist(0.0, 1.0);
+  auto values = xt::xtensor<double, 2>::from_shape({12, kNstock});
+  for (auto &v : values) {
+    v = dist(gen);
+  }
+  return values;
+}
+
+void DumpDayStarts(const fs::path &dir) {
+  std::vector<int64_t> starts{0, 3, 7, 11};
+  xt::dump_npy((dir / NpyHistory::kDayStartsFile).string(),
+               xt::xtensor<int64_t, 1>(xt::adapt(starts)));
+}
+
+TEST(LibraryWarmupTest, ChunksMatchSingleFile) {
+  const fs::path root = fs::path(::testing::TempDir()) / "library_warmup";
+  const fs::path single = root / "single";
+  const fs::path chunked = root / "chunked";
+  fs::remove_all(root);
+  fs::create_directories(single);
+  fs::create_directories(chunked / "x");
+  std::mt19937 gen(11);
+  auto history = RandomHistory(gen);
+  xt::dump_npy((single / "x.npy").string(), history);
+  //   5、4、3行: 第二、三天跨越分块
+  xt::dump_npy((chunked / "x" / "0.npy").string(),
+               xt::xtensor<double, 2>(xt::view(history, xt::range(0, 5))));
+  xt::dump_npy((chunked / "x" / "1.npy").string(),
+               xt::xtensor<double, 2>(xt::view(history, xt::range(5, 9))));
+  xt::dump_npy((chunked / "x" / "2.npy").string(),
+               xt::xtensor<double, 2>(xt::view(history, xt::range(9, 12))));
+  DumpDayStarts(single);
+  DumpDayStarts(chunked);
+
+  InitArgs args(kNstock, kBatchPerDay);
+  FactorTree expected(args);
+  expected.CreateTree(kExpression);
+  FactorTree actual(args);
+  actual.CreateTree(kExpression);
+  auto expected_report = WarmUp(expected, NpyHistory(single.string()));
+  auto actual_report = WarmUp(actual, NpyHistory(chunked.string()));
+  EXPECT_EQ(actual_report.rows, 12u);
+  EXPECT_EQ(actual_report.days, 4u);
+  EXPECT_EQ(expected_report.days, 4u);
+
+  //   预热之后的下一天逐批次结果相同
+  expected.OnDayBegin();
+  actual.OnDayBegin();
+  std::normal_distribution<double> dist(0.0, 1.0);
+  for (size_t batch = 0; batch < kBatchPerDay; ++batch) {
+    auto x = std::make_shared<xt::xtensor<double, 1>>(
+        xt::xtensor<double, 1>::from_shape({kNstock}));
+    for (auto &v : *x) {
+      v = dist(gen);
+    }
+    SCOPED_TRACE("batch " + std::to_string(batch));
+    ExpectSameValues(*expected.Update({{"x", x}}, batch),
+                     *actual.Update({{"x", x}}, batch));
+  }
+  fs::remove_all(root);
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,113 @@
+// 常量折叠和一侧为常量的二元算子, 标量节点与两侧都是变量时的结果相同
+#include "factor_tree/operators/mathoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::ConstantOp;
+using header_ops::GetConstantValue;
+using header_ops::MathAdd;
+using header_ops::MathBinaryOp;
+using header_ops::MathDivide;
+using header_ops::MathMultiply;
+using header_ops::MathScalarOp;
+using header_ops::MathSubtract;
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+constexpr size_t kNstock = 3;
+
+class MathOperatorTest : public ::testing::Test {
+protected:
+  OpInitArgs Next() { return OpInitArgs{next_id_++, config_}; }
+
+  OperatorPtr Constant(double value) {
+    return OperatorPtr(new ConstantOp(value, Next()));
+  }
+
+  InitArgsPtr config_ = std::make_shared<InitArgs>(kNstock);
+  OperatorId next_id_ = 0;
+};
+
+TEST_F(MathOperatorTest, FoldKeepsExpression) {
+  auto one = Constant(1);
+  auto three = Constant(3);
+  auto folded = MathDivide::Create({Arg(one), Arg(three)}, Next());
+  EXPECT_EQ(folded->GetType(), OperatorType::Constant);
+  EXPECT_EQ(folded->ToString(), "divide(#1,#3)");
+  double value = 0.0;
+  ASSERT_TRUE(GetConstantValue(folded, value));
+  EXPECT_DOUBLE_EQ(value, 1.0 / 3);
+
+  //   嵌套的常量子树逐层折叠, 父节点中保留原表达式
+  OperatorPtr x(new InputOp("@x", Next()));
+  auto nested = MathAdd::Create({Arg(folded), Arg(Constant(1))}, Next());
+  EXPECT_EQ(nested->ToString(), "add(divide(#1,#3),#1)");
+  auto scaled = MathMultiply::Create({Arg(x), Arg(nested)}, Next());
+  EXPECT_EQ(scaled->ToString(), "multiply(@x,add(divide(#1,#3),#1))");
+}
+
+TEST_F(MathOperatorTest, NoFoldForNonFinite) {
+  auto folded = MathDivide::Create({Arg(Constant(1)), Arg(Constant(0))},
+                                   Next());
+  EXPECT_NE(folded->GetType(), OperatorType::Constant);
+  EXPECT_EQ(folded->ToString(), "divide(#1,#0)");
+  auto out = folded->GetResult(1).GetTensor();
+  for (size_t i = 0; i < kNstock; ++i) {
+    EXPECT_TRUE(std::isnan(out(i)));
+  }
+}
+
+// 标量在左侧和右侧: 结果与逐元素的 c - x, x / c 相同, nan行仍为nan,
+// 除以很小的标量得到nan
+TEST_F(MathOperatorTest, ScalarOpValues) {
+  auto x = std::make_shared<InputOp>("@x", Next());
+  OperatorPtr input = x;
+  auto minus = MathSubtract::Create({Arg(Constant(1)), Arg(input)}, Next());
+  auto half = MathDivide::Create({Arg(input), Arg(Constant(2))}, Next());
+  auto tiny = MathDivide::Create({Arg(input), Arg(Constant(1e-12))}, Next());
+  using LeftSubtract = MathScalarOp<OperatorType::MathSubtract, true>;
+  using RightDivide = MathScalarOp<OperatorType::MathDivide, false>;
+  ASSERT_NE(dynamic_cast<LeftSubtract *>(minus.get()), nullptr);
+  ASSERT_NE(dynamic_cast<RightDivide *>(half.get()), nullptr);
+  EXPECT_EQ(minus->ToString(), "subtract(#1,@x)");
+  EXPECT_EQ(half->ToString(), "divide(@x,#2)");
+  EXPECT_EQ(minus->GetChilds(), std::vector<OperatorPtr>{input});
+
+  x->Feed(1, Tensor{3.0, kNaN, -0.5});
+  ExpectSameValues(Tensor{-2.0, kNaN, 1.5}, minus->GetResult(1).GetTensor());
+  ExpectSameValues(Tensor{1.5, kNaN, -0.25}, half->GetResult(1).GetTensor());
+  ExpectSameValues(Tensor{kNaN, kNaN, kNaN}, tiny->GetResult(1).GetTensor());
+  x->Feed(2, Tensor{kNaN, kNaN, kNaN});
+  ExpectSameValues(Tensor{kNaN, kNaN, kNaN}, minus->GetResult(2).GetTensor());
+  ExpectSameValues(Tensor{kNaN, kNaN, kNaN}, half->GetResult(2).GetTensor());
+}
+
+// 常量子节点换成变量输入时走MathBinaryOp, 结果与标量节点相同
+TEST_F(MathOperatorTest, ScalarOpMatchesBinaryOp) {
+  auto x = std::make_shared<InputOp>("@x", Next());
+  auto c = std::make_shared<InputOp>("@c", Next());
+  OperatorPtr input = x;
+  OperatorPtr constant = c;
+  auto scalar = MathSubtract::Create({Arg(Constant(1)), Arg(input)}, Next());
+  auto binary = MathSubtract::Create({Arg(constant), Arg(input)}, Next());
+  ASSERT_NE(
+      dynamic_cast<MathBinaryOp<OperatorType::MathSubtract> *>(binary.get()),
+      nullptr);
+  Tensor values = {0.25, kNaN, 1e300};
+  x->Feed(1, values);
+  c->Feed(1, Tensor{1.0, 1.0, 1.0});
+  ExpectSameValues(binary->GetResult(1).GetTensor(),
+                   scalar->GetResult(1).GetTensor());
+}
+
+} // namespace
+} // namespace factor_tree
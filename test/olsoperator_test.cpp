@@ -0,0 +1,290 @@
+// cs_ols_res_k与ts_ols_*_k与直接解正规方程的多元回归相同, 包括nan行、
+// 共线的x和有效行不足的情况; cs_ols_res_k串行与按块并行逐位相同
+#include "factor_tree/operators/olsoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using testing::ExpectSameValues;
+using testing::InputOp;
+
+constexpr size_t kK = 2;
+
+// 带截距的最小二乘: rows的每行为 (y, x1, ..., xk)
+// 中心化后用部分主元的高斯消元解 k x k 方程组, 返回 (a, b1..bk), 共线时为空
+std::vector<double> BruteOLS(const std::vector<std::vector<double>> &rows) {
+  const size_t k = rows[0].size() - 1;
+  const double n = static_cast<double>(rows.size());
+  std::vector<double> mean(k + 1, 0.0);
+  for (const auto &row : rows) {
+    for (size_t c = 0; c <= k; ++c) {
+      mean[c] += row[c] / n;
+    }
+  }
+  // 增广矩阵 [X'X | X'y]
+  std::vector<std::vector<double>> m(k, std::vector<double>(k + 1, 0.0));
+  for (const auto &row : rows) {
+    for (size_t a = 0; a < k; ++a) {
+      for (size_t b = 0; b < k; ++b) {
+        m[a][b] += (row[a + 1] - mean[a + 1]) * (row[b + 1] - mean[b + 1]);
+      }
+      m[a][k] += (row[a + 1] - mean[a + 1]) * (row[0] - mean[0]);
+    }
+  }
+  for (size_t j = 0; j < k; ++j) {
+    size_t pivot = j;
+    for (size_t i = j + 1; i < k; ++i) {
+      if (std::abs(m[i][j]) > std::abs(m[pivot][j])) {
+        pivot = i;
+      }
+    }
+    std::swap(m[j], m[pivot]);
+    if (std::abs(m[j][j]) < 1e-9) {
+      return {};
+    }
+    for (size_t i = 0; i < k; ++i) {
+      if (i == j) {
+        continue;
+      }
+      const double f = m[i][j] / m[j][j];
+      for (size_t c = j; c <= k; ++c) {
+        m[i][c] -= f * m[j][c];
+      }
+    }
+  }
+  std::vector<double> coef(k + 1);
+  coef[0] = mean[0];
+  for (size_t a = 0; a < k; ++a) {
+    coef[a + 1] = m[a][k] / m[a][a];
+    coef[0] -= coef[a + 1] * mean[a + 1];
+  }
+  return coef;
+}
+
+double Residual(const std::vector<double> &coef,
+                const std::vector<double> &row) {
+  double res = row[0] - coef[0];
+  for (size_t c = 1; c < row.size(); ++c) {
+    res -= coef[c] * row[c];
+  }
+  return res;
+}
+
+// y, x1..xk 的输入节点与其上的回归节点
+struct OlsTree {
+  InitArgsPtr config;
+  std::vector<std::shared_ptr<InputOp>> inputs;
+  std::vector<Arg> args;
+  RequestIdx next_idx = 1;
+  OperatorId next_id = kK + 1;
+
+  OlsTree(size_t nstock, size_t threads)
+      : config(std::make_shared<InitArgs>(nstock)) {
+    auto context = GetTreeContext(config);
+    context->cs_parallel_threads = threads;
+    context->cs_parallel_threshold = 1;
+    for (size_t c = 0; c <= kK; ++c) {
+      auto input = std::make_shared<InputOp>(
+          c == 0 ? "@y" : "@x" + std::to_string(c),
+          OpInitArgs{OperatorId(c), config});
+      inputs.push_back(input);
+      args.push_back(Arg(OperatorPtr(input)));
+    }
+  }
+
+  template <typename Op> OperatorPtr Add(std::vector<Arg> params) {
+    std::vector<Arg> all = args;
+    all.insert(all.end(), params.begin(), params.end());
+    return Op::Create(all, OpInitArgs{next_id++, config});
+  }
+
+  //   cols[c]为第c个输入的截面
+  void Feed(const std::vector<Tensor> &cols) {
+    for (size_t c = 0; c <= kK; ++c) {
+      inputs[c]->Feed(next_idx, cols[c]);
+    }
+    ++next_idx;
+  }
+};
+
+// y = 1 + 2 * x1 - x2 + 噪声, x在100附近, 约1/10的值为nan
+std::vector<Tensor> RandomCols(size_t n, std::mt19937 &gen) {
+  std::normal_distribution<double> dist(0.0, 1.0);
+  std::vector<Tensor> cols(kK + 1, Tensor::from_shape({n}));
+  for (size_t i = 0; i < n; ++i) {
+    cols[1](i) = 100.0 + dist(gen);
+    cols[2](i) = 100.0 + dist(gen);
+    cols[0](i) = 1.0 + 2.0 * cols[1](i) - cols[2](i) + 0.1 * dist(gen);
+    for (size_t c = 0; c <= kK; ++c) {
+      if (gen() % 30 == 0) {
+        cols[c](i) = kNaN;
+      }
+    }
+  }
+  return cols;
+}
+
+std::vector<double> Row(const std::vector<Tensor> &cols, size_t i) {
+  std::vector<double> row;
+  for (const auto &col : cols) {
+    row.push_back(col(i));
+  }
+  return row;
+}
+
+bool RowValid(const std::vector<double> &row) {
+  for (double v : row) {
+    if (std::isnan(v)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Tensor BruteCsResidual(const std::vector<Tensor> &cols) {
+  const size_t n = cols[0].size();
+  std::vector<std::vector<double>> rows;
+  for (size_t i = 0; i < n; ++i) {
+    if (RowValid(Row(cols, i))) {
+      rows.push_back(Row(cols, i));
+    }
+  }
+  auto out = Tensor::from_shape({n});
+  auto coef = rows.size() > kK ? BruteOLS(rows) : std::vector<double>{};
+  for (size_t i = 0; i < n; ++i) {
+    auto row = Row(cols, i);
+    out(i) = coef.empty() || !RowValid(row) ? kNaN : Residual(coef, row);
+  }
+  return out;
+}
+
+TEST(CsOLSResKTest, SerialAndParallelMatchBruteForce) {
+  const size_t n = 2 * kCsBlockSize + 333;
+  OlsTree serial(n, 1);
+  OlsTree parallel(n, 4);
+  auto serial_op = serial.Add<CsOLSResK>({});
+  auto parallel_op = parallel.Add<CsOLSResK>({});
+  std::mt19937 gen(31);
+  for (int batch = 0; batch < 3; ++batch) {
+    auto cols = RandomCols(n, gen);
+    serial.Feed(cols);
+    parallel.Feed(cols);
+    auto result = serial_op->GetResult(serial.next_idx - 1).GetTensor();
+    SCOPED_TRACE("batch " + std::to_string(batch));
+    ExpectSameValues(BruteCsResidual(cols), result, 1e-8);
+    ExpectSameValues(
+        result, parallel_op->GetResult(parallel.next_idx - 1).GetTensor());
+  }
+}
+
+// 有效行不多于k个, 或x2是x1的线性变换时为nan
+TEST(CsOLSResKTest, DegenerateCrossSections) {
+  OlsTree tree(5, 1);
+  auto op = tree.Add<CsOLSResK>({});
+  Tensor all_nan = {kNaN, kNaN, kNaN, kNaN, kNaN};
+  tree.Feed({Tensor{1.0, 2.0, 3.0, 4.0, 5.0},
+             Tensor{1.0, kNaN, 2.0, 7.0, kNaN},
+             Tensor{3.0, 1.0, 5.0, kNaN, 2.0}});
+  ExpectSameValues(all_nan, op->GetResult(1).GetTensor());
+  tree.Feed({Tensor{1.0, 2.0, 3.0, 4.0, 5.0}, Tensor{1.0, 2.0, 4.0, 7.0, 8.0},
+             Tensor{3.0, 5.0, 9.0, 15.0, 17.0}});
+  ExpectSameValues(all_nan, op->GetResult(2).GetTensor());
+}
+
+// 每个标的保存最近window行, 窗口满且全部有效时直接回归
+struct BruteTsOls {
+  size_t window;
+  std::vector<std::deque<std::vector<double>>> history;
+
+  BruteTsOls(size_t window, size_t nstock)
+      : window(window), history(nstock) {}
+
+  //   返回每个标的的 (a, b1..bk), 不可计算时为空
+  std::vector<std::vector<double>> Push(const std::vector<Tensor> &cols) {
+    std::vector<std::vector<double>> coefs;
+    for (size_t i = 0; i < history.size(); ++i) {
+      auto &rows = history[i];
+      rows.push_back(Row(cols, i));
+      if (rows.size() > window) {
+        rows.pop_front();
+      }
+      bool valid = rows.size() == window;
+      for (const auto &row : rows) {
+        valid = valid && RowValid(row);
+      }
+      coefs.push_back(valid ? BruteOLS({rows.begin(), rows.end()})
+                            : std::vector<double>{});
+    }
+    return coefs;
+  }
+};
+
+// 窗口内的值远大于波动, 检验参考值平移; 运行多个窗口, 经过多次重算
+// 标的0偶尔有nan, 标的1的x2与x1共线
+TEST(TsOlsKTest, MatchesBruteForce) {
+  const size_t nstock = 6;
+  const size_t window = 8;
+  OlsTree tree(nstock, 1);
+  auto res = tree.Add<TsOLSResK>({Arg(int(window))});
+  auto alpha = tree.Add<TsOLSAlphaK>({Arg(int(window))});
+  auto beta1 = tree.Add<TsOLSBetaK>({Arg(1), Arg(int(window))});
+  auto beta2 = tree.Add<TsOLSBetaK>({Arg(2), Arg(int(window))});
+  BruteTsOls brute(window, nstock);
+  std::mt19937 gen(41);
+  std::normal_distribution<double> dist(0.0, 1.0);
+  for (size_t step = 0; step < 6 * window; ++step) {
+    std::vector<Tensor> cols(kK + 1, Tensor::from_shape({nstock}));
+    for (size_t i = 0; i < nstock; ++i) {
+      const double level = 1e4 * static_cast<double>(i + 1);
+      cols[1](i) = level + dist(gen);
+      cols[2](i) = i == 1 ? 3.0 * cols[1](i) - 2.0 : level + dist(gen);
+      cols[0](i) = 0.5 * cols[1](i) + 2.0 * cols[2](i) + dist(gen);
+    }
+    if (step % 11 == 3) {
+      cols[gen() % (kK + 1)](0) = kNaN;
+    }
+    tree.Feed(cols);
+    const RequestIdx idx = tree.next_idx - 1;
+    auto coefs = brute.Push(cols);
+    auto expected_res = Tensor::from_shape({nstock});
+    auto expected_alpha = Tensor::from_shape({nstock});
+    auto expected_beta1 = Tensor::from_shape({nstock});
+    auto expected_beta2 = Tensor::from_shape({nstock});
+    for (size_t i = 0; i < nstock; ++i) {
+      const auto &coef = coefs[i];
+      expected_res(i) = coef.empty() ? kNaN : Residual(coef, Row(cols, i));
+      expected_alpha(i) = coef.empty() ? kNaN : coef[0];
+      expected_beta1(i) = coef.empty() ? kNaN : coef[1];
+      expected_beta2(i) = coef.empty() ? kNaN : coef[2];
+    }
+    SCOPED_TRACE("step " + std::to_string(step));
+    ExpectSameValues(expected_res, res->GetResult(idx).GetTensor(), 1e-6);
+    ExpectSameValues(expected_alpha, alpha->GetResult(idx).GetTensor(), 1e-4);
+    ExpectSameValues(expected_beta1, beta1->GetResult(idx).GetTensor(), 1e-8);
+    ExpectSameValues(expected_beta2, beta2->GetResult(idx).GetTensor(), 1e-8);
+  }
+}
+
+TEST(TsOlsKTest, RejectsBadArguments) {
+  OlsTree tree(2, 1);
+  EXPECT_THROW(tree.Add<TsOLSResK>({Arg(0)}), std::invalid_argument);
+  EXPECT_THROW(tree.Add<TsOLSBetaK>({Arg(3), Arg(5)}), std::invalid_argument);
+  EXPECT_THROW(TsOLSResK::Create({tree.args[0], Arg(5)},
+                                 OpInitArgs{50, tree.config}),
+               std::invalid_argument);
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,148 @@
+// OutputSink按rows_per_chunk切换分块, 最后未写满的分块改写文件头并截断,
+// 写出的文件可以用xt::load_npy读回; 后台落盘失败时由Close抛出
+#include "factor_tree/outputsink.h"
+
+#include <gtest/gtest.h>
+
+#include <xtensor/xnpy.hpp>
+#include <xtensor/xtensor.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+namespace fs = std::filesystem;
+
+constexpr size_t kNstock = 3;
+
+// 第r行为 (r, r + 0.5, r + 0.25)
+std::vector<double> Row(size_t r) {
+  const double x = static_cast<double>(r);
+  return {x, x + 0.5, x + 0.25};
+}
+
+class OutputSinkTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    dir_ = fs::path(::testing::TempDir()) /
+           ("output_sink_" + std::string(::testing::UnitTest::GetInstance()
+                                             ->current_test_info()
+                                             ->name()));
+    fs::remove_all(dir_);
+  }
+
+  void TearDown() override { fs::remove_all(dir_); }
+
+  std::string ChunkPath(const std::string &factor, size_t k) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%06zu.npy", k);
+    return (dir_ / factor / name).string();
+  }
+
+  //   第k块应为从first_row开始的rows行
+  void ExpectChunk(const std::string &factor, size_t k, size_t first_row,
+                   size_t rows) const {
+    const std::string path = ChunkPath(factor, k);
+    SCOPED_TRACE(path);
+    EXPECT_EQ(fs::file_size(path),
+              kNpyHeaderSize + rows * kNstock * sizeof(double));
+    auto values = xt::load_npy<double>(path);
+    ASSERT_EQ(values.shape(), (std::vector<size_t>{rows, kNstock}));
+    for (size_t r = 0; r < rows; ++r) {
+      auto row = Row(first_row + r);
+      for (size_t i = 0; i < kNstock; ++i) {
+        EXPECT_EQ(values(r, i), row[i]);
+      }
+    }
+  }
+
+  fs::path dir_;
+};
+
+TEST_F(OutputSinkTest, RollsOverAndTruncatesLastChunk) {
+  OutputSink sink(dir_.string(), kNstock, 4);
+  for (size_t r = 0; r < 10; ++r) {
+    sink.Append("alpha", Row(r).data(), kNstock);
+  }
+  for (size_t r = 0; r < 8; ++r) {
+    sink.Append("beta", Row(r).data(), kNstock);
+  }
+  sink.Close();
+  ExpectChunk("alpha", 0, 0, 4);
+  ExpectChunk("alpha", 1, 4, 4);
+  ExpectChunk("alpha", 2, 8, 2);
+  EXPECT_FALSE(fs::exists(ChunkPath("alpha", 3)));
+  //   行数正好是分块的整数倍时没有空的分块
+  ExpectChunk("beta", 0, 0, 4);
+  ExpectChunk("beta", 1, 4, 4);
+  EXPECT_FALSE(fs::exists(ChunkPath("beta", 2)));
+}
+
+TEST_F(OutputSinkTest, FinishPartialChunk) {
+  fs::create_directories(dir_ / "direct");
+  NpyChunk chunk(ChunkPath("direct", 0), 5, kNstock);
+  EXPECT_EQ(fs::file_size(ChunkPath("direct", 0)),
+            kNpyHeaderSize + 5 * kNstock * sizeof(double));
+  for (size_t r = 0; r < 2; ++r) {
+    auto row = Row(r);
+    std::copy(row.begin(), row.end(), chunk.Row(r));
+  }
+  chunk.Finish(2);
+  ExpectChunk("direct", 0, 0, 2);
+}
+
+TEST_F(OutputSinkTest, RejectsBadInput) {
+  EXPECT_THROW(OutputSink(dir_.string(), kNstock, 0), std::invalid_argument);
+  OutputSink sink(dir_.string(), kNstock, 4);
+  std::vector<double> short_row{1.0, 2.0};
+  EXPECT_THROW(sink.Append("alpha", short_row.data(), short_row.size()),
+               std::invalid_argument);
+  sink.Close();
+  EXPECT_THROW(sink.Append("alpha", Row(0).data(), kNstock),
+               std::runtime_error);
+}
+
+// 落盘失败的分块
+class FailingChunk : public NpyChunk {
+public:
+  using NpyChunk::NpyChunk;
+
+  void Finish(size_t rows) override {
+    NpyChunk::Finish(rows);
+    throw std::runtime_error("disk full");
+  }
+};
+
+class FailingSink : public OutputSink {
+public:
+  using OutputSink::OutputSink;
+
+protected:
+  std::unique_ptr<NpyChunk> NewChunk(const std::string &filename) override {
+    return std::make_unique<FailingChunk>(filename, 2, kNstock);
+  }
+};
+
+// 后台线程中的异常由Close抛出, Close之后析构不再抛出
+TEST_F(OutputSinkTest, SurfacesFlushError) {
+  FailingSink sink(dir_.string(), kNstock, 2);
+  for (size_t r = 0; r < 3; ++r) {
+    sink.Append("alpha", Row(r).data(), kNstock);
+  }
+  try {
+    sink.Close();
+    FAIL() << "Close should rethrow the flush error";
+  } catch (const std::runtime_error &e) {
+    EXPECT_STREQ(e.what(), "disk full");
+  }
+}
+
+} // namespace
+} // namespace factor_tree
@@ -0,0 +1,47 @@
+// 计划文件保存后按PlanFile读出的节点和参数与表达式一致
+#include "factor_tree/plan.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace factor_tree {
+namespace {
+
+std::string ArgString(const PlanFile &plan, const PlanArg &arg) {
+  return std::string(plan.Strings() + arg.offset, arg.size);
+}
+
+TEST(PlanTest, RoundTripWithEmptyString) {
+  const std::string filename = ::testing::TempDir() + "test.plan";
+  PlanCompiler compiler("test");
+  compiler.AddExpression("cs_group(add(@x,@x),\"\",ind,3,0.5)");
+  compiler.Save(filename);
+
+  PlanFile plan(filename, "test");
+  //   @x, add, cs_group, 共享的@x只保留一个节点
+  ASSERT_EQ(plan.Header().node_count, 3u);
+  ASSERT_EQ(plan.Header().root_count, 1u);
+  const PlanNode &root = plan.Nodes()[plan.Roots()[0]];
+  EXPECT_EQ(std::string(plan.Strings() + root.name_offset, root.name_size),
+            "cs_group");
+  ASSERT_EQ(root.arg_count, 5u);
+  const PlanArg *args = plan.Args() + root.first_arg;
+  EXPECT_EQ(args[0].type, static_cast<uint32_t>(ArgType::Operator));
+  EXPECT_EQ(args[1].type, static_cast<uint32_t>(ArgType::String));
+  EXPECT_EQ(ArgString(plan, args[1]), "\"\"");
+  EXPECT_EQ(ArgString(plan, args[2]), "ind");
+  EXPECT_EQ(args[3].integer, 3);
+  EXPECT_EQ(args[4].real, 0.5);
+}
+
+TEST(PlanTest, RejectsDifferentTag) {
+  const std::string filename = ::testing::TempDir() + "tag.plan";
+  PlanCompiler compiler("v1");
+  compiler.AddExpression("add(@x,@y)");
+  compiler.Save(filename);
+  EXPECT_THROW(PlanFile(filename, "v2"), std::runtime_error);
+}
+
+} // namespace
+} // namespace factor_tree
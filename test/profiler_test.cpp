@@ -0,0 +1,122 @@
+// 耗时直方图的分档、上界和分位数; 统计开关在运行期生效, 报告按树筛选
+#include "factor_tree/operators/mathoperator.h"
+#include "factor_tree/profiler.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::MathAdd;
+using testing::InputOp;
+
+// [0, 8)每个值一档; 之后每档的上界不小于档内的值, 相对误差不超过25%
+TEST(LatencyHistogramTest, IndexAndUpperBound) {
+  for (uint64_t ns = 0; ns < 8; ++ns) {
+    EXPECT_EQ(LatencyHistogram::Index(ns), ns);
+    EXPECT_EQ(LatencyHistogram::UpperBound(ns), ns);
+  }
+  //   8, 9 | 10, 11 | 12, 13 | 14, 15 | 16..19
+  EXPECT_EQ(LatencyHistogram::Index(9), 8u);
+  EXPECT_EQ(LatencyHistogram::Index(10), 9u);
+  EXPECT_EQ(LatencyHistogram::Index(15), 11u);
+  EXPECT_EQ(LatencyHistogram::Index(16), 12u);
+  EXPECT_EQ(LatencyHistogram::UpperBound(8), 9u);
+  EXPECT_EQ(LatencyHistogram::UpperBound(12), 19u);
+
+  size_t last = 0;
+  for (uint64_t ns = 1; ns < (uint64_t(1) << 40); ns = ns * 5 / 4 + 1) {
+    const size_t i = LatencyHistogram::Index(ns);
+    ASSERT_LT(i, LatencyHistogram::kBuckets);
+    EXPECT_GE(i, last);
+    last = i;
+    EXPECT_GE(LatencyHistogram::UpperBound(i), ns);
+    EXPECT_LT(LatencyHistogram::UpperBound(i - 1), ns);
+    EXPECT_LE(static_cast<double>(LatencyHistogram::UpperBound(i) - ns),
+              0.25 * static_cast<double>(ns));
+  }
+  const uint64_t max = std::numeric_limits<uint64_t>::max();
+  const size_t top = LatencyHistogram::Index(max);
+  EXPECT_LT(top, LatencyHistogram::kBuckets);
+  EXPECT_EQ(LatencyHistogram::UpperBound(top), max);
+}
+
+// 1..100各一个样本, 分位数为第ceil(q * 100)个样本所在档的上界
+TEST(LatencyHistogramTest, Quantile) {
+  LatencyHistogram::Counts counts{};
+  EXPECT_EQ(LatencyHistogram::Quantile(counts, 0.99), 0u);
+  LatencyHistogram histogram;
+  for (uint64_t ns = 1; ns <= 100; ++ns) {
+    histogram.Add(ns);
+  }
+  histogram.MergeInto(counts);
+  auto bound = [](uint64_t ns) {
+    return LatencyHistogram::UpperBound(LatencyHistogram::Index(ns));
+  };
+  EXPECT_EQ(LatencyHistogram::Quantile(counts, 0.0), 1u);
+  EXPECT_EQ(LatencyHistogram::Quantile(counts, 0.5), bound(50));
+  EXPECT_EQ(LatencyHistogram::Quantile(counts, 0.99), bound(99));
+  EXPECT_EQ(LatencyHistogram::Quantile(counts, 1.0), bound(100));
+}
+
+// add(@x, @y)的单节点树, 每棵树有自己的InitArgs
+struct AddTree {
+  InitArgsPtr config = std::make_shared<InitArgs>(3);
+  std::shared_ptr<InputOp> x;
+  std::shared_ptr<InputOp> y;
+  OperatorPtr root;
+  RequestIdx next_idx = 1;
+
+  AddTree() {
+    x = std::make_shared<InputOp>("@x", OpInitArgs{0, config});
+    y = std::make_shared<InputOp>("@y", OpInitArgs{1, config});
+    OperatorPtr left = x;
+    OperatorPtr right = y;
+    root = MathAdd::Create({Arg(left), Arg(right)}, OpInitArgs{2, config});
+  }
+
+  void Step() {
+    x->Feed(next_idx, Tensor{1.0, 2.0, 3.0});
+    y->Feed(next_idx, Tensor{4.0, 5.0, 6.0});
+    root->GetResult(next_idx++);
+  }
+};
+
+TEST(OpProfilerTest, RuntimeSwitchAndTreeFilter) {
+  auto &profiler = OpProfiler::Instance();
+  profiler.Reset();
+  AddTree first;
+  AddTree second;
+  first.Step();
+  EXPECT_TRUE(profiler.Report(0, first.config.get()).empty());
+
+  profiler.SetEnabled(true);
+  for (int step = 0; step < 3; ++step) {
+    first.Step();
+  }
+  second.Step();
+  profiler.SetEnabled(false);
+  first.Step();
+
+  auto report = profiler.Report(0, first.config.get());
+  ASSERT_EQ(report.size(), 1u);
+  EXPECT_EQ(report[0].op_id, 2u);
+  EXPECT_EQ(report[0].expression, "add(@x,@y)");
+  EXPECT_EQ(report[0].count, 3u);
+  EXPECT_EQ(report[0].bytes, 3 * 3 * 3 * sizeof(double));
+  EXPECT_FALSE(report[0].inclusive);
+  ASSERT_EQ(profiler.Report(0, second.config.get()).size(), 1u);
+  EXPECT_EQ(profiler.Report(0, second.config.get())[0].count, 1u);
+  EXPECT_EQ(profiler.Report().size(), 2u);
+  profiler.Reset();
+}
+
+} // namespace
+} // namespace factor_tree
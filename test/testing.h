@@ -0,0 +1,83 @@
+#pragma once
+
+#include "factor_tree/factortree.h"
+#include "factor_tree/operators/baseoperator.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace factor_tree {
+namespace testing {
+
+// 测试用的输入字段节点, 每个批次由Feed写入
+class InputOp : public BaseOperator {
+public:
+  InputOp(const std::string &name, const OpInitArgs &init_args)
+      : BaseOperator(init_args), name_(name) {}
+
+  OpOutput GetResult(RequestIdx idx) override {
+    return OpOutput(GetOpResultBuffer());
+  }
+
+  OperatorType GetType() const override { return OperatorType::Data; }
+
+  std::string ToString() const override { return name_; }
+
+  void Feed(RequestIdx idx, const Tensor &values) {
+    SetOpCache(idx, std::make_shared<Tensor>(values));
+  }
+
+private:
+  std::string name_;
+};
+
+// 两个结果逐元素相同, nan与nan视为相同
+inline void ExpectSameValues(const Tensor &expected, const Tensor &actual,
+                             double tolerance = 0.0) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    if (std::isnan(expected(i))) {
+      EXPECT_TRUE(std::isnan(actual(i))) << "at " << i;
+    } else {
+      EXPECT_NEAR(expected(i), actual(i), tolerance) << "at " << i;
+    }
+  }
+}
+
+// 两棵树输入相同的随机数据, 逐批次结果相同, 需要链接FactorTree
+// 每个字段的第0个标的全程为nan, 其余约1/3为nan
+inline void ExpectSameTrees(FactorTree &expected, FactorTree &actual,
+                            const std::vector<std::string> &fields,
+                            size_t nstock, size_t batch_per_day,
+                            size_t days = 3) {
+  std::mt19937 gen(11);
+  std::normal_distribution<double> dist(0.0, 1.0);
+  for (size_t day = 0; day < days; ++day) {
+    expected.OnDayBegin();
+    actual.OnDayBegin();
+    for (size_t batch = 0; batch < batch_per_day; ++batch) {
+      std::unordered_map<std::string, TensorPtr> data;
+      for (const auto &field : fields) {
+        auto x = std::make_shared<Tensor>(Tensor::from_shape({nstock}));
+        for (size_t i = 0; i < nstock; ++i) {
+          (*x)(i) = (i == 0 || gen() % 3 == 0) ? kNaN : dist(gen);
+        }
+        data.emplace(field, std::move(x));
+      }
+      SCOPED_TRACE(actual.ToString() + " day " + std::to_string(day) +
+                   " batch " + std::to_string(batch));
+      ExpectSameValues(*expected.Update(data), *actual.Update(data));
+    }
+    expected.OnDayEnd();
+    actual.OnDayEnd();
+  }
+}
+
+} // namespace testing
+} // namespace factor_tree
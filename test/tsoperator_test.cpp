@@ -0,0 +1,170 @@
+// 增量维护的时序状态与按窗口直接计算的结果相同, 包括nan输入和定期重算前后
+#include "factor_tree/operators/tsoperator.h"
+#include "testing.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+using header_ops::TsConcentState;
+using header_ops::TsTcorrState;
+using testing::ExpectSameValues;
+
+constexpr size_t kNstock = 5;
+constexpr double kTolerance = 1e-9;
+
+// 第t步的输入, 约1/6为nan, 第0个标的全程没有nan
+Tensor Step(std::mt19937 &gen, double scale) {
+  std::normal_distribution<double> dist(0.0, scale);
+  auto values = Tensor::from_shape({kNstock});
+  for (size_t i = 0; i < kNstock; ++i) {
+    values(i) = (i > 0 && gen() % 6 == 0) ? kNaN : dist(gen);
+  }
+  return values;
+}
+
+// 最近window步(不足时为全部)中第i个标的的观测
+std::vector<double> Window(const std::vector<Tensor> &history, size_t window,
+                           size_t i) {
+  size_t begin = history.size() > window ? history.size() - window : 0;
+  std::vector<double> xs;
+  for (size_t t = begin; t < history.size(); ++t) {
+    xs.push_back(history[t](i));
+  }
+  return xs;
+}
+
+double BruteTcorr(const std::vector<double> &xs, size_t window) {
+  if (xs.size() < window) {
+    return kNaN;
+  }
+  const double n = static_cast<double>(xs.size());
+  double mean_x = 0.0;
+  for (double x : xs) {
+    if (std::isnan(x)) {
+      return kNaN;
+    }
+    mean_x += x / n;
+  }
+  const double mean_t = (n - 1) / 2;
+  double cov = 0.0;
+  double var_x = 0.0;
+  double var_t = 0.0;
+  for (size_t k = 0; k < xs.size(); ++k) {
+    double dt = static_cast<double>(k) - mean_t;
+    double dx = xs[k] - mean_x;
+    cov += dt * dx;
+    var_x += dx * dx;
+    var_t += dt * dt;
+  }
+  double denom = std::sqrt(var_x * var_t);
+  //   与增量实现相同, 按n²倍的协方差和方差判断分母
+  return denom * n * n < kEpsilon ? kNaN : cov / denom;
+}
+
+double BruteConcent(const std::vector<double> &xs) {
+  double sum_abs = 0.0;
+  for (double x : xs) {
+    if (!std::isnan(x)) {
+      sum_abs += std::abs(x);
+    }
+  }
+  if (sum_abs < kEpsilon) {
+    return kNaN;
+  }
+  double result = 0.0;
+  for (double x : xs) {
+    if (!std::isnan(x)) {
+      result += (x / sum_abs) * (x / sum_abs);
+    }
+  }
+  return result;
+}
+
+template <typename State, typename BruteFn>
+void ExpectMatchesBruteForce(size_t window, size_t steps, double scale,
+                             BruteFn brute) {
+  auto config = std::make_shared<InitArgs>(kNstock);
+  State state(window, config);
+  std::mt19937 gen(static_cast<unsigned>(window));
+  std::vector<Tensor> history;
+  auto out = Tensor::from_shape({kNstock});
+  auto expected = Tensor::from_shape({kNstock});
+  for (size_t t = 0; t < steps; ++t) {
+    history.push_back(Step(gen, scale));
+    state.Update(history.back(), out);
+    for (size_t i = 0; i < kNstock; ++i) {
+      expected(i) = brute(Window(history, window, i), window);
+    }
+    SCOPED_TRACE("window " + std::to_string(window) + " step " +
+                 std::to_string(t));
+    ExpectSameValues(expected, out, kTolerance);
+  }
+}
+
+TEST(TsTcorrStateTest, MatchesBruteForce) {
+  for (size_t window : {1, 2, 3, 7, 20}) {
+    ExpectMatchesBruteForce<TsTcorrState>(window, 6 * window + 3, 1.0,
+                                          BruteTcorr);
+  }
+}
+
+TEST(TsConcentStateTest, MatchesBruteForce) {
+  for (size_t window : {1, 2, 3, 7, 20}) {
+    ExpectMatchesBruteForce<TsConcentState>(
+        window, 6 * window + 3, 1.0,
+        [](const std::vector<double> &xs, size_t) { return BruteConcent(xs); });
+  }
+}
+
+TEST(TsConcentStateTest, AllNanWindow) {
+  auto config = std::make_shared<InitArgs>(kNstock);
+  TsConcentState state(3, config);
+  auto x = Tensor::from_shape({kNstock});
+  auto out = Tensor::from_shape({kNstock});
+  std::fill(x.begin(), x.end(), 1.0);
+  state.Update(x, out);
+  std::fill(x.begin(), x.end(), kNaN);
+  for (int t = 0; t < 2; ++t) {
+    state.Update(x, out);
+    EXPECT_DOUBLE_EQ(out(0), 1.0);
+  }
+  //   唯一的有效值滑出窗口后为nan
+  state.Update(x, out);
+  EXPECT_TRUE(std::isnan(out(0)));
+}
+
+// 每window步重算一次滚动和, 重算的那一步之后累计值与从头求和完全相同
+TEST(RollingSumStateTest, RefreshBoundary) {
+  constexpr size_t kWindow = 4;
+  auto config = std::make_shared<InitArgs>(kNstock);
+  TsTcorrState state(kWindow, config);
+  std::mt19937 gen(7);
+  auto out = Tensor::from_shape({kNstock});
+  for (size_t t = 1; t <= 3 * kWindow; ++t) {
+    //   量级相差很大的输入, 不重算时抵消误差会一直累积
+    state.Update(Step(gen, t % 2 ? 1e8 : 1e-3), out);
+    EXPECT_EQ(state.steps_since_refresh, t % kWindow);
+    if (t % kWindow != 0) {
+      continue;
+    }
+    TsTcorrState fresh = state;
+    fresh.Refresh();
+    for (size_t i = 0; i < kNstock; ++i) {
+      EXPECT_EQ(state.sum_x[i], fresh.sum_x[i]) << "step " << t;
+      EXPECT_EQ(state.sum_xx[i], fresh.sum_xx[i]) << "step " << t;
+      EXPECT_EQ(state.sum_ix[i], fresh.sum_ix[i]) << "step " << t;
+      EXPECT_EQ(state.nan_count[i], fresh.nan_count[i]) << "step " << t;
+    }
+  }
+}
+
+} // namespace
+} // namespace factor_tree
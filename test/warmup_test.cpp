@@ -0,0 +1,146 @@
+// 历史数据目录的读取, 以及WarmUp按分块切分day_starts: 一天跨越分块时
+// 第0行的tidx接着上一块, 分块从新的一天开始时先收尾上一天
+#include "factor_tree/warmup.h"
+
+#include <gtest/gtest.h>
+
+#include <xtensor/xnpy.hpp>
+#include <xtensor/xtensor.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace factor_tree {
+namespace {
+
+namespace fs = std::filesystem;
+
+// 每个测试一个空的历史目录, 结束时删除
+class NpyHistoryTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    dir_ = fs::path(::testing::TempDir()) /
+           ("npy_history_" + std::string(::testing::UnitTest::GetInstance()
+                                             ->current_test_info()
+                                             ->name()));
+    fs::remove_all(dir_);
+    fs::create_directories(dir_);
+  }
+
+  void TearDown() override { fs::remove_all(dir_); }
+
+  std::string Path(const std::string &name) const {
+    return (dir_ / name).string();
+  }
+
+  //   rows x 2 的数组, 第r行为 (base + r, -(base + r))
+  static xt::xtensor<double, 2> Rows(size_t rows, double base) {
+    auto values = xt::xtensor<double, 2>::from_shape({rows, 2});
+    for (size_t r = 0; r < rows; ++r) {
+      values(r, 0) = base + static_cast<double>(r);
+      values(r, 1) = -values(r, 0);
+    }
+    return values;
+  }
+
+  void DumpDayStarts(const std::vector<int64_t> &starts) {
+    xt::dump_npy(Path(NpyHistory::kDayStartsFile),
+                 xt::xtensor<int64_t, 1>(xt::adapt(starts)));
+  }
+
+  fs::path dir_;
+};
+
+TEST_F(NpyHistoryTest, ReadsChunkedFields) {
+  for (const char *field : {"x", "y"}) {
+    fs::create_directories(Path(field));
+    xt::dump_npy(Path(std::string(field) + "/0.npy"), Rows(5, 0));
+    xt::dump_npy(Path(std::string(field) + "/1.npy"), Rows(4, 5));
+  }
+  DumpDayStarts({0, 3, 7});
+  NpyHistory history(dir_.string());
+  EXPECT_EQ(history.Fields(), (std::vector<std::string>{"x", "y"}));
+  EXPECT_EQ(history.NumChunks(), 2u);
+  EXPECT_EQ(history.NumRows(), 9u);
+  EXPECT_TRUE(history.HasDayStarts());
+  EXPECT_EQ(history.DayStarts(), (std::vector<size_t>{0, 3, 7}));
+  auto chunk = history.LoadChunk(1);
+  ASSERT_EQ(chunk.size(), 2u);
+  EXPECT_EQ(chunk[0], Rows(4, 5));
+  EXPECT_EQ(chunk[1], Rows(4, 5));
+}
+
+// 没有day_starts.npy时整段历史是同一天
+TEST_F(NpyHistoryTest, MissingDayStarts) {
+  xt::dump_npy(Path("x.npy"), Rows(6, 0));
+  NpyHistory history(dir_.string());
+  EXPECT_FALSE(history.HasDayStarts());
+  EXPECT_EQ(history.DayStarts(), (std::vector<size_t>{0}));
+  EXPECT_EQ(history.NumRows(), 6u);
+}
+
+// float32的字段按double读入, 值不变
+TEST_F(NpyHistoryTest, ReadsFloat32) {
+  xt::xtensor<float, 2> values = {{1.5f, -2.25f}, {0.125f, 3.0f}};
+  xt::dump_npy(Path("x.npy"), values);
+  auto chunk = NpyHistory(dir_.string()).LoadChunk(0);
+  xt::xtensor<double, 2> expected = {{1.5, -2.25}, {0.125, 3.0}};
+  EXPECT_EQ(chunk[0], expected);
+}
+
+TEST_F(NpyHistoryTest, RejectsBadDayStarts) {
+  xt::dump_npy(Path("x.npy"), Rows(6, 0));
+  DumpDayStarts({0, 3, 3});
+  EXPECT_THROW(NpyHistory(dir_.string()), std::invalid_argument);
+  DumpDayStarts({1, 3});
+  EXPECT_THROW(NpyHistory(dir_.string()), std::invalid_argument);
+}
+
+// day_starts = {0, 3, 7}, 分块为5、4、3行: 第二天跨越前两块, 第三天跨越后两块
+TEST(ChunkDaySplitterTest, DaysSpanChunks) {
+  ChunkDaySplitter splitter({0, 3, 7});
+  auto first = splitter.Next(5);
+  EXPECT_EQ(first.day_starts, (std::vector<size_t>{0, 3}));
+  EXPECT_FALSE(first.close_previous);
+  auto second = splitter.Next(4);
+  EXPECT_EQ(second.day_starts, (std::vector<size_t>{2}));
+  EXPECT_EQ(second.first_tidx, 2u);
+  EXPECT_FALSE(second.close_previous);
+  auto third = splitter.Next(3);
+  EXPECT_TRUE(third.day_starts.empty());
+  EXPECT_EQ(third.first_tidx, 2u);
+  EXPECT_EQ(splitter.Rows(), 12u);
+  EXPECT_EQ(splitter.Days(), 3u);
+  EXPECT_NO_THROW(splitter.Finish());
+}
+
+// 分块恰好从新的一天开始时先收尾上一天
+TEST(ChunkDaySplitterTest, ChunkStartsNewDay) {
+  ChunkDaySplitter splitter({0, 5});
+  EXPECT_FALSE(splitter.Next(5).close_previous);
+  auto second = splitter.Next(5);
+  EXPECT_EQ(second.day_starts, (std::vector<size_t>{0}));
+  EXPECT_TRUE(second.close_previous);
+}
+
+// 没有day_starts.npy时只有第0行换日, 之后各块的tidx接着累加
+TEST(ChunkDaySplitterTest, SingleDay) {
+  ChunkDaySplitter splitter({0});
+  EXPECT_EQ(splitter.Next(4).day_starts, (std::vector<size_t>{0}));
+  auto second = splitter.Next(4);
+  EXPECT_TRUE(second.day_starts.empty());
+  EXPECT_EQ(second.first_tidx, 4u);
+  EXPECT_EQ(splitter.Next(4).first_tidx, 8u);
+}
+
+TEST(ChunkDaySplitterTest, RejectsDayStartsPastTheEnd) {
+  ChunkDaySplitter splitter({0, 20});
+  splitter.Next(12);
+  EXPECT_THROW(splitter.Finish(), std::invalid_argument);
+}
+
+} // namespace
+} // namespace factor_tree